@@ -0,0 +1,390 @@
+#pragma once
+
+#include <ros/ros.h>
+#include <tf_conversions/tf_eigen.h>
+#include <std_srvs/Empty.h>
+#include <geometry_msgs/Twist.h>
+
+#include <Eigen/Dense>
+
+#include <memory>
+
+#include <crazyflie_controller/ExecuteTrajectoryAction.h>
+#include <actionlib/server/simple_action_server.h>
+
+#include <crazyflie_driver/GenericLogData.h>
+
+
+#include "pid.hpp"
+#include "trajectory_sampler.hpp"
+#include "transform_cache.hpp"
+
+inline double get(
+    const ros::NodeHandle& n,
+    const std::string& name) {
+    double value;
+    n.getParam(name, value);
+    return value;
+}
+
+// Controller of one Crazyflie (index in transformCache and pidsYaw, which
+// are shared by all controllers of a node). A tick is split in two, so that
+// the yaw PIDs of all controllers can be updated in one pass in between:
+// update() computes the command (and sets the input of the yaw PID),
+// publish() sends it.
+// Callbacks run on the spin thread; ticks may run on other threads, as long
+// as the spin thread waits for them.
+class Controller
+{
+public:
+
+    Controller(
+        const ros::NodeHandle& n,
+        ros::NodeHandle& nh,
+        const std::string& stabilizerTopic,
+        TransformCache& transformCache,
+        PIDBatch& pidsYaw,
+        size_t index)
+        : m_transformCache(transformCache)
+        , m_pidsYaw(pidsYaw)
+        , m_index(index)
+        , m_pubNav()
+        , m_state(Idle)
+        , m_subscribeStabilizer()
+        // , m_goal()
+        // , m_subscribeGoal()
+        , m_serviceTakeoff()
+        , m_serviceLand()
+        , m_actionServerExecuteTrajectory()
+        , m_thrust(0)
+        , m_kp(get(n, "PIDs/Body/kp"))
+        , m_kd(get(n, "PIDs/Body/kd"))
+        , m_ki(get(n, "PIDs/Body/ki"))
+        , m_oldPosition(0,0,0)
+        , m_current_r_error_integration(0,0,0)
+        , m_massThrust(get(n, "MassThrust"))
+        , m_maxAngle(get(n, "MaxAngle"))
+        , m_mass(get(n, "mass"))
+        , m_sampler()
+        , m_roll(0)
+        , m_pitch(0)
+        , m_yaw(0)
+        , m_command()
+        , m_hasCommand(false)
+        , m_usesPidYaw(false)
+    {
+        m_pubNav = nh.advertise<geometry_msgs::Twist>("cmd_vel", 1);
+        // m_subscribeGoal = nh.subscribe("goal", 1, &Controller::goalChanged, this);
+        // ToDo switch to actions!
+        m_serviceTakeoff = nh.advertiseService("takeoff", &Controller::takeoff, this);
+        m_serviceLand = nh.advertiseService("land", &Controller::land, this);
+        // m_serviceGoTo = nh.advertiseService("go_to", &Controller::go_to, this);
+
+        m_subscribeStabilizer = nh.subscribe(stabilizerTopic, 1, &Controller::stabilizerChanged, this);
+
+        // goals are handled on the spin thread (no thread per action server)
+        m_actionServerExecuteTrajectory.reset(new actionlib::SimpleActionServer<crazyflie_controller::ExecuteTrajectoryAction>(
+            nh, "execute_trajectory", false));
+        m_actionServerExecuteTrajectory->registerGoalCallback(
+            std::bind(&Controller::executeTrajectory, this));
+        m_actionServerExecuteTrajectory->start();
+    }
+
+    // First part of a tick: computes the command
+    void update(float dt)
+    {
+        m_hasCommand = false;
+        m_usesPidYaw = false;
+
+        switch(m_state)
+        {
+        case TakingOff:
+            {
+                tf::StampedTransform transform;
+                m_transformCache.lookup(m_index, transform);
+                if (transform.getOrigin().z() > 0.05 || m_thrust > 50000)
+                {
+                    pidReset();
+                    m_state = Automatic;
+                    m_thrust = 0;
+                    setHoverTrajectory(0.5);
+                    return;
+                }
+                else
+                {
+                    m_thrust += 10000 * dt;
+                    m_command = geometry_msgs::Twist();
+                    m_command.linear.z = m_thrust;
+                }
+
+            }
+            break;
+        case Landing:
+            {
+                // m_goal.pose.position.z = 0.05;
+                setHoverTrajectory(0.05);
+
+                tf::StampedTransform transform;
+                m_transformCache.lookup(m_index, transform);
+                if (transform.getOrigin().z() <= 0.05) {
+                    m_state = Idle;
+                    geometry_msgs::Twist msg;
+                    m_pubNav.publish(msg);
+                }
+            }
+            // intentional fall-thru
+        case Automatic:
+            {
+                tf::StampedTransform tf_transform;
+                m_transformCache.lookup(m_index, tf_transform);
+
+                // CURRENT STATES
+                Eigen::Affine3d transform;
+                tf::transformTFToEigen(tf_transform, transform);
+
+                // Current position
+                Eigen::Vector3d current_position = transform.translation();
+
+                // Current velocity
+                Eigen::Vector3d current_velocity = (current_position - m_oldPosition) / dt;
+                m_oldPosition = current_position;
+
+                // Current Orientation
+                // see m_roll, m_pitch, m_yaw
+
+                // Current angular velocity
+                //Eigen::Vector3d current_angular_velocity(
+                //    m_imu.angular_velocity.x,
+                //    m_imu.angular_velocity.y,
+                //    m_imu.angular_velocity.z
+                //);
+
+                //DESIRED STATES
+                crazyflie_controller::QuadcopterTrajectoryPoint trajectoryPoint;
+                getCurrentTrajectoryPoint(trajectoryPoint);
+
+                // Desired position
+                Eigen::Vector3d target_position(
+                    trajectoryPoint.position.x,
+                    trajectoryPoint.position.y,
+                    trajectoryPoint.position.z);
+
+                //Desired velocity
+                Eigen::Vector3d target_velocity(
+                    trajectoryPoint.velocity.x,
+                    trajectoryPoint.velocity.y,
+                    trajectoryPoint.velocity.z);
+
+                //Desired acceleration
+                Eigen::Vector3d target_acceleration(
+                    trajectoryPoint.acceleration.x,
+                    trajectoryPoint.acceleration.y,
+                    trajectoryPoint.acceleration.z);
+
+                //Desired yaw
+                double target_yaw = trajectoryPoint.yaw;
+
+                // set this to 0 because we don't want to rotate during the flight
+                Eigen::Vector3d target_angular_velocity(0, 0, 0);
+
+
+                //CALCULATE THRUST
+
+                // Position Error
+                Eigen::Vector3d current_r_error = target_position - current_position;
+                // Velocity Error
+                Eigen::Vector3d current_v_error = target_velocity - current_velocity;
+                // Desired thrust
+                Eigen::Vector3d target_thrust = m_kp*current_r_error + m_kd*current_v_error + m_mass * target_acceleration + m_mass * Eigen::Vector3d(0,0,9.81);
+                // Current z_axis
+                Eigen::Vector3d current_z_axis( -sin(m_pitch)*cos(m_roll),
+                                            sin(m_roll),
+                                            cos(m_pitch)*cos(m_roll));
+                // Current thrust
+                double current_thrust = target_thrust.dot(current_z_axis) * m_massThrust;
+                ROS_DEBUG_THROTTLE(1.0, "thrust: %f", current_thrust);
+
+                // CALCULATE AXIS
+                // // Desired z_axis
+                Eigen::Vector3d z_axis_desired = target_thrust/target_thrust.norm();
+                // // Desired x_center_axis
+                // Eigen::Vector3d x_center_axis_desired = Eigen::Vector3d(sin(target_yaw), cos(target_yaw), 0);
+                // // Desired y_axis
+                // Eigen::Vector3d y_axis_desired = z_axis_desired.cross(x_center_axis_desired);
+                // // Desired x_axis
+                // Eigen::Vector3d x_axis_desired = y_axis_desired.cross(z_axis_desired);
+
+                Eigen::Vector3d x_axis_desired = z_axis_desired.cross(Eigen::Vector3d(sin(target_yaw), cos(target_yaw), 0));
+                //x_axis_desired.normalize();
+                Eigen::Vector3d y_axis_desired = z_axis_desired.cross(x_axis_desired);
+
+                // CONTROL
+
+
+                tfScalar current_euler_roll, current_euler_pitch, current_euler_yaw;
+                tf::Matrix3x3(tf_transform.getRotation()).getRPY(
+                    current_euler_roll,
+                    current_euler_pitch,
+                    current_euler_yaw);
+
+                double thrust = current_thrust;//z_axis_desired.dot(current_z_axis);
+                if (thrust < 0) {
+                    thrust = 0;
+                }
+                if (thrust > 65536) {
+                    thrust = 65536;
+                }
+
+                double pitch_angle = asin(x_axis_desired[2]) * 180.0 / M_PI;
+                double yaw_angle = target_yaw;
+                // double yaw_angle = atan2(x_axis_desired.getY(), x_axis_desired.getX());
+                double roll_angle = atan2(y_axis_desired[2], z_axis_desired[2]) * 180.0 / M_PI;
+
+                m_command = geometry_msgs::Twist();
+                m_command.linear.x = pitch_angle;
+                m_command.linear.y = -roll_angle;
+                m_command.linear.z = thrust;
+                // angular.z: output of the yaw PID
+                m_pidsYaw.setInput(m_index, current_euler_yaw, yaw_angle);
+                m_usesPidYaw = true;
+
+
+            }
+            break;
+        case Idle:
+            {
+                m_command = geometry_msgs::Twist();
+            }
+            break;
+        }
+        m_hasCommand = true;
+    }
+
+    // Second part of a tick, once the yaw PIDs are updated
+    void publish()
+    {
+        if (!m_hasCommand) {
+            return;
+        }
+        if (m_usesPidYaw) {
+            m_command.angular.z = m_pidsYaw.output(m_index);
+        }
+        m_pubNav.publish(m_command);
+    }
+
+private:
+    // void goalChanged(
+    //     const geometry_msgs::PoseStamped::ConstPtr& msg)
+    // {
+    //     m_goal = *msg;
+    // }
+
+    void stabilizerChanged(
+        const crazyflie_driver::GenericLogData::ConstPtr& msg)
+    {
+        m_roll = -msg->values[0] / 180 * M_PI;
+        m_pitch = msg->values[1] / 180 * M_PI;
+        m_yaw = msg->values[2] / 180 * M_PI;
+    }
+
+    bool takeoff(
+        std_srvs::Empty::Request& req,
+        std_srvs::Empty::Response& res)
+    {
+        ROS_INFO("Takeoff requested!");
+        m_state = TakingOff;
+
+        return true;
+    }
+
+    bool land(
+        std_srvs::Empty::Request& req,
+        std_srvs::Empty::Response& res)
+    {
+        ROS_INFO("Landing requested!");
+        m_state = Landing;
+
+        return true;
+    }
+
+    void executeTrajectory()
+    {
+        ROS_INFO("execute trajectory requested!");
+
+        // preempts the previous goal, if any
+        auto goal = m_actionServerExecuteTrajectory->acceptNewGoal();
+        m_sampler.setTrajectory(goal->trajectory);
+        // m_startTime = ros::Time::now();
+
+        // m_actionServerExecuteTrajectory->setSucceeded();
+    }
+
+    // Hovers at the given height, starting now
+    void setHoverTrajectory(
+        double z)
+    {
+        crazyflie_controller::QuadcopterTrajectory trajectory;
+        trajectory.header.stamp = ros::Time::now();
+        crazyflie_controller::QuadcopterTrajectoryPoint pt;
+        pt.position.z = z;
+        trajectory.points.push_back(pt);
+        m_sampler.setTrajectory(trajectory);
+    }
+
+    void getCurrentTrajectoryPoint(
+        crazyflie_controller::QuadcopterTrajectoryPoint& result)
+    {
+        ros::Duration d = ros::Time::now() - m_sampler.startTime();
+        m_sampler.sample(d.toSec(), result);
+    }
+
+    void pidReset()
+    {
+        m_current_r_error_integration = Eigen::Vector3d(0,0,0);
+        m_pidsYaw.reset(m_index);
+    }
+
+private:
+
+    enum State
+    {
+        Idle = 0,
+        Automatic = 1,
+        TakingOff = 2,
+        Landing = 3,
+    };
+
+private:
+    TransformCache& m_transformCache;
+    PIDBatch& m_pidsYaw;
+    size_t m_index;
+    ros::Publisher m_pubNav;
+    State m_state;
+    // geometry_msgs::PoseStamped m_goal;
+    // ros::Subscriber m_subscribeGoal;
+    ros::Subscriber m_subscribeStabilizer;
+    ros::ServiceServer m_serviceTakeoff;
+    ros::ServiceServer m_serviceLand;
+    std::unique_ptr<actionlib::SimpleActionServer<crazyflie_controller::ExecuteTrajectoryAction> > m_actionServerExecuteTrajectory;
+    float m_thrust;
+
+    double m_kp;
+    double m_kd;
+    double m_ki;
+    Eigen::Vector3d m_oldPosition;
+    Eigen::Vector3d m_current_r_error_integration;
+    double m_massThrust;
+    double m_maxAngle;
+    double m_mass;
+
+    TrajectorySampler m_sampler;
+
+    double m_roll;
+    double m_pitch;
+    double m_yaw;
+
+    // current command (angular.z is set in publish())
+    geometry_msgs::Twist m_command;
+    bool m_hasCommand;
+    bool m_usesPidYaw;
+};
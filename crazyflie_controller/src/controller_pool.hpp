@@ -0,0 +1,111 @@
+#pragma once
+
+#include <ros/ros.h>
+
+#include <memory>
+#include <string>
+#include <vector>
+#include <algorithm>
+
+#include <crazyflie_cpp/FrameWorkerPool.h>
+
+#include "controller.hpp"
+
+// Controllers of several Crazyflies in one node, ticked by a single timer.
+// They share one /tf subscription (TransformCache) and one PIDBatch for
+// their yaw PIDs. Each tick, every worker updates a contiguous range of
+// controllers, then the PIDs of that range in one pass, and publishes their
+// commands. Without workers, the tick runs on the spin thread.
+class ControllerPool
+{
+public:
+    // namespaces[i]: namespace of the topics and services of controller i
+    // (relative to the namespace of the node)
+    ControllerPool(
+        const std::string& worldFrame,
+        const std::vector<std::string>& frames,
+        const std::vector<std::string>& namespaces,
+        const std::string& stabilizerTopic,
+        const ros::NodeHandle& n,
+        size_t numWorkers)
+        : m_transformCache(worldFrame, frames)
+        , m_pidsYaw(
+            get(n, "PIDs/Yaw/kp"),
+            get(n, "PIDs/Yaw/kd"),
+            get(n, "PIDs/Yaw/ki"),
+            get(n, "PIDs/Yaw/minOutput"),
+            get(n, "PIDs/Yaw/maxOutput"),
+            get(n, "PIDs/Yaw/integratorMin"),
+            get(n, "PIDs/Yaw/integratorMax"),
+            "yaw",
+            true,
+            frames.size())
+        , m_controllers()
+        , m_workers()
+        , m_numRanges(std::max<size_t>(std::min(numWorkers, frames.size()), 1))
+        , m_dt(0)
+        , m_time(0)
+    {
+        for (size_t i = 0; i < frames.size(); ++i) {
+            ros::NodeHandle nh(namespaces[i]);
+            m_controllers.push_back(std::unique_ptr<Controller>(new Controller(
+                n, nh, stabilizerTopic, m_transformCache, m_pidsYaw, i)));
+        }
+        if (m_numRanges > 1) {
+            std::vector<std::function<void()> > jobs;
+            for (size_t r = 0; r < m_numRanges; ++r) {
+                jobs.push_back(std::bind(&ControllerPool::updateRange, this, r));
+            }
+            m_workers.start(jobs, std::vector<int>());
+        }
+    }
+
+    void run(double frequency)
+    {
+        ros::NodeHandle node;
+        ros::Timer timer = node.createTimer(ros::Duration(1.0/frequency), &ControllerPool::iteration, this);
+        ros::spin();
+    }
+
+private:
+    void iteration(const ros::TimerEvent& e)
+    {
+        m_dt = e.current_real.toSec() - e.last_real.toSec();
+        m_time = ros::Time::now().toSec();
+        if (m_workers.size() > 0) {
+            m_workers.run();
+        } else {
+            updateRange(0);
+        }
+    }
+
+    // Runs on worker r
+    void updateRange(size_t r)
+    {
+        size_t begin = m_controllers.size() * r / m_numRanges;
+        size_t end = m_controllers.size() * (r + 1) / m_numRanges;
+        for (size_t i = begin; i < end; ++i) {
+            try {
+                m_controllers[i]->update(m_dt);
+            }
+            catch(tf::TransformException& e) {
+                // no command for this controller in this tick
+                ROS_WARN_THROTTLE(1.0, "Controller %zu: %s", i, e.what());
+            }
+        }
+        m_pidsYaw.update(begin, end, m_time);
+        for (size_t i = begin; i < end; ++i) {
+            m_controllers[i]->publish();
+        }
+    }
+
+private:
+    TransformCache m_transformCache;
+    PIDBatch m_pidsYaw;
+    std::vector<std::unique_ptr<Controller> > m_controllers;
+    FrameWorkerPool m_workers;
+    size_t m_numRanges;
+    // of the current tick
+    float m_dt;
+    double m_time;
+};
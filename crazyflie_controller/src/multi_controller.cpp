@@ -0,0 +1,40 @@
+#include <ros/ros.h>
+
+#include <thread>
+
+#include "controller_pool.hpp"
+
+int main(int argc, char **argv)
+{
+  ros::init(argc, argv, "multi_controller");
+
+  // Read parameters
+  ros::NodeHandle n("~");
+  std::string worldFrame;
+  n.param<std::string>("worldFrame", worldFrame, "/world");
+  // frames of the Crazyflies; their topics and services are in a namespace
+  // of the same name, e.g. cf1/cmd_vel
+  std::vector<std::string> frames;
+  n.getParam("frames", frames);
+  double frequency;
+  n.param("frequency", frequency, 50.0);
+  // 0: one per core
+  int numWorkers;
+  n.param("num_workers", numWorkers, 0);
+  if (numWorkers <= 0) {
+    numWorkers = std::thread::hardware_concurrency();
+  }
+
+  ROS_INFO("Controlling %zu Crazyflies with %d workers", frames.size(), numWorkers);
+
+  ControllerPool controllers(
+    worldFrame,
+    frames,
+    frames,
+    "stabilizer",
+    n,
+    numWorkers);
+  controllers.run(frequency);
+
+  return 0;
+}
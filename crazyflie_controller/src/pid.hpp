@@ -2,6 +2,9 @@
 
 #include <ros/ros.h>
 
+#include <vector>
+#include <cstdint>
+
 class PID
 {
 public:
@@ -24,7 +27,7 @@ public:
         , m_integratorMax(integratorMax)
         , m_integral(0)
         , m_previousError(0)
-        , m_previousTime(ros::Time::now())
+        , m_previousTime(ros::Time::now().toSec())
         , m_isAngle(isAngle)
     {
     }
@@ -33,7 +36,7 @@ public:
     {
         m_integral = 0;
         m_previousError = 0;
-        m_previousTime = ros::Time::now();
+        m_previousTime = ros::Time::now().toSec();
     }
 
     void setIntegral(float integral)
@@ -48,8 +51,13 @@ public:
 
     float update(float value, float targetValue)
     {
-        ros::Time time = ros::Time::now();
-        float dt = time.toSec() - m_previousTime.toSec();
+        return update(value, targetValue, ros::Time::now().toSec());
+    }
+
+    // time in s
+    float update(float value, float targetValue, double time)
+    {
+        float dt = time - m_previousTime;
         float error = targetValue - value;
         if (m_isAngle) {
             error = fmod(error + M_PI, 2 * M_PI) - M_PI;
@@ -84,6 +92,76 @@ private:
     float m_integratorMax;
     float m_integral;
     float m_previousError;
-    ros::Time m_previousTime;
+    double m_previousTime;
     bool m_isAngle;
 };
+
+// PIDs with the same gains for many controllers (one PID each). The
+// controllers set their input, then update() evaluates a range of them in
+// one pass (at one time). Different ranges can be updated on different
+// threads.
+class PIDBatch
+{
+public:
+    PIDBatch(
+        float kp,
+        float kd,
+        float ki,
+        float minOutput,
+        float maxOutput,
+        float integratorMin,
+        float integratorMax,
+        const std::string& name,
+        bool isAngle,
+        size_t size)
+        : m_pids(size, PID(kp, kd, ki, minOutput, maxOutput, integratorMin, integratorMax, name, isAngle))
+        , m_values(size, 0)
+        , m_targetValues(size, 0)
+        , m_outputs(size, 0)
+        , m_hasInput(size, 0)
+    {
+    }
+
+    size_t size() const
+    {
+        return m_pids.size();
+    }
+
+    void reset(size_t i)
+    {
+        m_pids[i].reset();
+    }
+
+    void setInput(size_t i, float value, float targetValue)
+    {
+        m_values[i] = value;
+        m_targetValues[i] = targetValue;
+        m_hasInput[i] = 1;
+    }
+
+    float output(size_t i) const
+    {
+        return m_outputs[i];
+    }
+
+    // Updates the PIDs in [begin, end) which got an input since their
+    // last update; time in s
+    void update(size_t begin, size_t end, double time)
+    {
+        for (size_t i = begin; i < end; ++i) {
+            if (!m_hasInput[i]) {
+                continue;
+            }
+            m_hasInput[i] = 0;
+            m_outputs[i] = m_pids[i].update(m_values[i], m_targetValues[i], time);
+        }
+    }
+
+private:
+    std::vector<PID> m_pids;
+    std::vector<float> m_values;
+    std::vector<float> m_targetValues;
+    std::vector<float> m_outputs;
+    // not std::vector<bool>: ranges are updated on different threads
+    std::vector<uint8_t> m_hasInput;
+};
@@ -0,0 +1,160 @@
+#pragma once
+
+#include <ros/ros.h>
+#include <crazyflie_controller/QuadcopterTrajectory.h>
+
+#include <vector>
+#include <algorithm>
+
+// Evaluates a QuadcopterTrajectory at the (mostly increasing) times of the
+// controller ticks. A cursor remembers the current segment, i.e. a sample
+// costs O(1) amortised instead of a scan from the start.
+// * points: position, velocity, acceleration and yaw are interpolated
+//   linearly between the points around t (before the first/after the last
+//   point, that point is used)
+// * polynomials (used if there are any): pieces of the given durations; the
+//   coefficients are in increasing powers of the time since the start of
+//   the piece. Velocity and acceleration are the derivatives.
+class TrajectorySampler
+{
+public:
+    TrajectorySampler()
+        : m_trajectory()
+        , m_times()
+        , m_cursor(0)
+    {
+    }
+
+    void setTrajectory(
+        const crazyflie_controller::QuadcopterTrajectory& trajectory)
+    {
+        m_trajectory = trajectory;
+        m_cursor = 0;
+        m_times.clear();
+        if (!m_trajectory.polynomials.empty()) {
+            // start time of each piece
+            double t = 0;
+            for (const auto& poly : m_trajectory.polynomials) {
+                m_times.push_back(t);
+                t += poly.duration.toSec();
+            }
+        } else {
+            for (const auto& pt : m_trajectory.points) {
+                m_times.push_back(pt.time_from_start.toSec());
+            }
+        }
+    }
+
+    const ros::Time& startTime() const
+    {
+        return m_trajectory.header.stamp;
+    }
+
+    // t: time since startTime() in s
+    void sample(
+        double t,
+        crazyflie_controller::QuadcopterTrajectoryPoint& result)
+    {
+        if (!m_trajectory.polynomials.empty()) {
+            samplePolynomials(t, result);
+        } else {
+            samplePoints(t, result);
+        }
+        result.time_from_start = ros::Duration(std::max(t, 0.0));
+    }
+
+private:
+    // m_cursor: the first point after t
+    void samplePoints(
+        double t,
+        crazyflie_controller::QuadcopterTrajectoryPoint& result)
+    {
+        const auto& points = m_trajectory.points;
+        if (points.empty()) {
+            result = crazyflie_controller::QuadcopterTrajectoryPoint();
+            return;
+        }
+        // time went backwards: search from the start
+        if (m_cursor > 0 && t < m_times[m_cursor - 1]) {
+            m_cursor = 0;
+        }
+        while (m_cursor < points.size() && m_times[m_cursor] <= t) {
+            ++m_cursor;
+        }
+        if (m_cursor == 0) {
+            result = points.front();
+            return;
+        }
+        if (m_cursor == points.size()) {
+            result = points.back();
+            return;
+        }
+
+        const auto& a = points[m_cursor - 1];
+        const auto& b = points[m_cursor];
+        double duration = m_times[m_cursor] - m_times[m_cursor - 1];
+        double u = duration > 0 ? (t - m_times[m_cursor - 1]) / duration : 1.0;
+        interpolate(a.position, b.position, u, result.position);
+        interpolate(a.velocity, b.velocity, u, result.velocity);
+        interpolate(a.acceleration, b.acceleration, u, result.acceleration);
+        result.yaw = a.yaw + u * (b.yaw - a.yaw);
+    }
+
+    // m_cursor: the piece t is in
+    void samplePolynomials(
+        double t,
+        crazyflie_controller::QuadcopterTrajectoryPoint& result)
+    {
+        const auto& polys = m_trajectory.polynomials;
+        if (t < m_times[m_cursor]) {
+            m_cursor = 0;
+        }
+        while (m_cursor + 1 < polys.size() && m_times[m_cursor + 1] <= t) {
+            ++m_cursor;
+        }
+
+        const auto& poly = polys[m_cursor];
+        double tp = std::min(std::max(t - m_times[m_cursor], 0.0), poly.duration.toSec());
+        evaluate(poly.poly_x, tp, result.position.x, result.velocity.x, result.acceleration.x);
+        evaluate(poly.poly_y, tp, result.position.y, result.velocity.y, result.acceleration.y);
+        evaluate(poly.poly_z, tp, result.position.z, result.velocity.z, result.acceleration.z);
+        double yawRate;
+        double yawAcceleration;
+        evaluate(poly.poly_yaw, tp, result.yaw, yawRate, yawAcceleration);
+    }
+
+    static void interpolate(
+        const geometry_msgs::Vector3& a,
+        const geometry_msgs::Vector3& b,
+        double u,
+        geometry_msgs::Vector3& result)
+    {
+        result.x = a.x + u * (b.x - a.x);
+        result.y = a.y + u * (b.y - a.y);
+        result.z = a.z + u * (b.z - a.z);
+    }
+
+    // value and first two derivatives of a polynomial (Horner's scheme)
+    static void evaluate(
+        const std::vector<double>& coefficients,
+        double t,
+        double& value,
+        double& derivative,
+        double& secondDerivative)
+    {
+        value = 0;
+        derivative = 0;
+        secondDerivative = 0;
+        for (size_t i = coefficients.size(); i-- > 0;) {
+            secondDerivative = secondDerivative * t + 2 * derivative;
+            derivative = derivative * t + value;
+            value = value * t + coefficients[i];
+        }
+    }
+
+private:
+    crazyflie_controller::QuadcopterTrajectory m_trajectory;
+    // start times of the pieces or times of the points (s)
+    std::vector<double> m_times;
+    size_t m_cursor;
+};
@@ -0,0 +1,99 @@
+#pragma once
+
+#include <ros/ros.h>
+#include <tf/transform_listener.h>
+#include <tf/transform_datatypes.h>
+#include <tf2_msgs/TFMessage.h>
+
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+#include <unordered_map>
+
+// Keeps the latest transforms of the given frames in worldFrame, as
+// received on /tf, so that a controller tick does not need a lookup in a
+// tf::TransformListener. One subscription serves the frames of all
+// controllers of a node. If a transform is not published directly (e.g.
+// there are intermediate frames), a listener is created on the first lookup
+// and used for it instead.
+// The callbacks run on the spin thread; lookups may run on other threads, as
+// long as the spin thread waits for them.
+class TransformCache
+{
+public:
+    TransformCache(
+        const std::string& worldFrame,
+        const std::vector<std::string>& frames)
+        : m_worldFrame(stripSlash(worldFrame))
+        , m_frames()
+        , m_indices()
+        , m_subscribeTf()
+        , m_transforms(frames.size())
+        , m_valid(frames.size(), 0)
+        , m_listenerMutex()
+        , m_listener()
+    {
+        for (size_t i = 0; i < frames.size(); ++i) {
+            m_frames.push_back(stripSlash(frames[i]));
+            m_indices[m_frames.back()] = i;
+        }
+        ros::NodeHandle nh;
+        m_subscribeTf = nh.subscribe("/tf", 100, &TransformCache::tfChanged, this);
+    }
+
+    // Transform of frames[i]
+    void lookup(
+        size_t i,
+        tf::StampedTransform& result)
+    {
+        if (m_valid[i]) {
+            result = m_transforms[i];
+            return;
+        }
+        {
+            std::lock_guard<std::mutex> lock(m_listenerMutex);
+            if (!m_listener) {
+                m_listener.reset(new tf::TransformListener);
+            }
+        }
+        m_listener->lookupTransform(m_worldFrame, m_frames[i], ros::Time(0), result);
+    }
+
+private:
+    static std::string stripSlash(
+        const std::string& frame)
+    {
+        return (!frame.empty() && frame[0] == '/') ? frame.substr(1) : frame;
+    }
+
+    void tfChanged(
+        const tf2_msgs::TFMessage::ConstPtr& msg)
+    {
+        for (const auto& transform : msg->transforms) {
+            if (stripSlash(transform.header.frame_id) != m_worldFrame) {
+                continue;
+            }
+            auto iter = m_indices.find(stripSlash(transform.child_frame_id));
+            if (iter == m_indices.end()) {
+                continue;
+            }
+            size_t i = iter->second;
+            if (!m_valid[i] || transform.header.stamp >= m_transforms[i].stamp_) {
+                tf::transformStampedMsgToTF(transform, m_transforms[i]);
+                m_valid[i] = 1;
+            }
+        }
+    }
+
+private:
+    std::string m_worldFrame;
+    std::vector<std::string> m_frames;
+    std::unordered_map<std::string, size_t> m_indices;
+    ros::Subscriber m_subscribeTf;
+    std::vector<tf::StampedTransform> m_transforms;
+    std::vector<uint8_t> m_valid;
+    // guards the creation of m_listener
+    std::mutex m_listenerMutex;
+    std::unique_ptr<tf::TransformListener> m_listener;
+};
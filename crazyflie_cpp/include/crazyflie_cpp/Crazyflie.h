@@ -8,8 +8,24 @@
 #include <list>
 #include <set>
 #include <map>
+#include <unordered_map>
+#include <algorithm>
 #include <iostream>
 #include <chrono>
+#include <memory>
+#include <atomic>
+#include <mutex>
+
+// Priority classes for the access to a (shared) Crazyradio.
+// Lower values are served first; long transfers (batches, pose frames) yield
+// the radio between USB transfers to a waiting higher class.
+enum RadioPriority
+{
+  RadioPriorityEmergency = 0,
+  RadioPriorityPose      = 1,
+  RadioPriorityDefault   = 2, // params, logging, trajectories, ...
+  RadioPriorityCount
+};
 
 struct stateExternalBringup{
   uint8_t id;
@@ -22,6 +38,91 @@ struct stateExternalBringup{
   float q3;
 };
 
+// Poses of one frame as structure of arrays, as packed by
+// CrazyflieBroadcaster::sendPositionExternalBringup. clear() keeps the
+// capacity, i.e. a batch which is reused for every frame does not allocate.
+struct poseBatch
+{
+  size_t size() const {
+    return id.size();
+  }
+
+  bool empty() const {
+    return id.empty();
+  }
+
+  void reserve(
+    size_t n)
+  {
+    id.reserve(n);
+    x.reserve(n);
+    y.reserve(n);
+    z.reserve(n);
+    q0.reserve(n);
+    q1.reserve(n);
+    q2.reserve(n);
+    q3.reserve(n);
+  }
+
+  // keeps the first n poses (n <= size())
+  void resize(
+    size_t n)
+  {
+    id.resize(n);
+    x.resize(n);
+    y.resize(n);
+    z.resize(n);
+    q0.resize(n);
+    q1.resize(n);
+    q2.resize(n);
+    q3.resize(n);
+  }
+
+  void clear() {
+    resize(0);
+  }
+
+  void push_back(
+    uint8_t id,
+    float x, float y, float z,
+    float q0, float q1, float q2, float q3)
+  {
+    this->id.push_back(id);
+    this->x.push_back(x);
+    this->y.push_back(y);
+    this->z.push_back(z);
+    this->q0.push_back(q0);
+    this->q1.push_back(q1);
+    this->q2.push_back(q2);
+    this->q3.push_back(q3);
+  }
+
+  // overwrites pose to with pose from
+  void copy(
+    size_t from,
+    size_t to)
+  {
+    id[to] = id[from];
+    x[to] = x[from];
+    y[to] = y[from];
+    z[to] = z[from];
+    q0[to] = q0[from];
+    q1[to] = q1[from];
+    q2[to] = q2[from];
+    q3[to] = q3[from];
+  }
+
+  std::vector<uint8_t> id;
+  std::vector<float> x;
+  std::vector<float> y;
+  std::vector<float> z;
+  // quaternion (x, y, z, w)
+  std::vector<float> q0;
+  std::vector<float> q1;
+  std::vector<float> q2;
+  std::vector<float> q3;
+};
+
 struct vec3 {
   float x;
   float y;
@@ -95,6 +196,55 @@ public:
     std::string name;
   };
 
+  // TOC with a "group.name" index. Immutable once loaded and shared by all
+  // Crazyflies with the same firmware, so pointers to its entries can be
+  // kept as handles.
+  template<class T>
+  struct Toc
+  {
+    std::vector<T> entries;
+    std::unordered_map<std::string, size_t> index;
+
+    void buildIndex() {
+      index.clear();
+      index.reserve(entries.size());
+      for (size_t i = 0; i < entries.size(); ++i) {
+        index[entries[i].group + "." + entries[i].name] = i;
+      }
+    }
+
+    const T* find(const std::string& fullName) const {
+      auto iter = index.find(fullName);
+      if (iter != index.end()) {
+        return &entries[iter->second];
+      }
+      return nullptr;
+    }
+
+    // the firmware assigns ids in TOC order
+    const T* find(uint8_t id) const {
+      if (id < entries.size() && entries[id].id == id) {
+        return &entries[id];
+      }
+      return nullptr;
+    }
+  };
+
+  // One polynomial piece of a trajectory (7th order per axis)
+  struct TrajectoryPiece
+  {
+    float duration;
+    float poly_x[8];
+    float poly_y[8];
+    float poly_z[8];
+    float poly_yaw[8];
+  };
+
+  // A piece is uploaded in 6 packets: duration and poly_x[0-4] | poly_x[5-7]
+  // and poly_y[0-2] | poly_y[3-7] and poly_z[0] | poly_z[1-6] |
+  // poly_z[7] and poly_yaw[0-4] | poly_yaw[5-7]
+  static const size_t TrajectoryPieceNumPackets = 6;
+
   enum BootloaderTarget {
     TargetSTM32 = 0xFF,
     TargetNRF51 = 0xFE,
@@ -138,18 +288,30 @@ public:
 
   void requestParamToc(bool forceNoCache=false);
 
+  // Directory of the TOC cache files (default: current working directory).
+  // The cache is shared by all Crazyflies of the process.
+  static void setTocCacheDirectory(
+    const std::string& directory);
+
+  // Makes the batch requests (TOC, params, trajectories, ...) which are in
+  // progress in any thread fail with an exception once the packets being
+  // sent (one chunk of at most 32) are done, e.g. so that an emergency stop
+  // does not wait behind them.
+  // Later requests are not affected.
+  static void abortRequests();
+
   std::vector<ParamTocEntry>::const_iterator paramsBegin() const {
-    return m_paramTocEntries.begin();
+    return m_paramToc->entries.begin();
   }
   std::vector<ParamTocEntry>::const_iterator paramsEnd() const {
-    return m_paramTocEntries.end();
+    return m_paramToc->entries.end();
   }
 
   std::vector<LogTocEntry>::const_iterator logVariablesBegin() const {
-    return m_logTocEntries.begin();
+    return m_logToc->entries.begin();
   }
   std::vector<LogTocEntry>::const_iterator logVariablesEnd() const {
-    return m_logTocEntries.end();
+    return m_logToc->entries.end();
   }
 
   template<class T>
@@ -170,6 +332,10 @@ public:
 
   void setRequestedParams();
 
+  // Reads the current values of the given params from the Crazyflie in one
+  // batch; getParam() returns them afterwards.
+  void requestParams(
+    const std::vector<uint8_t>& ids);
 
   template<class T>
   T getParam(uint8_t id) const {
@@ -181,6 +347,17 @@ public:
     const std::string& group,
     const std::string& name) const;
 
+  // fullName is "group.name"
+  const ParamTocEntry* getParamTocEntry(
+    const std::string& fullName) const {
+    return m_paramToc->find(fullName);
+  }
+
+  const ParamTocEntry* getParamTocEntry(
+    uint8_t id) const {
+    return m_paramToc->find(id);
+  }
+
   void setEmptyAckCallback(
     std::function<void(const crtpPlatformRSSIAck*)> cb) {
     m_emptyAckCallback = cb;
@@ -191,11 +368,56 @@ public:
     m_linkQualityCallback = cb;
   }
 
+  // Counters of the radio link of this Crazyflie since it was created; the
+  // statistics of a window are the differences of two snapshots.
+  struct linkStatistics
+  {
+    // packets sent and how many of them were acknowledged
+    uint64_t numSent;
+    uint64_t numAcked;
+    // retransmissions by the radio (at most 15 per packet)
+    uint64_t numRetries;
+    // acks with the signal strength, and the sum of their RSSI (in -dBm)
+    uint64_t numRSSI;
+    uint64_t rssiSum;
+    // transfers of up to the pipeline depth packets (until their acks came
+    // back) and their total/maximum duration (in ns); the maximum is the one
+    // since the previous readLinkStatistics call
+    uint64_t numTransfers;
+    uint64_t transferTime;
+    uint64_t maxTransferTime;
+    // time waited for the radio (or transport) before the transfers (in ns)
+    uint64_t waitTime;
+  };
+
+  // Lock-free; can be called from any thread (but resets maxTransferTime).
+  void readLinkStatistics(
+    linkStatistics& stats);
+
   void setConsoleCallback(
     std::function<void(const char*)> cb) {
     m_consoleCallback = cb;
   }
 
+  // Number of packets kept in flight on the radio while handling batch
+  // requests (1 = stop-and-wait). The radio is shared by all Crazyflies
+  // using the same devId.
+  void setRadioPipelineDepth(
+    uint32_t depth);
+
+  // Batch requests (TOC downloads, parameter reads, ...) keep at most
+  // `window` requests outstanding. A request is sent again if no matching
+  // response arrived within retransmitTimeout seconds.
+  void setBatchWindow(
+    size_t window) {
+    m_batchWindow = std::max<size_t>(window, 1);
+  }
+
+  void setBatchRetransmitTimeout(
+    float retransmitTimeout) {
+    m_batchRetransmitTimeout = retransmitTimeout;
+  }
+
   void trajectoryReset();
   void trajectoryAdd(
     float duration,
@@ -203,6 +425,20 @@ public:
     std::vector<float> poly_y,
     std::vector<float> poly_z,
     std::vector<float> poly_yaw);
+
+  // Uploads all pieces in a single windowed batch. Every packet is verified
+  // by the response the firmware sends once it stored it; throws on timeout.
+  // Packets whose bit is set in sharedPackets[piece] are skipped; those are
+  // broadcast to the whole group instead (see CrazyflieBroadcaster::trajectoryAdd).
+  void trajectoryAdd(
+    const std::vector<TrajectoryPiece>& pieces,
+    const std::vector<uint8_t>& sharedPackets = std::vector<uint8_t>());
+
+  // Bit j of result[k] is set if packet j of piece k is the same for all
+  // trajectories. Pieces which only differ by a translation share the last
+  // three packets.
+  static std::vector<uint8_t> sharedTrajectoryPackets(
+    const std::vector<const std::vector<TrajectoryPiece>*>& trajectories);
   // void trajectoryStart();
   // void setTrajectoryState(bool state);
 
@@ -262,17 +498,33 @@ private:
   void sendPacket(
     const uint8_t* data,
     uint32_t length,
-    Crazyradio::Ack& result);
+    Crazyradio::Ack& result,
+    RadioPriority priority = RadioPriorityDefault);
 
   bool sendPacket(
     const uint8_t* data,
     uint32_t length);
 
+  // Sends the packets in chunks of the radio's pipeline depth. Between chunks,
+  // the radio is handed over if a higher priority class is waiting for it.
+  void sendPackets(
+    const ITransport::Packet* packets,
+    size_t numPackets,
+    Crazyradio::Ack* results,
+    RadioPriority priority = RadioPriorityDefault);
+
  void sendPacketOrTimeout(
    const uint8_t* data,
    uint32_t length,
    float timeout = 1.0);
 
+  // Sends all packets (pipelined) and resends the ones which were not
+  // acknowledged; throws if there was no progress for timeout seconds.
+  void sendPacketsOrTimeout(
+    const ITransport::Packet* packets,
+    size_t numPackets,
+    float timeout = 1.0);
+
   void handleAck(
     const Crazyradio::Ack& result);
 
@@ -350,6 +602,11 @@ private:
     const std::string& group,
     const std::string& name) const;
 
+  const LogTocEntry* getLogTocEntry(
+    const std::string& fullName) const {
+    return m_logToc->find(fullName);
+  }
+
   uint8_t registerLogBlock(
     std::function<void(crtpLogDataResponse*, uint8_t)> cb);
 
@@ -367,21 +624,61 @@ private:
 private:
   Crazyradio* m_radio;
   ITransport* m_transport;
+  // serializes the access to m_transport (if not a radio)
+  std::mutex* m_transportMutex;
   int m_devId;
 
   uint8_t m_channel;
   uint64_t m_address;
   Crazyradio::Datarate m_datarate;
 
-  std::vector<LogTocEntry> m_logTocEntries;
+  // shared with other Crazyflies using the same firmware
+  std::shared_ptr<const Toc<LogTocEntry> > m_logToc;
   std::map<uint8_t, std::function<void(crtpLogDataResponse*, uint8_t)> > m_logBlockCb;
 
-  std::vector<ParamTocEntry> m_paramTocEntries;
+  std::shared_ptr<const Toc<ParamTocEntry> > m_paramToc;
   std::map<uint8_t, ParamValue> m_paramValues;
 
   std::function<void(const crtpPlatformRSSIAck*)> m_emptyAckCallback;
   std::function<void(float)> m_linkQualityCallback;
   std::function<void(const char*)> m_consoleCallback;
+  // see linkStatistics; updated by the threads sending to this Crazyflie
+  struct linkCounters
+  {
+    linkCounters()
+      : numSent(0)
+      , numAcked(0)
+      , numRetries(0)
+      , numRSSI(0)
+      , rssiSum(0)
+      , numTransfers(0)
+      , transferTime(0)
+      , maxTransferTime(0)
+      , waitTime(0)
+      , linkQualityWindow(0)
+    {
+    }
+
+    std::atomic<uint64_t> numSent;
+    std::atomic<uint64_t> numAcked;
+    std::atomic<uint64_t> numRetries;
+    std::atomic<uint64_t> numRSSI;
+    std::atomic<uint64_t> rssiSum;
+    std::atomic<uint64_t> numTransfers;
+    std::atomic<uint64_t> transferTime;
+    std::atomic<uint64_t> maxTransferTime;
+    std::atomic<uint64_t> waitTime;
+    // start of the window of the link quality callback: the (lower 32 bits
+    // of the) sent and acked counters, packed to be swapped at once
+    std::atomic<uint64_t> linkQualityWindow;
+  };
+
+  void countTransfer(
+    std::chrono::steady_clock::time_point requested,
+    std::chrono::steady_clock::time_point started,
+    std::chrono::steady_clock::time_point finished);
+
+  linkCounters m_linkCounters;
 
   uint16_t m_lastTrajectoryId;
 
@@ -395,10 +692,18 @@ private:
     std::vector<uint8_t> request;
     size_t numBytesToMatch;
     ITransport::Ack ack;
+    bool sent;
     bool finished;
+    std::chrono::steady_clock::time_point sendTime;
   };
   std::vector<batchRequest> m_batchRequests;
   size_t m_numRequestsFinished;
+  // match bytes => indices into m_batchRequests
+  std::unordered_map<std::string, std::vector<size_t> > m_batchIndex;
+  // distinct numBytesToMatch of the current batch
+  std::vector<size_t> m_batchMatchLengths;
+  size_t m_batchWindow;
+  float m_batchRetransmitTimeout;
 
   // logging
   Logger& m_logger;
@@ -494,175 +799,104 @@ private:
 class LogBlockGeneric
 {
 public:
+  // Type and position of one variable within the payload of a log packet
+  struct Column
+  {
+    Crazyflie::LogType type;
+    uint8_t offset;
+  };
+
+  // The values passed to callback are reused for the next packet, i.e.
+  // they are only valid during the call.
   LogBlockGeneric(
     Crazyflie* cf,
     const std::vector<std::string>& variables,
     void* userData,
-    std::function<void(uint32_t, std::vector<double>*, void* userData)>& callback)
-    : m_cf(cf)
-    , m_userData(userData)
-    , m_callback(callback)
-    , m_id(0)
-  {
-    m_id = m_cf->registerLogBlock([=](crtpLogDataResponse* r, uint8_t s) { this->handleData(r, s);});
-    crtpLogCreateBlockRequest request;
-    request.id = m_id;
-    int i = 0;
-    size_t s = 0;
-    for (auto&& var : variables) {
-      auto pos = var.find(".");
-      std::string first = var.substr(0, pos);
-      std::string second = var.substr(pos+1);
-      const Crazyflie::LogTocEntry* entry = m_cf->getLogTocEntry(first, second);
-      if (entry) {
-        s += Crazyflie::size(entry->type);
-        if (s > 26) {
-          std::stringstream sstr;
-          sstr << "Can't configure that many variables in a single log block!"
-               << " Ignoring " << first << "." << second << std::endl;
-          throw std::runtime_error(sstr.str());
-        } else {
-          request.items[i].logType = entry->type;
-          request.items[i].id = entry->id;
-          ++i;
-          m_types.push_back(entry->type);
-        }
-      }
-      else {
-        std::stringstream sstr;
-        sstr << "Could not find " << first << "." << second << " in log toc!";
-        throw std::runtime_error(sstr.str());
-      }
-    }
-    m_cf->startBatchRequest();
-    m_cf->addRequest(reinterpret_cast<const uint8_t*>(&request), 3 + 2*i, 2);
-    m_cf->handleRequests();
-    auto r = m_cf->getRequestResult<crtpLogControlResponse>(0);
-    if (r->result != crtpLogControlResultOk
-        && r->result != crtpLogControlResultBlockExists) {
-      throw std::runtime_error("Could not create log block!");
-    }
-  }
+    std::function<void(uint32_t, std::vector<double>*, void* userData)>& callback);
 
-  ~LogBlockGeneric()
-  {
-    stop();
-    m_cf->unregisterLogBlock(m_id);
-  }
+  ~LogBlockGeneric();
 
+  void start(uint8_t period);
 
-  void start(uint8_t period)
-  {
-    crtpLogStartRequest request(m_id, period);
-    m_cf->startBatchRequest();
-    m_cf->addRequest(request, 2);
-    m_cf->handleRequests();
+  void stop();
+
+  // Called with the undecoded payload of every log packet (before the
+  // regular callback). Use decode() or view() to interpret it.
+  void setRawCallback(
+    std::function<void(uint32_t, const uint8_t*, size_t, void* userData)> cb) {
+    m_rawCallback = cb;
   }
 
-  void stop()
-  {
-    crtpLogStopRequest request(m_id);
-    m_cf->startBatchRequest();
-    m_cf->addRequest(request, 2);
-    m_cf->handleRequests();
+  const std::vector<Column>& columns() const {
+    return m_columns;
   }
 
-private:
-  void handleData(crtpLogDataResponse* response, uint8_t size) {
+  // payload size in bytes
+  size_t size() const {
+    return m_size;
+  }
 
-    std::vector<double> result;
-    size_t pos = 0;
-    for (size_t i = 0; i < m_types.size(); ++i)
-    {
-      switch (m_types[i])
-      {
-      case Crazyflie::LogTypeUint8:
-        {
-          uint8_t value;
-          memcpy(&value, &response->data[pos], sizeof(uint8_t));
-          result.push_back(value);
-          pos += sizeof(uint8_t);
-          break;
-        }
-      case Crazyflie::LogTypeInt8:
-        {
-          int8_t value;
-          memcpy(&value, &response->data[pos], sizeof(int8_t));
-          result.push_back(value);
-          pos += sizeof(int8_t);
-          break;
-        }
-      case Crazyflie::LogTypeUint16:
-        {
-          uint16_t value;
-          memcpy(&value, &response->data[pos], sizeof(uint16_t));
-          result.push_back(value);
-          pos += sizeof(uint16_t);
-          break;
-        }
-      case Crazyflie::LogTypeInt16:
-        {
-          int16_t value;
-          memcpy(&value, &response->data[pos], sizeof(int16_t));
-          result.push_back(value);
-          pos += sizeof(int16_t);
-          break;
-        }
-      case Crazyflie::LogTypeUint32:
-        {
-          uint32_t value;
-          memcpy(&value, &response->data[pos], sizeof(uint32_t));
-          result.push_back(value);
-          pos += sizeof(uint32_t);
-          break;
-        }
-      case Crazyflie::LogTypeInt32:
-        {
-          int32_t value;
-          memcpy(&value, &response->data[pos], sizeof(int32_t));
-          result.push_back(value);
-          pos += sizeof(int32_t);
-          break;
-        }
-      case Crazyflie::LogTypeFloat:
-        {
-          float value;
-          memcpy(&value, &response->data[pos], sizeof(float));
-          result.push_back(value);
-          pos += sizeof(float);
-          break;
-        }
-      case Crazyflie::LogTypeFP16:
-        {
-          double value;
-          memcpy(&value, &response->data[pos], sizeof(double));
-          result.push_back(value);
-          pos += sizeof(double);
-          break;
-        }
-      }
-    }
+  // Writes one value per column to values (which must hold columns().size()
+  // elements).
+  void decode(
+    const uint8_t* data,
+    double* values) const;
+
+  // Decodes a single value of the given type
+  static double decodeValue(
+    Crazyflie::LogType type,
+    const uint8_t* data);
 
-    uint32_t time_in_ms = ((uint32_t)response->timestampHi << 8) | (response->timestampLo);
-    m_callback(time_in_ms, &result, m_userData);
+  // Interprets the payload as packed struct T, which has to match the
+  // variables of this block. Returns nullptr if the payload is too short.
+  template<class T>
+  static const T* view(
+    const uint8_t* data,
+    size_t size) {
+    if (size < sizeof(T)) {
+      return nullptr;
+    }
+    return reinterpret_cast<const T*>(data);
   }
 
+private:
+  void handleData(crtpLogDataResponse* response, uint8_t size);
+
 private:
   Crazyflie* m_cf;
   void* m_userData;
   std::function<void(uint32_t, std::vector<double>*, void*)> m_callback;
+  std::function<void(uint32_t, const uint8_t*, size_t, void*)> m_rawCallback;
   uint8_t m_id;
-  std::vector<Crazyflie::LogType> m_types;
+  std::vector<Column> m_columns;
+  size_t m_size;
+  // reused for every packet
+  std::vector<double> m_values;
 };
 
 ///
 
 class CrazyflieBroadcaster
 {
+public:
+  struct PositionUpdateRate
+  {
+    uint8_t id;
+    // poses per second passed to sendPositionExternalBringup
+    double requested;
+    // poses per second that were actually sent
+    double sent;
+  };
+
 public:
   CrazyflieBroadcaster(
     const std::string& link_uri);
 
+  // Sends all broadcasts to the given transport instead of a Crazyradio
+  // (e.g. a null transport for benchmarks). The transport is not owned.
+  CrazyflieBroadcaster(
+    ITransport* transport);
+
   void trajectoryStart(
     uint8_t group,
     bool reversed);
@@ -688,12 +922,65 @@ public:
     uint16_t trajectory, // one of enum trajectory_type
     float timescale);
 
+  // Broadcasts a zero-thrust setpoint, which stops the motors of all CFs on
+  // this channel. Served before any other traffic of the radio; broadcasts
+  // are not acknowledged, so it is sent numRepeats times.
+  void emergencyStop(
+    size_t numRepeats);
+
+  // Sends one frame of poses (two per packet, two packets per USB transfer)
+  // while holding the radio for the whole frame.
+  void sendPositionExternalBringup(
+    const poseBatch& poses);
+
+  // Same as above; copies data into a batch first.
   void sendPositionExternalBringup(
     const std::vector<stateExternalBringup>& data);
 
+  // Rotates the order of the vehicles every frame, so that no vehicle
+  // always gets its pose last.
+  void setPositionRotation(
+    bool enable) {
+    m_positionRotation = enable;
+  }
+
+  // Poses which are not sent within budget (in s) after the start of a frame
+  // are dropped; the next frame starts with them. 0 disables the limit.
+  void setPositionFrameBudget(
+    double budget) {
+    m_positionFrameBudget = budget;
+  }
+
+  // Achieved pose update rate per vehicle since the last call
+  void positionUpdateRates(
+    std::vector<PositionUpdateRate>& rates);
+
+  // Control transfers sent to the radio so far (by any user of it; 0
+  // without a Crazyradio)
+  uint64_t numRadioControlTransfers() const {
+    return m_radio ? m_radio->numControlTransfers() : 0;
+  }
+
+  // Broadcasts the packets whose bit is set in sharedPackets[piece] (see
+  // Crazyflie::sharedTrajectoryPackets); piece i gets the id firstId + i.
+  // Broadcasts are not acknowledged, so every packet is sent numRepeats times.
+  void trajectoryAdd(
+    const std::vector<Crazyflie::TrajectoryPiece>& pieces,
+    const std::vector<uint8_t>& sharedPackets,
+    size_t numRepeats,
+    uint8_t firstId = 0);
+
   void sendPacketDropTest(
     uint64_t seq);
 
+  // Broadcasts count drop test packets with the consecutive sequence numbers
+  // seq, seq + 1, ... under one radio lock, like a frame of poses. With
+  // paired set, two packets are sent per USB transfer (as the poses are).
+  void sendPacketDropTests(
+    uint64_t seq,
+    size_t count,
+    bool paired = true);
+
   template<class T>
   void setParam(
     uint8_t group,
@@ -706,26 +993,54 @@ public:
     setParam(group, id, type, v);
   }
 
+  void setParam(
+    uint8_t group,
+    uint8_t id,
+    Crazyflie::ParamType type,
+    const Crazyflie::ParamValue& value);
+
 protected:
   void sendPacket(
     const uint8_t* data,
-    uint32_t length);
+    uint32_t length,
+    RadioPriority priority = RadioPriorityDefault);
 
   void send2Packets(
     const uint8_t* data,
-    uint32_t length);
+    uint32_t length,
+    RadioPriority priority = RadioPriorityDefault);
 
-  void setParam(
-    uint8_t group,
-    uint8_t id,
-    Crazyflie::ParamType type,
-    const Crazyflie::ParamValue& value);
+private:
+  // Has to be called while holding the radio lock
+  void configureRadio();
+
+  // Packs poses [begin, end) into consecutive pose slots, starting at slot
+  void packPoses(
+    const poseBatch& poses,
+    size_t begin,
+    size_t end,
+    size_t slot);
 
 private:
   Crazyradio* m_radio;
+  // m_radio, or the transport given to the constructor
+  ITransport* m_transport;
   int m_devId;
 
   uint8_t m_channel;
   uint64_t m_address;
   Crazyradio::Datarate m_datarate;
+
+  bool m_positionRotation;
+  double m_positionFrameBudget;
+  // index of the pose the next frame starts with
+  size_t m_positionOffset;
+  // reused for every frame
+  std::vector<crtpPosExtBringup> m_positionRequests;
+  std::vector<uint8_t> m_positionIds;
+  poseBatch m_positionBatch;
+  // per vehicle id; read by positionUpdateRates from another thread
+  std::atomic<uint32_t> m_numPosesRequested[256];
+  std::atomic<uint32_t> m_numPosesSent[256];
+  std::chrono::steady_clock::time_point m_positionStatsStart;
 };
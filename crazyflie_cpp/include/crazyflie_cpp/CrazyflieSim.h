@@ -0,0 +1,146 @@
+#pragma once
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include <deque>
+#include <map>
+#include <mutex>
+#include <random>
+#include <chrono>
+
+#include "ITransport.h"
+
+// Simulated Crazyflie, answering the CRTP requests of the driver (log and
+// param TOC, params, logging, trajectories) as the firmware does: responses
+// are queued and returned in the payload of subsequent acks.
+// Used by Crazyflie for "sim://" URIs, so that the batch engine can be
+// benchmarked without hardware.
+class CrazyflieSim
+  : public ITransport
+{
+public:
+  struct Config
+  {
+    Config()
+      : numLogVariables(64)
+      , numParams(64)
+      , latency(0)
+      , loss(0)
+      , pipelineDepth(1)
+      , seed(0)
+    {
+    }
+
+    size_t numLogVariables;
+    size_t numParams;
+    // round trip (in s) of a USB transfer
+    double latency;
+    // probability that a packet or its ack gets lost
+    double loss;
+    // packets per USB transfer, i.e. sharing one latency
+    size_t pipelineDepth;
+    uint32_t seed;
+  };
+
+  struct Stats
+  {
+    size_t numPackets;
+    size_t numLost;
+    size_t numResponses;
+    size_t numLogPackets;
+    // log packets dropped since the queue was full
+    size_t numLogPacketsDropped;
+  };
+
+public:
+  CrazyflieSim(
+    const Config& config);
+
+  virtual void sendPacket(
+    const uint8_t* data,
+    uint32_t length,
+    ITransport::Ack& result);
+
+  virtual void sendPacketNoAck(
+    const uint8_t* data,
+    uint32_t length);
+
+  virtual void sendPackets(
+    const ITransport::Packet* packets,
+    size_t numPackets,
+    ITransport::Ack* results);
+
+  Stats stats() const;
+
+  const Config& config() const {
+    return m_config;
+  }
+
+private:
+  struct logVariable
+  {
+    std::string group;
+    std::string name;
+    uint8_t type;
+  };
+
+  struct param
+  {
+    std::string group;
+    std::string name;
+    uint8_t type;
+    uint32_t value;
+  };
+
+  struct logBlock
+  {
+    size_t size;
+    bool running;
+    std::chrono::milliseconds period;
+    std::chrono::steady_clock::time_point next;
+  };
+
+  // Has to be called with m_mutex held
+  void transfer(
+    const uint8_t* data,
+    uint32_t length,
+    ITransport::Ack& result);
+
+  void handleRequest(
+    const uint8_t* data,
+    uint32_t length);
+
+  void handleLogToc(
+    const uint8_t* data,
+    uint32_t length);
+
+  void handleLogControl(
+    const uint8_t* data,
+    uint32_t length);
+
+  void handleParams(
+    uint8_t channel,
+    const uint8_t* data,
+    uint32_t length);
+
+  void queueLogData();
+
+  void queueResponse(
+    const std::vector<uint8_t>& response);
+
+  void latency(
+    size_t numPackets);
+
+private:
+  Config m_config;
+  mutable std::mutex m_mutex;
+  std::mt19937 m_random;
+  std::bernoulli_distribution m_lossDistribution;
+  std::vector<logVariable> m_logVariables;
+  std::vector<param> m_params;
+  std::map<uint8_t, logBlock> m_logBlocks;
+  std::deque<std::vector<uint8_t> > m_queue;
+  std::chrono::steady_clock::time_point m_start;
+  Stats m_stats;
+};
@@ -6,6 +6,8 @@
 #include "ITransport.h"
 #include "USBDevice.h"
 
+struct libusb_transfer;
+
 class Crazyradio
   : public ITransport
   , public USBDevice
@@ -77,9 +79,28 @@ public:
     bool getAckEnable() const {
         return m_ackEnable;
     }
+
+    // Changes the settings which differ from the given ones. The firmware
+    // has no request to change several of them at once, i.e. this costs one
+    // control transfer per changed setting (returns their number).
+    size_t configure(
+        uint64_t address,
+        uint8_t channel,
+        Datarate datarate,
+        bool ackEnable);
+
     void setContCarrier(
         bool active);
 
+    // Maximum number of packets sendPackets keeps in flight.
+    // 1 (default) disables pipelining.
+    void setPipelineDepth(
+        uint32_t depth);
+
+    uint32_t getPipelineDepth() const {
+        return m_pipelineDepth;
+    }
+
     virtual void sendPacket(
         const uint8_t* data,
         uint32_t length,
@@ -94,10 +115,18 @@ public:
         const uint8_t* data,
         uint32_t totalLength);
 
+    virtual void sendPackets(
+        const ITransport::Packet* packets,
+        size_t numPackets,
+        ITransport::Ack* results);
+
 private:
     uint8_t m_channel;
     uint64_t m_address;
     Datarate m_datarate;
     bool m_ackEnable;
     uint32_t m_numPacketsSent;
+    uint32_t m_pipelineDepth;
+    // OUT/IN transfer pairs, reused by sendPackets
+    std::vector<libusb_transfer*> m_transfers;
 };
@@ -0,0 +1,114 @@
+#pragma once
+
+#include <stdint.h>
+#include <cstdio>
+#include <string>
+#include <vector>
+#include <atomic>
+#include <thread>
+
+#include "Crazyflie.h"
+
+// Binary flight log, storing the raw payload of log blocks.
+//
+// File format:
+//   "CFLG", version (uint8_t), number of blocks (uint8_t)
+//   per block: number of variables (uint8_t)
+//     per variable: type (uint8_t), name length (uint8_t), name
+//   FlightLogRecord entries until the end of the file
+
+struct FlightLogRecord
+{
+  uint32_t time_in_ms;
+  uint8_t block;
+  uint8_t size;
+  uint8_t data[26];
+} __attribute__((packed));
+
+struct FlightLogBlock
+{
+  std::vector<std::string> variables;
+  std::vector<Crazyflie::LogType> types;
+};
+
+// Buffers records in a ring buffer; a background thread writes them to disk
+// in chunks. append() never blocks or allocates.
+class FlightLogWriter
+{
+public:
+  // capacity is the number of records that can be buffered (rounded up
+  // to the next power of two)
+  FlightLogWriter(
+    const std::string& fileName,
+    size_t capacity = 4096);
+
+  ~FlightLogWriter();
+
+  // Has to be called for all blocks before start().
+  // Returns the block index to use for append().
+  uint8_t addBlock(
+    const FlightLogBlock& block);
+
+  // Writes the header and starts the writer thread
+  void start();
+
+  // Writes all buffered records and closes the file
+  void stop();
+
+  // Queues a record; it is dropped if the buffer is full.
+  // Single producer: must not be called from several threads concurrently.
+  bool append(
+    uint8_t block,
+    uint32_t time_in_ms,
+    const uint8_t* data,
+    size_t size);
+
+  uint64_t numDropped() const {
+    return m_numDropped;
+  }
+
+private:
+  void writerLoop();
+
+  size_t writeAvailable();
+
+private:
+  std::string m_fileName;
+  FILE* m_file;
+  std::vector<FlightLogBlock> m_blocks;
+  std::vector<FlightLogRecord> m_buffer;
+  size_t m_mask;
+  // next record to be filled by append()
+  std::atomic<size_t> m_head;
+  // next record to be written to disk
+  std::atomic<size_t> m_tail;
+  std::atomic<bool> m_running;
+  std::atomic<uint64_t> m_numDropped;
+  std::thread m_thread;
+};
+
+class FlightLogReader
+{
+public:
+  FlightLogReader(
+    const std::string& fileName);
+
+  ~FlightLogReader();
+
+  const std::vector<FlightLogBlock>& blocks() const {
+    return m_blocks;
+  }
+
+  // Returns false at the end of the file
+  bool next(
+    FlightLogRecord& record);
+
+  // One value per variable of record.block
+  void decode(
+    const FlightLogRecord& record,
+    std::vector<double>& values) const;
+
+private:
+  FILE* m_file;
+  std::vector<FlightLogBlock> m_blocks;
+};
@@ -0,0 +1,167 @@
+#pragma once
+
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <exception>
+#include <functional>
+#include <vector>
+#include <chrono>
+#include <pthread.h>
+
+// Runs a fixed set of jobs once per frame on long-lived threads.
+// run() wakes up all workers (using a condition variable) and returns once
+// every job has finished for the current frame. This avoids creating and
+// destroying a thread per job per frame.
+// Alternatively, runAsync() starts the jobs and wait() waits for them, which
+// lets the caller prepare the next frame meanwhile.
+// Exceptions of the jobs are rethrown by wait().
+class FrameWorkerPool
+{
+public:
+  FrameWorkerPool()
+    : m_jobs()
+    , m_threads()
+    , m_mutex()
+    , m_frameCondition()
+    , m_doneCondition()
+    , m_frame(0)
+    , m_numDone(0)
+    , m_running(false)
+    , m_finished()
+    , m_stop(false)
+    , m_exception()
+  {
+  }
+
+  ~FrameWorkerPool()
+  {
+    stop();
+  }
+
+  // cpus[i] is the core job i will be pinned to (-1 or missing: not pinned).
+  // Returns false if a job could not be pinned (it runs unpinned then).
+  bool start(
+    const std::vector<std::function<void()> >& jobs,
+    const std::vector<int>& cpus)
+  {
+    bool pinned = true;
+    m_jobs = jobs;
+    for (size_t i = 0; i < m_jobs.size(); ++i) {
+      m_threads.push_back(std::thread(&FrameWorkerPool::worker, this, i));
+      if (i < cpus.size() && cpus[i] >= 0) {
+        pinned = pinThread(m_threads.back(), cpus[i]) && pinned;
+      }
+    }
+    return pinned;
+  }
+
+  size_t size() const
+  {
+    return m_threads.size();
+  }
+
+  void run()
+  {
+    runAsync();
+    wait();
+  }
+
+  void runAsync()
+  {
+    std::unique_lock<std::mutex> lock(m_mutex);
+    m_numDone = 0;
+    m_running = true;
+    ++m_frame;
+    m_frameCondition.notify_all();
+  }
+
+  // Returns the time the last job of the current frame finished (or now, if
+  // no frame is running).
+  std::chrono::high_resolution_clock::time_point wait()
+  {
+    std::unique_lock<std::mutex> lock(m_mutex);
+    if (!m_running || m_jobs.empty()) {
+      m_running = false;
+      return std::chrono::high_resolution_clock::now();
+    }
+    m_doneCondition.wait(lock, [this] { return m_numDone == m_jobs.size(); });
+    m_running = false;
+    if (m_exception) {
+      std::exception_ptr e = m_exception;
+      m_exception = nullptr;
+      std::rethrow_exception(e);
+    }
+    return m_finished;
+  }
+
+  void stop()
+  {
+    {
+      std::unique_lock<std::mutex> lock(m_mutex);
+      m_stop = true;
+    }
+    m_frameCondition.notify_all();
+    for (auto& thread : m_threads) {
+      thread.join();
+    }
+    m_threads.clear();
+  }
+
+private:
+  void worker(size_t idx)
+  {
+    uint64_t lastFrame = 0;
+    while (true) {
+      {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        m_frameCondition.wait(lock, [&] { return m_stop || m_frame != lastFrame; });
+        if (m_stop) {
+          return;
+        }
+        lastFrame = m_frame;
+      }
+
+      std::exception_ptr e;
+      try {
+        m_jobs[idx]();
+      }
+      catch(...) {
+        e = std::current_exception();
+      }
+
+      {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        if (e && !m_exception) {
+          m_exception = e;
+        }
+        ++m_numDone;
+        if (m_numDone == m_jobs.size()) {
+          m_finished = std::chrono::high_resolution_clock::now();
+        }
+      }
+      m_doneCondition.notify_one();
+    }
+  }
+
+  static bool pinThread(std::thread& thread, int cpu)
+  {
+    cpu_set_t cpuset;
+    CPU_ZERO(&cpuset);
+    CPU_SET(cpu, &cpuset);
+    return pthread_setaffinity_np(thread.native_handle(), sizeof(cpu_set_t), &cpuset) == 0;
+  }
+
+private:
+  std::vector<std::function<void()> > m_jobs;
+  std::vector<std::thread> m_threads;
+  std::mutex m_mutex;
+  std::condition_variable m_frameCondition;
+  std::condition_variable m_doneCondition;
+  uint64_t m_frame;
+  size_t m_numDone;
+  bool m_running;
+  std::chrono::high_resolution_clock::time_point m_finished;
+  bool m_stop;
+  std::exception_ptr m_exception;
+};
@@ -1,6 +1,7 @@
 #pragma once
 
 #include <stdint.h>
+#include <stddef.h>
 
 class ITransport
 {
@@ -9,6 +10,8 @@ public:
   {
     Ack()
       : ack(0)
+      , powerDet(0)
+      , retry(0)
       , size(0)
     {}
 
@@ -20,6 +23,12 @@ public:
     uint8_t size;
   }__attribute__((packed));
 
+  struct Packet
+  {
+    const uint8_t* data;
+    uint32_t length;
+  };
+
 public:
   virtual ~ITransport() {}
 
@@ -32,6 +41,18 @@ public:
     const uint8_t* data,
     uint32_t length) = 0;
 
+  // Sends numPackets packets and stores the ack of packets[i] in results[i].
+  // Transports may keep several of those packets in flight at the same time.
+  virtual void sendPackets(
+    const Packet* packets,
+    size_t numPackets,
+    Ack* results)
+  {
+    for (size_t i = 0; i < numPackets; ++i) {
+      sendPacket(packets[i].data, packets[i].length, results[i]);
+    }
+  }
+
   virtual void send2PacketsNoAck(
       const uint8_t* data,
       uint32_t totalLength)
@@ -1,6 +1,7 @@
 #pragma once
 
 #include <stdint.h>
+#include <atomic>
 
 // forward declarations
 struct libusb_context;
@@ -15,6 +16,12 @@ public:
 
   virtual ~USBDevice();
 
+  // Control transfers (e.g. changes of the radio settings) sent so far; can
+  // be read from any thread.
+  uint64_t numControlTransfers() const {
+    return m_numControlTransfers;
+  }
+
 protected:
     static uint32_t numDevices(
       uint16_t idVendor,
@@ -35,6 +42,8 @@ protected:
 
     float m_version;
 
+    std::atomic<uint64_t> m_numControlTransfers;
+
 private:
   uint16_t m_idVendor;
   uint16_t m_idProduct;
@@ -7,6 +7,7 @@
 
 #include "Crazyradio.h"
 #include "CrazyflieUSB.h"
+#include "CrazyflieSim.h"
 
 #include "quatcompress.h" // FROM CF FIRMWARE
 
@@ -14,6 +15,17 @@
 #include <cstring>
 #include <stdexcept>
 #include <thread>
+#include <algorithm>
+#include <deque>
+#include <list>
+#include <condition_variable>
+#include <fstream>
+#include <cstdio>
+#include <cmath>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
 
 #include "num.h"
 
@@ -25,32 +37,491 @@ namespace pt = boost::property_tree;
 #define MAX_RADIOS 16
 #define MAX_USB     4
 
+namespace {
+
+// Arbitrates the access to one Crazyradio between threads:
+// * waiters of a higher priority class are always served first
+// * within a class, the waiter whose configuration (address, channel,
+//   datarate, ack) needs the fewest changes of the radio's settings is
+//   preferred (each change is a control transfer); the oldest of these wins.
+//   At most maxAffinityGrants consecutive grants may bypass the oldest
+//   waiter of the class, otherwise waiters are served in FIFO order.
+// A configuration of 0 means the waiter does not use the radio's settings.
+class RadioArbiter
+{
+public:
+  RadioArbiter()
+    : m_mutex()
+    , m_condition()
+    , m_waiters()
+    , m_locked(false)
+    , m_owner(0)
+    , m_nextTicket(1)
+    , m_config(0)
+    , m_numAffinityGrants(0)
+  {
+    for (auto& numWaiting : m_numWaiting) {
+      numWaiting = 0;
+    }
+  }
+
+  void lock(
+    RadioPriority priority,
+    uint64_t config)
+  {
+    std::unique_lock<std::mutex> mlock(m_mutex);
+    uint64_t ticket = m_nextTicket++;
+    if (!m_locked) {
+      grant(ticket, config, false);
+      return;
+    }
+    m_waiters.push_back({ticket, priority, config});
+    ++m_numWaiting[priority];
+    m_condition.wait(mlock, [&] { return m_owner == ticket; });
+  }
+
+  void unlock()
+  {
+    std::unique_lock<std::mutex> mlock(m_mutex);
+    m_locked = false;
+    if (m_waiters.empty()) {
+      return;
+    }
+
+    RadioPriority priority = RadioPriorityCount;
+    for (const auto& w : m_waiters) {
+      priority = std::min(priority, w.priority);
+    }
+    auto oldest = m_waiters.end();
+    auto next = m_waiters.end();
+    int nextChanges = 0;
+    for (auto iter = m_waiters.begin(); iter != m_waiters.end(); ++iter) {
+      if (iter->priority != priority) {
+        continue;
+      }
+      int changes = numChanges(iter->config);
+      if (oldest == m_waiters.end()) {
+        oldest = next = iter;
+        nextChanges = changes;
+        if (m_numAffinityGrants >= maxAffinityGrants) {
+          break;
+        }
+      } else if (changes < nextChanges) {
+        next = iter;
+        nextChanges = changes;
+      }
+      if (nextChanges == 0) {
+        break;
+      }
+    }
+
+    --m_numWaiting[next->priority];
+    grant(next->ticket, next->config, next != oldest);
+    m_waiters.erase(next);
+    m_condition.notify_all();
+  }
+
+  // true if a thread of a higher priority class is waiting
+  bool preempted(
+    RadioPriority priority) const
+  {
+    for (int p = 0; p < priority; ++p) {
+      if (m_numWaiting[p] > 0) {
+        return true;
+      }
+    }
+    return false;
+  }
+
+private:
+  // bypassed: the oldest waiter of the class has to wait longer
+  void grant(
+    uint64_t ticket,
+    uint64_t config,
+    bool bypassed)
+  {
+    m_numAffinityGrants = bypassed ? m_numAffinityGrants + 1 : 0;
+    if (config != 0) {
+      m_config = config;
+    }
+    m_owner = ticket;
+    m_locked = true;
+  }
+
+  // settings (see radioConfig) to change from m_config to config
+  int numChanges(
+    uint64_t config) const
+  {
+    if (config == 0) {
+      return 0;
+    }
+    uint64_t diff = config ^ m_config;
+    return ((diff & 0xFFFFFFFFFFULL) != 0)
+      + (((diff >> 40) & 0xFF) != 0)
+      + (((diff >> 48) & 0xFF) != 0)
+      + (((diff >> 56) & 0xFF) != 0);
+  }
+
+private:
+  static const size_t maxAffinityGrants = 8;
+
+  struct waiter
+  {
+    uint64_t ticket;
+    RadioPriority priority;
+    uint64_t config;
+  };
+
+  std::mutex m_mutex;
+  std::condition_variable m_condition;
+  std::list<waiter> m_waiters;
+  bool m_locked;
+  uint64_t m_owner;
+  uint64_t m_nextTicket;
+  // configuration the radio has (as requested by the current/last owner
+  // which uses the settings)
+  uint64_t m_config;
+  size_t m_numAffinityGrants;
+  std::atomic<uint32_t> m_numWaiting[RadioPriorityCount];
+};
+
+class RadioLock
+{
+public:
+  RadioLock(
+    RadioArbiter& arbiter,
+    RadioPriority priority,
+    uint64_t config)
+    : m_arbiter(arbiter)
+  {
+    m_arbiter.lock(priority, config);
+  }
+
+  ~RadioLock()
+  {
+    m_arbiter.unlock();
+  }
+
+private:
+  RadioArbiter& m_arbiter;
+};
+
+uint64_t radioConfig(
+  uint64_t address,
+  uint8_t channel,
+  Crazyradio::Datarate datarate,
+  bool ackEnable)
+{
+  return (address & 0xFFFFFFFFFFULL)
+    | ((uint64_t)channel << 40)
+    | ((uint64_t)datarate << 48)
+    | ((uint64_t)ackEnable << 56);
+}
+
+} // namespace
+
 Crazyradio* g_crazyradios[MAX_RADIOS];
-std::mutex g_radioMutex[MAX_RADIOS];
+RadioArbiter g_radioArbiter[MAX_RADIOS];
 
 CrazyflieUSB* g_crazyflieUSB[MAX_USB];
 std::mutex g_crazyflieusbMutex[MAX_USB];
 
+// simulated Crazyflies by id (sim://id), kept for the lifetime of the process
+std::map<int, std::unique_ptr<CrazyflieSim> > g_crazyflieSims;
+std::mutex g_crazyflieSimsMutex;
+
 Logger EmptyLogger;
 
+// TOC cache, shared by all Crazyflies of this process and keyed by the TOC CRC.
+// It is backed by binary files in g_tocCacheDirectory.
+std::mutex g_tocCacheMutex;
+std::string g_tocCacheDirectory;
+std::map<uint32_t, std::shared_ptr<const Crazyflie::Toc<Crazyflie::LogTocEntry> > > g_logTocCache;
+std::map<uint32_t, std::shared_ptr<const Crazyflie::Toc<Crazyflie::ParamTocEntry> > > g_paramTocCache;
+
+// incremented by Crazyflie::abortRequests; batches fail if it changes
+std::atomic<uint64_t> g_requestAbortEpoch(0);
+
+namespace {
+
+// Key used to match a batch request to its response. Responses echo the
+// header and the first numBytesToMatch bytes of the request. In CRTP mode
+// only port and channel of the header have to match (not the link bits).
+std::string batchKey(
+  const uint8_t* data,
+  size_t numBytesToMatch,
+  bool crtpMode)
+{
+  if (crtpMode) {
+    std::string key(1 + numBytesToMatch, 0);
+    key[0] = data[0] & 0xF3;
+    memcpy(&key[1], data + 1, numBytesToMatch);
+    return key;
+  }
+  return std::string(reinterpret_cast<const char*>(data), numBytesToMatch);
+}
+
+// Binary TOC cache file:
+//   magic (4 bytes), version (uint8_t), crc (uint32_t), numEntries (uint16_t)
+//   numEntries x entry: id, type, [readonly,] group, name
+//   strings are stored as uint8_t length followed by the characters
+const char tocCacheMagic[4] = {'C', 'F', 'T', 'C'};
+const uint8_t tocCacheVersion = 1;
+
+std::string tocCacheFileName(
+  const std::string& prefix,
+  uint32_t crc,
+  const std::string& extension)
+{
+  std::string fileName = prefix + std::to_string(crc) + extension;
+  if (g_tocCacheDirectory.empty()) {
+    return fileName;
+  }
+  return g_tocCacheDirectory + "/" + fileName;
+}
+
+void writeString(std::string& buffer, const std::string& str)
+{
+  // TOC strings are limited by the CRTP packet size
+  buffer.push_back((char)str.size());
+  buffer.append(str);
+}
+
+bool readString(const std::string& buffer, size_t& pos, std::string& str)
+{
+  if (pos >= buffer.size()) {
+    return false;
+  }
+  size_t len = (uint8_t)buffer[pos++];
+  if (pos + len > buffer.size()) {
+    return false;
+  }
+  str.assign(buffer, pos, len);
+  pos += len;
+  return true;
+}
+
+void writeEntry(std::string& buffer, const Crazyflie::LogTocEntry& entry)
+{
+  buffer.push_back(entry.id);
+  buffer.push_back(entry.type);
+  writeString(buffer, entry.group);
+  writeString(buffer, entry.name);
+}
+
+void writeEntry(std::string& buffer, const Crazyflie::ParamTocEntry& entry)
+{
+  buffer.push_back(entry.id);
+  buffer.push_back(entry.type);
+  buffer.push_back(entry.readonly);
+  writeString(buffer, entry.group);
+  writeString(buffer, entry.name);
+}
+
+bool readEntry(const std::string& buffer, size_t& pos, Crazyflie::LogTocEntry& entry)
+{
+  if (pos + 2 > buffer.size()) {
+    return false;
+  }
+  entry.id = buffer[pos++];
+  entry.type = (Crazyflie::LogType)(uint8_t)buffer[pos++];
+  return readString(buffer, pos, entry.group)
+      && readString(buffer, pos, entry.name);
+}
+
+bool readEntry(const std::string& buffer, size_t& pos, Crazyflie::ParamTocEntry& entry)
+{
+  if (pos + 3 > buffer.size()) {
+    return false;
+  }
+  entry.id = buffer[pos++];
+  entry.type = (Crazyflie::ParamType)(uint8_t)buffer[pos++];
+  entry.readonly = buffer[pos++];
+  return readString(buffer, pos, entry.group)
+      && readString(buffer, pos, entry.name);
+}
+
+template<class T>
+void writeTocCacheFile(
+  const std::string& fileName,
+  uint32_t crc,
+  const std::vector<T>& entries)
+{
+  std::string buffer(tocCacheMagic, sizeof(tocCacheMagic));
+  buffer.push_back(tocCacheVersion);
+  buffer.append(reinterpret_cast<const char*>(&crc), sizeof(crc));
+  uint16_t numEntries = entries.size();
+  buffer.append(reinterpret_cast<const char*>(&numEntries), sizeof(numEntries));
+  for (const auto& entry : entries) {
+    writeEntry(buffer, entry);
+  }
+
+  // write to a temporary file first, so that readers never see a partial file
+  std::string tmpFileName = fileName + ".tmp";
+  {
+    std::ofstream output(tmpFileName, std::ios::binary);
+    output.write(buffer.data(), buffer.size());
+    if (!output) {
+      return;
+    }
+  }
+  std::rename(tmpFileName.c_str(), fileName.c_str());
+}
+
+template<class T>
+bool readTocCacheFile(
+  const std::string& fileName,
+  uint32_t crc,
+  std::vector<T>& entries)
+{
+  std::ifstream input(fileName, std::ios::binary);
+  if (!input.good()) {
+    return false;
+  }
+  std::string buffer((std::istreambuf_iterator<char>(input)), std::istreambuf_iterator<char>());
+
+  const size_t headerSize = sizeof(tocCacheMagic) + 1 + sizeof(uint32_t) + sizeof(uint16_t);
+  if (buffer.size() < headerSize
+      || memcmp(buffer.data(), tocCacheMagic, sizeof(tocCacheMagic)) != 0
+      || (uint8_t)buffer[sizeof(tocCacheMagic)] != tocCacheVersion) {
+    return false;
+  }
+  size_t pos = sizeof(tocCacheMagic) + 1;
+  uint32_t fileCrc;
+  memcpy(&fileCrc, &buffer[pos], sizeof(fileCrc));
+  pos += sizeof(fileCrc);
+  uint16_t numEntries;
+  memcpy(&numEntries, &buffer[pos], sizeof(numEntries));
+  pos += sizeof(numEntries);
+  if (fileCrc != crc) {
+    return false;
+  }
+
+  entries.resize(numEntries);
+  for (auto& entry : entries) {
+    if (!readEntry(buffer, pos, entry)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+void readJsonEntry(const pt::ptree& node, Crazyflie::LogTocEntry& entry)
+{
+  entry.id = node.get<uint8_t>("id");
+  entry.type = (Crazyflie::LogType)node.get<int>("type");
+  entry.group = node.get<std::string>("group");
+  entry.name = node.get<std::string>("name");
+}
+
+void readJsonEntry(const pt::ptree& node, Crazyflie::ParamTocEntry& entry)
+{
+  entry.id = node.get<uint8_t>("id");
+  entry.type = (Crazyflie::ParamType)node.get<int>("type");
+  entry.readonly = node.get<bool>("readonly");
+  entry.group = node.get<std::string>("group");
+  entry.name = node.get<std::string>("name");
+}
+
+// cache files written by older versions
+template<class T>
+bool readJsonTocCacheFile(
+  const std::string& fileName,
+  std::vector<T>& entries)
+{
+  std::ifstream input(fileName);
+  if (!input.good()) {
+    return false;
+  }
+  try {
+    pt::ptree root;
+    pt::read_json(input, root);
+    entries.clear();
+    for (const auto& item : root.get_child("entries")) {
+      entries.resize(entries.size() + 1);
+      readJsonEntry(item.second, entries.back());
+    }
+  } catch (const pt::ptree_error&) {
+    return false;
+  }
+  return true;
+}
+
+// Returns the TOC with the given CRC from the process-wide cache, loading
+// it from disk if needed. Returns nullptr if it is not cached.
+// Requires g_tocCacheMutex to be locked.
+template<class T>
+std::shared_ptr<const Crazyflie::Toc<T> > loadToc(
+  std::map<uint32_t, std::shared_ptr<const Crazyflie::Toc<T> > >& cache,
+  const std::string& prefix,
+  uint32_t crc,
+  size_t len)
+{
+  // a TOC of a different length (with the same CRC) is downloaded again
+  auto iter = cache.find(crc);
+  if (iter != cache.end()) {
+    if (iter->second->entries.size() != len) {
+      return nullptr;
+    }
+    return iter->second;
+  }
+
+  std::shared_ptr<Crazyflie::Toc<T> > toc(new Crazyflie::Toc<T>());
+  std::string fileName = tocCacheFileName(prefix, crc, ".bin");
+  if (!readTocCacheFile(fileName, crc, toc->entries)) {
+    if (!readJsonTocCacheFile(tocCacheFileName(prefix, crc, ".json"), toc->entries)) {
+      return nullptr;
+    }
+    writeTocCacheFile(fileName, crc, toc->entries);
+  }
+  if (toc->entries.size() != len) {
+    return nullptr;
+  }
+  toc->buildIndex();
+  cache[crc] = toc;
+  return toc;
+}
+
+template<class T>
+void storeToc(
+  std::map<uint32_t, std::shared_ptr<const Crazyflie::Toc<T> > >& cache,
+  const std::string& prefix,
+  uint32_t crc,
+  std::shared_ptr<const Crazyflie::Toc<T> > toc)
+{
+  std::unique_lock<std::mutex> lock(g_tocCacheMutex);
+  cache[crc] = toc;
+  writeTocCacheFile(tocCacheFileName(prefix, crc, ".bin"), crc, toc->entries);
+}
+
+} // namespace
+
 
 Crazyflie::Crazyflie(
   const std::string& link_uri,
   Logger& logger)
   : m_radio(nullptr)
   , m_transport(nullptr)
+  , m_transportMutex(nullptr)
   , m_devId(0)
   , m_channel(0)
   , m_address(0)
   , m_datarate(Crazyradio::Datarate_250KPS)
-  , m_logTocEntries()
+  , m_logToc(new Toc<LogTocEntry>())
   , m_logBlockCb()
-  , m_paramTocEntries()
+  , m_paramToc(new Toc<ParamTocEntry>())
   , m_paramValues()
   , m_emptyAckCallback(nullptr)
   , m_linkQualityCallback(nullptr)
   , m_consoleCallback(nullptr)
+  , m_linkCounters()
   , m_lastTrajectoryId(0)
+  , m_batchRequests()
+  , m_numRequestsFinished(0)
+  , m_batchIndex()
+  , m_batchMatchLengths()
+  , m_batchWindow(8)
+  , m_batchRetransmitTimeout(0.01)
   , m_logger(logger)
 {
   int datarate;
@@ -86,7 +557,7 @@ Crazyflie::Crazyflie(
     }
 
     {
-      std::unique_lock<std::mutex> mlock(g_radioMutex[m_devId]);
+      RadioLock lock(g_radioArbiter[m_devId], RadioPriorityDefault, 0);
       if (!g_crazyradios[m_devId]) {
         g_crazyradios[m_devId] = new Crazyradio(m_devId);
         // g_crazyradios[m_devId]->setAckEnable(false);
@@ -97,6 +568,30 @@ Crazyflie::Crazyflie(
 
     m_radio = g_crazyradios[m_devId];
   }
+  else if (link_uri.compare(0, 6, "sim://") == 0) {
+    // sim://id[/latency in ms[/loss in percent]]
+    double latency = 0;
+    double loss = 0;
+    success = std::sscanf(link_uri.c_str(), "sim://%d/%lf/%lf",
+       &m_devId, &latency, &loss) >= 1;
+
+    if (success) {
+      CrazyflieSim::Config config;
+      config.latency = latency / 1000.0;
+      config.loss = loss / 100.0;
+      config.seed = m_devId;
+
+      std::unique_lock<std::mutex> mlock(g_crazyflieSimsMutex);
+      auto& sim = g_crazyflieSims[m_devId];
+      if (!sim) {
+        sim.reset(new CrazyflieSim(config));
+      } else if (sim->config().latency != config.latency || sim->config().loss != config.loss) {
+        // the sim of an id is shared by all of its URIs
+        throw std::runtime_error("Simulated Crazyflie " + std::to_string(m_devId) + " is already used with a different latency or loss!");
+      }
+      m_transport = sim.get();
+    }
+  }
   else {
     success = std::sscanf(link_uri.c_str(), "usb://%d",
        &m_devId) == 1;
@@ -113,6 +608,7 @@ Crazyflie::Crazyflie(
     }
 
     m_transport = g_crazyflieUSB[m_devId];
+    m_transportMutex = &g_crazyflieusbMutex[m_devId];
   }
 
   if (!success) {
@@ -257,35 +753,17 @@ void Crazyflie::writeFlash(
   // write flash
   size_t offset = 0;
   uint16_t usedBuffers = 0;
-  // startBatchRequest();
+  // buffer loads of the current set of buffers; only acked, so they are
+  // streamed through the radio pipeline and resent if the ack is missing
+  std::vector<bootloaderLoadBufferRequest> loads;
+  std::vector<ITransport::Packet> packets;
   for (uint16_t page = flashStart; page < numPages + flashStart; ++page) {
     for (uint16_t address = 0; address < pageSize; address += 25) {
-      // std::cout << "request: " << page << " " << address << std::endl;
-      bootloaderLoadBufferRequest req(target, usedBuffers, address);
+      loads.push_back(bootloaderLoadBufferRequest(target, usedBuffers, address));
       size_t requestedSize = std::min<size_t>(data.size() - offset, std::min<size_t>(25, pageSize - address));
-      memcpy(req.data, &data[offset], requestedSize);
-      // addRequest(req, 0);
-      // for (size_t i = 0; i < 10; ++i)
-      // std::cout << "request: " << req.page << " " << req.address << " " << requestedSize << std::endl;
-      // for (size_t i = 0; i < 10; ++i) {
-
-      auto start = std::chrono::system_clock::now();
-      // while (true) {
-        sendPacketOrTimeout((uint8_t*)&req, 7 + requestedSize);
-      //   startBatchRequest();
-      //   bootloaderReadBufferRequest req2(target, usedBuffers, address);
-      //   addRequest(req2, 7);
-      //   handleRequests(/*crtpMode=*/false);
-      //   const bootloaderReadBufferResponse* response = getRequestResult<bootloaderReadBufferResponse>(0);
-      //   if (memcmp(req.data, response->data, requestedSize) == 0) {
-      //     break;
-      //   }
-      //   auto end = std::chrono::system_clock::now();
-      //   std::chrono::duration<double> elapsedSeconds = end-start;
-      //   if (elapsedSeconds.count() > 1.0) {
-      //     throw std::runtime_error("timeout");
-      //   }
-      // }
+      memcpy(loads.back().data, &data[offset], requestedSize);
+      ITransport::Packet packet = {nullptr, (uint32_t)(7 + requestedSize)};
+      packets.push_back(packet);
       offset += requestedSize;
       if (offset >= data.size()) {
         break;
@@ -295,24 +773,12 @@ void Crazyflie::writeFlash(
     if (usedBuffers == nBuffPage
         || page == numPages + flashStart - 1) {
 
-
-      // startBatchRequest();
-      // for (uint16_t buf = 0; buf < usedBuffers; ++buf) {
-      //   for (uint16_t address = 0; address < pageSize; address += 25) {
-      //     // std::cout << "request: " << page << " " << address << std::endl;
-      //     bootloaderReadBufferRequest req(target, buf, address);
-      //     addRequest(req, 7);
-      //   }
-      // }
-      // handleRequests(/*crtpMode=*/false);
-
-
-      // upload all the buffers now
-      // std::cout << "try to upload buffers!" << std::endl;
-      // handleRequests(/*crtpMode=*/false);
-      // std::cout << "buffers uploaded!" << std::endl;
-
-      // std::this_thread::sleep_for(std::chrono::milliseconds(100));
+      for (size_t i = 0; i < loads.size(); ++i) {
+        packets[i].data = reinterpret_cast<const uint8_t*>(&loads[i]);
+      }
+      sendPacketsOrTimeout(packets.data(), packets.size());
+      loads.clear();
+      packets.clear();
 
       // write flash
       bootloaderWriteFlashRequest req(target, 0, page - usedBuffers + 1, usedBuffers);
@@ -448,10 +914,13 @@ void Crazyflie::requestLogToc(bool forceNoCache)
   uint32_t crc = getRequestResult<crtpLogGetInfoResponse>(0)->log_crc;
 
   // check if it is in the cache
-  std::string fileName = "log" + std::to_string(crc) + ".json";
-  std::ifstream infile(fileName);
+  std::shared_ptr<const Toc<LogTocEntry> > toc;
+  if (!forceNoCache) {
+    std::unique_lock<std::mutex> lock(g_tocCacheMutex);
+    toc = loadToc(g_logTocCache, "log", crc, len);
+  }
 
-  if (forceNoCache || !infile.good()) {
+  if (!toc) {
     m_logger.info("Log: " + std::to_string(len));
 
     // Request detailed information
@@ -463,47 +932,24 @@ void Crazyflie::requestLogToc(bool forceNoCache)
     handleRequests();
 
     // Update internal structure with obtained data
-    m_logTocEntries.resize(len);
+    std::shared_ptr<Toc<LogTocEntry> > newToc(new Toc<LogTocEntry>());
+    newToc->entries.resize(len);
     for (size_t i = 0; i < len; ++i) {
       auto response = getRequestResult<crtpLogGetItemResponse>(i);
-      LogTocEntry& entry = m_logTocEntries[i];
+      LogTocEntry& entry = newToc->entries[i];
       entry.id = i;
       entry.type = (LogType)response->type;
       entry.group = std::string(&response->text[0]);
       entry.name = std::string(&response->text[entry.group.size() + 1]);
     }
+    newToc->buildIndex();
+    toc = newToc;
 
-    // Write a cache file
-    {
-      pt::ptree root;
-      pt::ptree entriesNode;
-      for (const auto& entry : m_logTocEntries) {
-        pt::ptree entryNode;
-        entryNode.put("id", entry.id);
-        entryNode.put("type", entry.type);
-        entryNode.put("group", entry.group);
-        entryNode.put("name", entry.name);
-        // entriesNode.put("", entryNode);
-        entriesNode.push_back(std::make_pair("", entryNode));
-      }
-      root.add_child("entries", entriesNode);
-      std::ofstream output(fileName);
-      write_json(output, root);
-    }
+    storeToc(g_logTocCache, "log", crc, toc);
   } else {
     m_logger.info("Found variables in cache.");
-
-    pt::ptree root;
-    pt::read_json(fileName, root);
-    m_logTocEntries.clear();
-    for (const auto& item : root.get_child("entries")) {
-      m_logTocEntries.resize(m_logTocEntries.size() + 1);
-      m_logTocEntries.back().id = item.second.get<uint8_t>("id");
-      m_logTocEntries.back().type = (LogType)item.second.get<int>("type");
-      m_logTocEntries.back().group = item.second.get<std::string>("group");
-      m_logTocEntries.back().name = item.second.get<std::string>("name");
-    }
   }
+  m_logToc = toc;
 }
 
 void Crazyflie::requestParamToc(bool forceNoCache)
@@ -517,10 +963,13 @@ void Crazyflie::requestParamToc(bool forceNoCache)
   uint32_t crc = getRequestResult<crtpParamTocGetInfoResponse>(0)->crc;
 
   // check if it is in the cache
-  std::string fileName = "params" + std::to_string(crc) + ".json";
-  std::ifstream infile(fileName);
+  std::shared_ptr<const Toc<ParamTocEntry> > toc;
+  if (!forceNoCache) {
+    std::unique_lock<std::mutex> lock(g_tocCacheMutex);
+    toc = loadToc(g_paramTocCache, "params", crc, len);
+  }
 
-  if (forceNoCache || !infile.good()) {
+  if (!toc) {
     m_logger.info("Params: " + std::to_string(len));
 
     // Request detailed information and values
@@ -534,12 +983,13 @@ void Crazyflie::requestParamToc(bool forceNoCache)
     handleRequests();
 
     // Update internal structure with obtained data
-    m_paramTocEntries.resize(len);
+    std::shared_ptr<Toc<ParamTocEntry> > newToc(new Toc<ParamTocEntry>());
+    newToc->entries.resize(len);
     for (size_t i = 0; i < len; ++i) {
       auto r = getRequestResult<crtpParamTocGetItemResponse>(i*2+0);
       auto val = getRequestResult<crtpParamValueResponse>(i*2+1);
 
-      ParamTocEntry& entry = m_paramTocEntries[i];
+      ParamTocEntry& entry = newToc->entries[i];
       entry.id = i;
       entry.type = (ParamType)(r->length | r-> type << 2 | r->sign << 3);
       entry.readonly = r->readonly;
@@ -550,40 +1000,13 @@ void Crazyflie::requestParamToc(bool forceNoCache)
       std::memcpy(&v, &val->valueFloat, 4);
       m_paramValues[i] = v;
     }
+    newToc->buildIndex();
+    toc = newToc;
 
-    // Write a cache file
-    {
-      pt::ptree root;
-      pt::ptree entriesNode;
-      for (const auto& entry : m_paramTocEntries) {
-        pt::ptree entryNode;
-        entryNode.put("id", entry.id);
-        entryNode.put("type", entry.type);
-        entryNode.put("readonly", entry.readonly);
-        entryNode.put("group", entry.group);
-        entryNode.put("name", entry.name);
-        // entriesNode.put("", entryNode);
-        entriesNode.push_back(std::make_pair("", entryNode));
-      }
-      root.add_child("entries", entriesNode);
-      std::ofstream output(fileName);
-      write_json(output, root);
-    }
+    storeToc(g_paramTocCache, "params", crc, toc);
   } else {
     m_logger.info("Found variables in cache.");
 
-    pt::ptree root;
-    pt::read_json(fileName, root);
-    m_paramTocEntries.clear();
-    for (const auto& item : root.get_child("entries")) {
-      m_paramTocEntries.resize(m_paramTocEntries.size() + 1);
-      m_paramTocEntries.back().id = item.second.get<uint8_t>("id");
-      m_paramTocEntries.back().type = (ParamType)item.second.get<int>("type");
-      m_paramTocEntries.back().readonly = item.second.get<bool>("readonly");
-      m_paramTocEntries.back().group = item.second.get<std::string>("group");
-      m_paramTocEntries.back().name = item.second.get<std::string>("name");
-    }
-
     // Request values
     startBatchRequest();
     for (size_t i = 0; i < len; ++i) {
@@ -598,6 +1021,19 @@ void Crazyflie::requestParamToc(bool forceNoCache)
       m_paramValues[i] = v;
     }
   }
+  m_paramToc = toc;
+}
+
+void Crazyflie::setTocCacheDirectory(
+  const std::string& directory)
+{
+  std::unique_lock<std::mutex> lock(g_tocCacheMutex);
+  g_tocCacheDirectory = directory;
+}
+
+void Crazyflie::abortRequests()
+{
+  ++g_requestAbortEpoch;
 }
 
 void Crazyflie::startSetParamRequest()
@@ -608,62 +1044,57 @@ void Crazyflie::startSetParamRequest()
 void Crazyflie::addSetParam(uint8_t id, const ParamValue& value) {
 
   // startBatchRequest();
-  bool found = false;
-  for (auto&& entry : m_paramTocEntries) {
-    if (entry.id == id) {
-      found = true;
-      switch (entry.type) {
-        case ParamTypeUint8:
-          {
-            crtpParamWriteRequest<uint8_t> request(id, value.valueUint8);
-            addRequest(request, 1);
-            break;
-          }
-        case ParamTypeInt8:
-          {
-            crtpParamWriteRequest<int8_t> request(id, value.valueInt8);
-            addRequest(request, 1);
-            break;
-          }
-        case ParamTypeUint16:
-          {
-            crtpParamWriteRequest<uint16_t> request(id, value.valueUint16);
-            addRequest(request, 1);
-            break;
-          }
-        case ParamTypeInt16:
-          {
-            crtpParamWriteRequest<int16_t> request(id, value.valueInt16);
-            addRequest(request, 1);
-            break;
-          }
-        case ParamTypeUint32:
-          {
-            crtpParamWriteRequest<uint32_t> request(id, value.valueUint32);
-            addRequest(request, 1);
-            break;
-          }
-        case ParamTypeInt32:
-          {
-            crtpParamWriteRequest<int32_t> request(id, value.valueInt32);
-            addRequest(request, 1);
-            break;
-          }
-        case ParamTypeFloat:
-          {
-            crtpParamWriteRequest<float> request(id, value.valueFloat);
-            addRequest(request, 1);
-            break;
-          }
-      }
-    }
-  }
-
-  if (!found) {
+  const ParamTocEntry* entry = m_paramToc->find(id);
+  if (!entry) {
     std::stringstream sstr;
-    sstr << "Could not find parameter with id " << id;
+    sstr << "Could not find parameter with id " << (int)id;
     throw std::runtime_error(sstr.str());
   }
+
+  switch (entry->type) {
+    case ParamTypeUint8:
+      {
+        crtpParamWriteRequest<uint8_t> request(id, value.valueUint8);
+        addRequest(request, 1);
+        break;
+      }
+    case ParamTypeInt8:
+      {
+        crtpParamWriteRequest<int8_t> request(id, value.valueInt8);
+        addRequest(request, 1);
+        break;
+      }
+    case ParamTypeUint16:
+      {
+        crtpParamWriteRequest<uint16_t> request(id, value.valueUint16);
+        addRequest(request, 1);
+        break;
+      }
+    case ParamTypeInt16:
+      {
+        crtpParamWriteRequest<int16_t> request(id, value.valueInt16);
+        addRequest(request, 1);
+        break;
+      }
+    case ParamTypeUint32:
+      {
+        crtpParamWriteRequest<uint32_t> request(id, value.valueUint32);
+        addRequest(request, 1);
+        break;
+      }
+    case ParamTypeInt32:
+      {
+        crtpParamWriteRequest<int32_t> request(id, value.valueInt32);
+        addRequest(request, 1);
+        break;
+      }
+    case ParamTypeFloat:
+      {
+        crtpParamWriteRequest<float> request(id, value.valueFloat);
+        addRequest(request, 1);
+        break;
+      }
+  }
   // handleRequests();
 
   m_paramValues[id] = value;
@@ -680,7 +1111,57 @@ void Crazyflie::setParam(uint8_t id, const ParamValue& value) {
   setRequestedParams();
 }
 
+void Crazyflie::requestParams(
+  const std::vector<uint8_t>& ids)
+{
+  startBatchRequest();
+  for (uint8_t id : ids) {
+    crtpParamReadRequest request(id);
+    addRequest(request, 1);
+  }
+  handleRequests();
+  for (size_t i = 0; i < ids.size(); ++i) {
+    auto val = getRequestResult<crtpParamValueResponse>(i);
+    ParamValue v;
+    std::memcpy(&v, &val->valueFloat, 4);
+    m_paramValues[ids[i]] = v;
+  }
+}
+
+
+
+namespace {
+
+// duration, poly_x, poly_y, poly_z, poly_yaw
+const size_t trajectoryPieceNumValues = 33;
+const size_t trajectoryPieceValuesPerPacket = 6;
+
+void trajectoryPieceValues(
+  const Crazyflie::TrajectoryPiece& piece,
+  float* values)
+{
+  values[0] = piece.duration;
+  memcpy(&values[1], piece.poly_x, sizeof(piece.poly_x));
+  memcpy(&values[9], piece.poly_y, sizeof(piece.poly_y));
+  memcpy(&values[17], piece.poly_z, sizeof(piece.poly_z));
+  memcpy(&values[25], piece.poly_yaw, sizeof(piece.poly_yaw));
+}
+
+void trajectoryPiecePacket(
+  const float* values,
+  uint8_t id,
+  size_t packet,
+  crtpTrajectoryAddRequest& request)
+{
+  size_t offset = packet * trajectoryPieceValuesPerPacket;
+  size_t size = std::min(trajectoryPieceValuesPerPacket, trajectoryPieceNumValues - offset);
+  request.data.id = id;
+  request.data.offset = offset;
+  request.data.size = size;
+  memcpy(request.data.values, &values[offset], size * sizeof(float));
+}
 
+} // namespace
 
 void Crazyflie::trajectoryReset()
 {
@@ -698,77 +1179,80 @@ void Crazyflie::trajectoryAdd(
     std::vector<float> poly_z,
     std::vector<float> poly_yaw)
 {
-  crtpTrajectoryAddRequest request;
-  request.data.id = m_lastTrajectoryId;
+  std::vector<TrajectoryPiece> pieces(1);
+  TrajectoryPiece& piece = pieces[0];
+  piece.duration = duration;
+  for (size_t i = 0; i < 8; ++i) {
+    piece.poly_x[i] = i < poly_x.size() ? poly_x[i] : 0;
+    piece.poly_y[i] = i < poly_y.size() ? poly_y[i] : 0;
+    piece.poly_z[i] = i < poly_z.size() ? poly_z[i] : 0;
+    piece.poly_yaw[i] = i < poly_yaw.size() ? poly_yaw[i] : 0;
+  }
+  trajectoryAdd(pieces);
+}
+
+void Crazyflie::trajectoryAdd(
+  const std::vector<TrajectoryPiece>& pieces,
+  const std::vector<uint8_t>& sharedPackets)
+{
+  if (pieces.empty()) {
+    return;
+  }
 
   startBatchRequest();
 
-  // Part 1
-  request.data.offset = 0;
-  request.data.size = 6;
-  request.data.values[0] = duration;
-  request.data.values[1] = poly_x[0];
-  request.data.values[2] = poly_x[1];
-  request.data.values[3] = poly_x[2];
-  request.data.values[4] = poly_x[3];
-  request.data.values[5] = poly_x[4];
-  addRequest(request, 3);
-
-  // Part 2
-  request.data.offset = 6;
-  request.data.size = 6;
-  request.data.values[0] = poly_x[5];
-  request.data.values[1] = poly_x[6];
-  request.data.values[2] = poly_x[7];
-  request.data.values[3] = poly_y[0];
-  request.data.values[4] = poly_y[1];
-  request.data.values[5] = poly_y[2];
-  addRequest(request, 3);
-
-  // Part 3
-  request.data.offset = 12;
-  request.data.size = 6;
-  request.data.values[0] = poly_y[3];
-  request.data.values[1] = poly_y[4];
-  request.data.values[2] = poly_y[5];
-  request.data.values[3] = poly_y[6];
-  request.data.values[4] = poly_y[7];
-  request.data.values[5] = poly_z[0];
-  addRequest(request, 3);
-
-  // Part 4
-  request.data.offset = 18;
-  request.data.size = 6;
-  request.data.values[0] = poly_z[1];
-  request.data.values[1] = poly_z[2];
-  request.data.values[2] = poly_z[3];
-  request.data.values[3] = poly_z[4];
-  request.data.values[4] = poly_z[5];
-  request.data.values[5] = poly_z[6];
-  addRequest(request, 3);
-
-  // Part 5
-  request.data.offset = 24;
-  request.data.size = 6;
-  request.data.values[0] = poly_z[7];
-  request.data.values[1] = poly_yaw[0];
-  request.data.values[2] = poly_yaw[1];
-  request.data.values[3] = poly_yaw[2];
-  request.data.values[4] = poly_yaw[3];
-  request.data.values[5] = poly_yaw[4];
-  addRequest(request, 3);
-
-  // Part 6
-  request.data.offset = 30;
-  request.data.size = 3;
-  request.data.values[0] = poly_yaw[5];
-  request.data.values[1] = poly_yaw[6];
-  request.data.values[2] = poly_yaw[7];
-  addRequest(request, 3);
-
-  handleRequests(5.0, 0.05, 17);
-
-  ++m_lastTrajectoryId;
+  float values[trajectoryPieceNumValues];
+  crtpTrajectoryAddRequest request;
+  for (size_t i = 0; i < pieces.size(); ++i) {
+    trajectoryPieceValues(pieces[i], values);
+    uint8_t shared = i < sharedPackets.size() ? sharedPackets[i] : 0;
+    for (size_t j = 0; j < TrajectoryPieceNumPackets; ++j) {
+      if (!(shared & (1 << j))) {
+        trajectoryPiecePacket(values, m_lastTrajectoryId, j, request);
+        // the response echoes command, id and offset
+        addRequest(request, 3);
+      }
+    }
+    ++m_lastTrajectoryId;
+  }
+
+  // Responses are matched by piece id and offset, so all pieces are streamed
+  // through the batch window without waiting for each other.
+  handleRequests(/*crtpMode*/ true, /*baseTime*/ 2.0, /*timePerRequest*/ 0.05);
+}
+
+std::vector<uint8_t> Crazyflie::sharedTrajectoryPackets(
+  const std::vector<const std::vector<TrajectoryPiece>*>& trajectories)
+{
+  std::vector<uint8_t> result;
+  if (trajectories.empty()) {
+    return result;
+  }
+
+  size_t numPieces = trajectories[0]->size();
+  for (auto trajectory : trajectories) {
+    numPieces = std::min(numPieces, trajectory->size());
+  }
+  result.resize(numPieces, 0);
+
+  float reference[trajectoryPieceNumValues];
+  float values[trajectoryPieceNumValues];
+  for (size_t k = 0; k < numPieces; ++k) {
+    trajectoryPieceValues((*trajectories[0])[k], reference);
+    uint8_t shared = (1 << TrajectoryPieceNumPackets) - 1;
+    for (size_t t = 1; t < trajectories.size() && shared; ++t) {
+      trajectoryPieceValues((*trajectories[t])[k], values);
+      for (size_t j = 0; j < TrajectoryPieceNumPackets; ++j) {
+        size_t offset = j * trajectoryPieceValuesPerPacket;
+        size_t size = std::min(trajectoryPieceValuesPerPacket, trajectoryPieceNumValues - offset);
+        if (memcmp(&reference[offset], &values[offset], size * sizeof(float)) != 0) {
+          shared &= ~(1 << j);
+        }
+      }
+    }
+    result[k] = shared;
+  }
+  return result;
 }
 
 void Crazyflie::trajectoryHover(
@@ -911,49 +1395,148 @@ bool Crazyflie::sendPacket(
   }
 }
 
-void Crazyflie::sendPacket(
-  const uint8_t* data,
-  uint32_t length,
-  Crazyradio::Ack& ack)
+void Crazyflie::sendPacketsOrTimeout(
+  const ITransport::Packet* packets,
+  size_t numPackets,
+  float timeout)
 {
-  static uint32_t numPackets = 0;
-  static uint32_t numAcks = 0;
-
-  numPackets++;
-
-  if (m_radio) {
-    std::unique_lock<std::mutex> mlock(g_radioMutex[m_devId]);
-    if (m_radio->getAddress() != m_address) {
-      m_radio->setAddress(m_address);
-    }
-    if (m_radio->getChannel() != m_channel) {
-      m_radio->setChannel(m_channel);
+  std::vector<ITransport::Packet> pending(packets, packets + numPackets);
+  std::vector<Crazyradio::Ack> acks;
+  auto start = std::chrono::system_clock::now();
+  while (!pending.empty()) {
+    acks.resize(pending.size());
+    sendPackets(pending.data(), pending.size(), acks.data());
+
+    // keep the packets which were not acknowledged
+    size_t numPending = 0;
+    for (size_t i = 0; i < pending.size(); ++i) {
+      if (!acks[i].ack) {
+        pending[numPending++] = pending[i];
+      }
     }
-    if (m_radio->getDatarate() != m_datarate) {
-      m_radio->setDatarate(m_datarate);
+
+    auto end = std::chrono::system_clock::now();
+    if (numPending < pending.size()) {
+      start = end;
     }
-    if (!m_radio->getAckEnable()) {
-      m_radio->setAckEnable(true);
+    pending.resize(numPending);
+    std::chrono::duration<double> elapsedSeconds = end-start;
+    if (!pending.empty() && elapsedSeconds.count() > timeout) {
+      throw std::runtime_error("timeout");
+    }
+  }
+}
+
+void Crazyflie::sendPacket(
+  const uint8_t* data,
+  uint32_t length,
+  Crazyradio::Ack& ack,
+  RadioPriority priority)
+{
+  ITransport::Packet packet = {data, length};
+  sendPackets(&packet, 1, &ack, priority);
+}
+
+void Crazyflie::sendPackets(
+  const ITransport::Packet* packets,
+  size_t numPackets,
+  Crazyradio::Ack* results,
+  RadioPriority priority)
+{
+  if (m_radio) {
+    RadioArbiter& arbiter = g_radioArbiter[m_devId];
+    uint64_t config = radioConfig(m_address, m_channel, m_datarate, true);
+    size_t i = 0;
+    while (i < numPackets) {
+      auto requested = std::chrono::steady_clock::now();
+      RadioLock lock(arbiter, priority, config);
+      m_radio->configure(m_address, m_channel, m_datarate, true);
+      do {
+        size_t count = std::min<size_t>(m_radio->getPipelineDepth(), numPackets - i);
+        auto started = std::chrono::steady_clock::now();
+        m_radio->sendPackets(packets + i, count, results + i);
+        auto finished = std::chrono::steady_clock::now();
+        countTransfer(requested, started, finished);
+        requested = finished;
+        i += count;
+      } while (i < numPackets && !arbiter.preempted(priority));
     }
-    m_radio->sendPacket(data, length, ack);
   } else {
-    std::unique_lock<std::mutex> mlock(g_crazyflieusbMutex[m_devId]);
-    m_transport->sendPacket(data, length, ack);
+    auto requested = std::chrono::steady_clock::now();
+    std::unique_lock<std::mutex> mlock;
+    if (m_transportMutex) {
+      mlock = std::unique_lock<std::mutex>(*m_transportMutex);
+    }
+    auto started = std::chrono::steady_clock::now();
+    m_transport->sendPackets(packets, numPackets, results);
+    countTransfer(requested, started, std::chrono::steady_clock::now());
   }
-  ack.data[ack.size] = 0;
-  if (ack.ack) {
-    handleAck(ack);
-    numAcks++;
-  }
-  if (numPackets == 100) {
-    if (m_linkQualityCallback) {
-      // We just take the ratio of sent vs. acked packets here
-      // for a sliding window of 100 packets
-      float linkQuality = numAcks / (float)numPackets;
+
+  uint32_t numAcked = 0;
+  uint32_t numRetries = 0;
+  for (size_t i = 0; i < numPackets; ++i) {
+    Crazyradio::Ack& ack = results[i];
+    ack.data[ack.size] = 0;
+    numRetries += ack.retry;
+    if (ack.ack) {
+      handleAck(ack);
+      ++numAcked;
+    }
+  }
+
+  uint64_t sent = m_linkCounters.numSent.fetch_add(numPackets) + numPackets;
+  uint64_t acked = m_linkCounters.numAcked.fetch_add(numAcked) + numAcked;
+  m_linkCounters.numRetries.fetch_add(numRetries);
+  if (m_linkQualityCallback && sent / 100 != (sent - numPackets) / 100) {
+    // We just take the ratio of sent vs. acked packets here
+    // for a sliding window of (about) 100 packets
+    uint64_t window = m_linkCounters.linkQualityWindow.exchange(
+      (sent << 32) | (acked & 0xFFFFFFFF));
+    uint32_t windowSent = (uint32_t)sent - (uint32_t)(window >> 32);
+    uint32_t windowAcked = (uint32_t)acked - (uint32_t)window;
+    if (windowSent > 0) {
+      float linkQuality = std::min(windowAcked / (float)windowSent, 1.0f);
       m_linkQualityCallback(linkQuality);
     }
-    numPackets = 0;
-    numAcks = 0;
+  }
+}
+
+void Crazyflie::countTransfer(
+  std::chrono::steady_clock::time_point requested,
+  std::chrono::steady_clock::time_point started,
+  std::chrono::steady_clock::time_point finished)
+{
+  uint64_t wait = std::chrono::duration_cast<std::chrono::nanoseconds>(started - requested).count();
+  uint64_t duration = std::chrono::duration_cast<std::chrono::nanoseconds>(finished - started).count();
+  m_linkCounters.numTransfers.fetch_add(1);
+  m_linkCounters.transferTime.fetch_add(duration);
+  m_linkCounters.waitTime.fetch_add(wait);
+  uint64_t max = m_linkCounters.maxTransferTime.load();
+  while (duration > max
+    && !m_linkCounters.maxTransferTime.compare_exchange_weak(max, duration)) {
+  }
+}
+
+void Crazyflie::readLinkStatistics(
+  linkStatistics& stats)
+{
+  stats.numSent = m_linkCounters.numSent.load();
+  stats.numAcked = m_linkCounters.numAcked.load();
+  stats.numRetries = m_linkCounters.numRetries.load();
+  stats.numRSSI = m_linkCounters.numRSSI.load();
+  stats.rssiSum = m_linkCounters.rssiSum.load();
+  stats.numTransfers = m_linkCounters.numTransfers.load();
+  stats.transferTime = m_linkCounters.transferTime.load();
+  stats.maxTransferTime = m_linkCounters.maxTransferTime.exchange(0);
+  stats.waitTime = m_linkCounters.waitTime.load();
+}
+
+void Crazyflie::setRadioPipelineDepth(
+  uint32_t depth)
+{
+  if (m_radio) {
+    RadioLock lock(g_radioArbiter[m_devId], RadioPriorityDefault, 0);
+    m_radio->setPipelineDepth(depth);
   }
 }
 
@@ -1001,6 +1584,8 @@ void Crazyflie::handleAck(
   }
   else if (crtpPlatformRSSIAck::match(result)) {
     crtpPlatformRSSIAck* r = (crtpPlatformRSSIAck*)result.data;
+    m_linkCounters.numRSSI.fetch_add(1);
+    m_linkCounters.rssiSum.fetch_add(r->rssi);
     if (m_emptyAckCallback) {
       m_emptyAckCallback(r);
     }
@@ -1023,24 +1608,14 @@ const Crazyflie::LogTocEntry* Crazyflie::getLogTocEntry(
   const std::string& group,
   const std::string& name) const
 {
-  for (auto&& entry : m_logTocEntries) {
-    if (entry.group == group && entry.name == name) {
-      return &entry;
-    }
-  }
-  return nullptr;
+  return m_logToc->find(group + "." + name);
 }
 
 const Crazyflie::ParamTocEntry* Crazyflie::getParamTocEntry(
   const std::string& group,
   const std::string& name) const
 {
-  for (auto&& entry : m_paramTocEntries) {
-    if (entry.group == group && entry.name == name) {
-      return &entry;
-    }
-  }
-  return nullptr;
+  return m_paramToc->find(group + "." + name);
 }
 
 uint8_t Crazyflie::registerLogBlock(
@@ -1052,12 +1627,13 @@ uint8_t Crazyflie::registerLogBlock(
       return id;
     }
   }
+  throw std::runtime_error("No free log block id!");
 }
 
 bool Crazyflie::unregisterLogBlock(
   uint8_t id)
 {
-  m_logBlockCb.erase(m_logBlockCb.find(id));
+  return m_logBlockCb.erase(id) > 0;
 }
 
 // Batch system
@@ -1076,6 +1652,7 @@ void Crazyflie::addRequest(
   m_batchRequests.back().request.resize(numBytes);
   memcpy(m_batchRequests.back().request.data(), data, numBytes);
   m_batchRequests.back().numBytesToMatch = numBytesToMatch;
+  m_batchRequests.back().sent = false;
   m_batchRequests.back().finished = false;
 }
 
@@ -1085,52 +1662,105 @@ void Crazyflie::handleRequests(
   float timePerRequest,
   int additionalSleep)
 {
-  auto start = std::chrono::system_clock::now();
-  Crazyradio::Ack ack;
-  m_numRequestsFinished = 0;
-  bool sendPing = false;
+  typedef std::chrono::steady_clock clock;
 
+  // Requests (and pings) are handed to the transport in chunks, which allows
+  // a pipelined radio to keep several of them in flight.
+  const size_t maxChunkSize = 32;
+
+  auto start = clock::now();
   float timeout = baseTime + timePerRequest * m_batchRequests.size();
+  uint64_t abortEpoch = g_requestAbortEpoch;
+
+  // The bootloader (non-CRTP mode) answers in the ack of the request itself,
+  // so there is no point in waiting before resending.
+  const clock::duration retransmitTimeout = crtpMode
+    ? std::chrono::duration_cast<clock::duration>(std::chrono::duration<float>(m_batchRetransmitTimeout))
+    : clock::duration::zero();
+
+  m_numRequestsFinished = 0;
+  m_batchIndex.clear();
+  m_batchMatchLengths.clear();
+  for (size_t i = 0; i < m_batchRequests.size(); ++i) {
+    const auto& request = m_batchRequests[i];
+    m_batchIndex[batchKey(request.request.data(), request.numBytesToMatch, crtpMode)].push_back(i);
+    if (std::find(m_batchMatchLengths.begin(), m_batchMatchLengths.end(), request.numBytesToMatch) == m_batchMatchLengths.end()) {
+      m_batchMatchLengths.push_back(request.numBytesToMatch);
+    }
+  }
 
-  while (true) {
+  std::vector<ITransport::Packet> packets;
+  std::vector<Crazyradio::Ack> acks(maxChunkSize);
+  packets.reserve(maxChunkSize);
+
+  // requests that were sent and might still be unanswered, oldest first
+  std::deque<size_t> inFlight;
+  size_t nextRequest = 0;
+
+  auto queue = [&](size_t idx, clock::time_point now) {
+    auto& request = m_batchRequests[idx];
+    request.sent = true;
+    request.sendTime = now;
+    inFlight.push_back(idx);
+    ITransport::Packet packet = {request.request.data(), (uint32_t)request.request.size()};
+    packets.push_back(packet);
+  };
+
+  while (m_numRequestsFinished < m_batchRequests.size()) {
     if (additionalSleep) {
       std::this_thread::sleep_for(std::chrono::milliseconds(additionalSleep));
     }
-    if (!crtpMode || !sendPing) {
-      for (const auto& request : m_batchRequests) {
-        if (!request.finished) {
-          // std::cout << "sendReq" << std::endl;
-          sendPacket(request.request.data(), request.request.size(), ack);
-          handleBatchAck(ack, crtpMode);
 
-          auto end = std::chrono::system_clock::now();
-          std::chrono::duration<double> elapsedSeconds = end-start;
-          if (elapsedSeconds.count() > timeout) {
-            throw std::runtime_error("timeout");
-          }
-        }
+    auto now = clock::now();
+
+    // resend requests whose response is overdue
+    while (!inFlight.empty() && packets.size() < maxChunkSize) {
+      size_t idx = inFlight.front();
+      if (m_batchRequests[idx].finished) {
+        inFlight.pop_front();
+        continue;
       }
-      sendPing = true;
-    } else {
-      for (size_t i = 0; i < 10; ++i) {
-        uint8_t ping = 0xFF;
-        sendPacket(&ping, sizeof(ping), ack);
-        handleBatchAck(ack, crtpMode);
-        // if (ack.ack && crtpPlatformRSSIAck::match(ack)) {
-        //   sendPing = false;
-        // }
+      if (now - m_batchRequests[idx].sendTime < retransmitTimeout) {
+        break;
+      }
+      inFlight.pop_front();
+      queue(idx, now);
+    }
 
-        auto end = std::chrono::system_clock::now();
-        std::chrono::duration<double> elapsedSeconds = end-start;
-        if (elapsedSeconds.count() > timeout) {
-          throw std::runtime_error("timeout");
-        }
+    // fill the window with new requests; only sent requests can be finished
+    while (nextRequest < m_batchRequests.size()
+           && nextRequest - m_numRequestsFinished < m_batchWindow
+           && packets.size() < maxChunkSize) {
+      if (!m_batchRequests[nextRequest].finished) {
+        queue(nextRequest, now);
+      }
+      ++nextRequest;
+    }
+
+    // Nothing to (re)send: poll the Crazyflie for pending responses, which
+    // are returned in the payload of the acks.
+    if (packets.empty()) {
+      static const uint8_t ping = 0xFF;
+      size_t numPings = std::min(std::max<size_t>(nextRequest - m_numRequestsFinished, 1), maxChunkSize);
+      for (size_t i = 0; i < numPings; ++i) {
+        ITransport::Packet packet = {&ping, sizeof(ping)};
+        packets.push_back(packet);
       }
+    }
 
-      sendPing = false;
+    sendPackets(packets.data(), packets.size(), acks.data());
+    for (size_t i = 0; i < packets.size(); ++i) {
+      handleBatchAck(acks[i], crtpMode);
     }
-    if (m_numRequestsFinished == m_batchRequests.size()) {
-      break;
+    packets.clear();
+
+    if (g_requestAbortEpoch != abortEpoch) {
+      throw std::runtime_error("Requests aborted!");
+    }
+
+    std::chrono::duration<double> elapsedSeconds = clock::now() - start;
+    if (elapsedSeconds.count() > timeout) {
+      throw std::runtime_error("timeout");
     }
   }
 }
@@ -1140,55 +1770,214 @@ void Crazyflie::handleBatchAck(
   bool crtpMode)
 {
   if (ack.ack) {
-    // if (ack.size > 0) {
-    //   for (size_t i = 0; i < ack.size; ++i) {
-    //     std::cout << (int)ack.data[i] << ",";
-    //   }
-    //   std::cout << std::endl;
-    // }
-
-    for (auto& request : m_batchRequests) {
-      if (crtpMode) {
-        if ((crtp(ack.data[0]) == crtp(request.request[0]) || ack.data[0] == request.request[0])
-            && memcmp(&ack.data[1], &request.request[1], request.numBytesToMatch) == 0
-            && !request.finished) {
+    for (size_t numBytesToMatch : m_batchMatchLengths) {
+      auto iter = m_batchIndex.find(batchKey(ack.data, numBytesToMatch, crtpMode));
+      if (iter == m_batchIndex.end()) {
+        continue;
+      }
+      for (size_t idx : iter->second) {
+        auto& request = m_batchRequests[idx];
+        if (request.sent && !request.finished) {
           request.ack = ack;
           request.finished = true;
           ++m_numRequestsFinished;
-          // std::cout << "gotack" <<std::endl;
           return;
         }
+      }
+    }
+  }
+}
+
+
+////////////////////////////////////////////////////////////////
+
+LogBlockGeneric::LogBlockGeneric(
+  Crazyflie* cf,
+  const std::vector<std::string>& variables,
+  void* userData,
+  std::function<void(uint32_t, std::vector<double>*, void* userData)>& callback)
+  : m_cf(cf)
+  , m_userData(userData)
+  , m_callback(callback)
+  , m_rawCallback(nullptr)
+  , m_id(0)
+  , m_columns()
+  , m_size(0)
+  , m_values()
+{
+  m_id = m_cf->registerLogBlock([=](crtpLogDataResponse* r, uint8_t s) { this->handleData(r, s);});
+  crtpLogCreateBlockRequest request;
+  request.id = m_id;
+  int i = 0;
+  for (auto&& var : variables) {
+    const Crazyflie::LogTocEntry* entry = m_cf->getLogTocEntry(var);
+    if (entry) {
+      size_t s = Crazyflie::size(entry->type);
+      if (m_size + s > 26) {
+        std::stringstream sstr;
+        sstr << "Can't configure that many variables in a single log block!"
+             << " Ignoring " << var << std::endl;
+        throw std::runtime_error(sstr.str());
       } else {
-        if (!request.finished
-            && memcmp(&ack.data[0], &request.request[0], request.numBytesToMatch) == 0) {
-          request.ack = ack;
-          request.finished = true;
-          ++m_numRequestsFinished;
-          // std::cout << m_numRequestsFinished / (float)m_batchRequests.size() * 100.0 << " %" << std::endl;
-          return;
-        }
+        request.items[i].logType = entry->type;
+        request.items[i].id = entry->id;
+        ++i;
+        Column column;
+        column.type = entry->type;
+        column.offset = m_size;
+        m_columns.push_back(column);
+        m_size += s;
       }
     }
+    else {
+      std::stringstream sstr;
+      sstr << "Could not find " << var << " in log toc!";
+      throw std::runtime_error(sstr.str());
+    }
+  }
+  m_values.resize(m_columns.size());
+
+  m_cf->startBatchRequest();
+  m_cf->addRequest(reinterpret_cast<const uint8_t*>(&request), 3 + 2*i, 2);
+  m_cf->handleRequests();
+  auto r = m_cf->getRequestResult<crtpLogControlResponse>(0);
+  if (r->result != crtpLogControlResultOk
+      && r->result != crtpLogControlResultBlockExists) {
+    throw std::runtime_error("Could not create log block!");
+  }
+}
+
+LogBlockGeneric::~LogBlockGeneric()
+{
+  stop();
+  m_cf->unregisterLogBlock(m_id);
+}
 
-    // handle generic ack
-    // handleAck(ack);
-    // crtp c(ack.data[0]);
-    //std::cout << "didnt handle ack " << (int) c.port << " " << (int) c.channel << " " << (int) ack.data[1] << " " << (int) ack.data[2] << std::endl;
-    // TODO: generic handle ack here?
+void LogBlockGeneric::start(uint8_t period)
+{
+  crtpLogStartRequest request(m_id, period);
+  m_cf->startBatchRequest();
+  m_cf->addRequest(request, 2);
+  m_cf->handleRequests();
+}
+
+void LogBlockGeneric::stop()
+{
+  crtpLogStopRequest request(m_id);
+  m_cf->startBatchRequest();
+  m_cf->addRequest(request, 2);
+  m_cf->handleRequests();
+}
+
+double LogBlockGeneric::decodeValue(
+  Crazyflie::LogType type,
+  const uint8_t* data)
+{
+  switch (type) {
+    case Crazyflie::LogTypeUint8:
+      {
+        uint8_t value;
+        memcpy(&value, data, sizeof(value));
+        return value;
+      }
+    case Crazyflie::LogTypeInt8:
+      {
+        int8_t value;
+        memcpy(&value, data, sizeof(value));
+        return value;
+      }
+    case Crazyflie::LogTypeUint16:
+      {
+        uint16_t value;
+        memcpy(&value, data, sizeof(value));
+        return value;
+      }
+    case Crazyflie::LogTypeInt16:
+      {
+        int16_t value;
+        memcpy(&value, data, sizeof(value));
+        return value;
+      }
+    case Crazyflie::LogTypeUint32:
+      {
+        uint32_t value;
+        memcpy(&value, data, sizeof(value));
+        return value;
+      }
+    case Crazyflie::LogTypeInt32:
+      {
+        int32_t value;
+        memcpy(&value, data, sizeof(value));
+        return value;
+      }
+    case Crazyflie::LogTypeFloat:
+      {
+        float value;
+        memcpy(&value, data, sizeof(value));
+        return value;
+      }
+    case Crazyflie::LogTypeFP16:
+      {
+        uint16_t value;
+        memcpy(&value, data, sizeof(value));
+        return half2single(value);
+      }
   }
+  return 0;
 }
 
+void LogBlockGeneric::decode(
+  const uint8_t* data,
+  double* values) const
+{
+  for (size_t i = 0; i < m_columns.size(); ++i) {
+    values[i] = decodeValue(m_columns[i].type, data + m_columns[i].offset);
+  }
+}
+
+void LogBlockGeneric::handleData(
+  crtpLogDataResponse* response,
+  uint8_t size)
+{
+  if (size < m_size) {
+    m_cf->m_logger.warning("Log block " + std::to_string((int)m_id) + ": size doesn't match! Is: "
+      + std::to_string((int)size) + " expected: " + std::to_string(m_size));
+    return;
+  }
+
+  uint32_t time_in_ms = ((uint32_t)response->timestampHi << 8) | (response->timestampLo);
+  if (m_rawCallback) {
+    m_rawCallback(time_in_ms, response->data, m_size, m_userData);
+  }
+  if (m_callback) {
+    decode(response->data, m_values.data());
+    m_callback(time_in_ms, &m_values, m_userData);
+  }
+}
 
 ////////////////////////////////////////////////////////////////
 
 CrazyflieBroadcaster::CrazyflieBroadcaster(
   const std::string& link_uri)
   : m_radio(NULL)
+  , m_transport(NULL)
   , m_devId(0)
   , m_channel(0)
   , m_address(0)
   , m_datarate(Crazyradio::Datarate_250KPS)
+  , m_positionRotation(false)
+  , m_positionFrameBudget(0)
+  , m_positionOffset(0)
+  , m_positionRequests()
+  , m_positionIds()
+  , m_positionBatch()
+  , m_positionStatsStart(std::chrono::steady_clock::now())
 {
+  for (size_t i = 0; i < 256; ++i) {
+    m_numPosesRequested[i] = 0;
+    m_numPosesSent[i] = 0;
+  }
+
   int datarate;
   int channel;
   char datarateType;
@@ -1229,50 +2018,60 @@ CrazyflieBroadcaster::CrazyflieBroadcaster(
     }
 
     m_radio = g_crazyradios[m_devId];
+    m_transport = m_radio;
   }
   else {
     throw std::runtime_error("Uri is not valid!");
   }
 }
 
-void CrazyflieBroadcaster::sendPacket(
-  const uint8_t* data,
-  uint32_t length)
+CrazyflieBroadcaster::CrazyflieBroadcaster(
+  ITransport* transport)
+  : m_radio(NULL)
+  , m_transport(transport)
+  , m_devId(0)
+  , m_channel(0)
+  , m_address(0)
+  , m_datarate(Crazyradio::Datarate_250KPS)
+  , m_positionRotation(false)
+  , m_positionFrameBudget(0)
+  , m_positionOffset(0)
+  , m_positionRequests()
+  , m_positionIds()
+  , m_positionBatch()
+  , m_positionStatsStart(std::chrono::steady_clock::now())
 {
-  std::unique_lock<std::mutex> mlock(g_radioMutex[m_devId]);
-  if (m_radio->getAddress() != m_address) {
-    m_radio->setAddress(m_address);
-  }
-  if (m_radio->getChannel() != m_channel) {
-    m_radio->setChannel(m_channel);
+  for (size_t i = 0; i < 256; ++i) {
+    m_numPosesRequested[i] = 0;
+    m_numPosesSent[i] = 0;
   }
-  if (m_radio->getDatarate() != m_datarate) {
-    m_radio->setDatarate(m_datarate);
-  }
-  if (m_radio->getAckEnable()) {
-    m_radio->setAckEnable(false);
+}
+
+void CrazyflieBroadcaster::configureRadio()
+{
+  if (m_radio) {
+    m_radio->configure(m_address, m_channel, m_datarate, false);
   }
-  m_radio->sendPacketNoAck(data, length);
+}
+
+void CrazyflieBroadcaster::sendPacket(
+  const uint8_t* data,
+  uint32_t length,
+  RadioPriority priority)
+{
+  RadioLock lock(g_radioArbiter[m_devId], priority, radioConfig(m_address, m_channel, m_datarate, false));
+  configureRadio();
+  m_transport->sendPacketNoAck(data, length);
 }
 
 void CrazyflieBroadcaster::send2Packets(
   const uint8_t* data,
-  uint32_t length)
+  uint32_t length,
+  RadioPriority priority)
 {
-  std::unique_lock<std::mutex> mlock(g_radioMutex[m_devId]);
-  if (m_radio->getAddress() != m_address) {
-    m_radio->setAddress(m_address);
-  }
-  if (m_radio->getChannel() != m_channel) {
-    m_radio->setChannel(m_channel);
-  }
-  if (m_radio->getDatarate() != m_datarate) {
-    m_radio->setDatarate(m_datarate);
-  }
-  if (m_radio->getAckEnable()) {
-    m_radio->setAckEnable(false);
-  }
-  m_radio->send2PacketsNoAck(data, length);
+  RadioLock lock(g_radioArbiter[m_devId], priority, radioConfig(m_address, m_channel, m_datarate, false));
+  configureRadio();
+  m_transport->send2PacketsNoAck(data, length);
 }
 
 void CrazyflieBroadcaster::trajectoryStart(
@@ -1332,35 +2131,383 @@ void CrazyflieBroadcaster::startCannedTrajectory(
   sendPacket((const uint8_t*)&request, sizeof(request));
 }
 
+void CrazyflieBroadcaster::emergencyStop(
+  size_t numRepeats)
+{
+  crtpSetpointRequest request(0, 0, 0, 0);
+  for (size_t i = 0; i < numRepeats; ++i) {
+    sendPacket((const uint8_t*)&request, sizeof(request), RadioPriorityEmergency);
+  }
+}
+
 void CrazyflieBroadcaster::sendPositionExternalBringup(
   const std::vector<stateExternalBringup>& data)
 {
-  if (data.size() == 0) {
-    return;
+  m_positionBatch.clear();
+  for (const auto& state : data) {
+    m_positionBatch.push_back(state.id, state.x, state.y, state.z, state.q0, state.q1, state.q2, state.q3);
   }
+  sendPositionExternalBringup(m_positionBatch);
+}
 
-  std::vector<crtpPosExtBringup> requests(ceil(data.size() / 2.0));
-  for (size_t i = 0; i < data.size(); ++i) {
-    size_t j = i / 2;
-    requests[j].data.pose[i%2].id = data[i].id;
-    requests[j].data.pose[i%2].x = position_float_to_fix24(data[i].x);
-    requests[j].data.pose[i%2].y = position_float_to_fix24(data[i].y);
-    requests[j].data.pose[i%2].z = position_float_to_fix24(data[i].z);
-    float q[4] = { data[i].q0, data[i].q1, data[i].q2, data[i].q3 };
-    requests[j].data.pose[i%2].quat = quatcompress(q);
+namespace {
+
+// Writes the positions and compressed quaternions of the poses
+// [begin, begin + n) into the slots slot, slot + 1, ... (two per packet).
+void packPoseDataScalar(
+  const poseBatch& poses,
+  size_t begin,
+  size_t n,
+  crtpPosExtBringup* requests,
+  size_t slot)
+{
+  for (size_t k = begin, s = slot; k < begin + n; ++k, ++s) {
+    auto& pose = requests[s / 2].data.pose[s % 2];
+    pose.x = position_float_to_fix24(poses.x[k]);
+    pose.y = position_float_to_fix24(poses.y[k]);
+    pose.z = position_float_to_fix24(poses.z[k]);
   }
+  for (size_t k = begin, s = slot; k < begin + n; ++k, ++s) {
+    float q[4] = { poses.q0[k], poses.q1[k], poses.q2[k], poses.q3[k] };
+    requests[s / 2].data.pose[s % 2].quat = quatcompress(q);
+  }
+}
 
-  size_t remainingRequests = requests.size();
+#if defined(__SSE2__)
+
+// SSE2 versions of position_float_to_fix24 and quatcompress (FROM CF
+// FIRMWARE) for 4 poses at a time. The firmware headers are not part of
+// this tree, so they are only used if they produce the same bytes as the
+// scalar functions for a set of test poses (see sse2MatchesScalar).
+
+// position_float_to_fix24(1) as signed 24 bit little endian integer
+float fix24Scale()
+{
+  posFixed24_t one = position_float_to_fix24(1.0f);
+  uint8_t b[3] = {0, 0, 0};
+  std::memcpy(b, &one, std::min(sizeof(one), sizeof(b)));
+  uint32_t value = b[0] | (b[1] << 8) | (b[2] << 16);
+  if (value & 0x800000) {
+    value |= 0xFF000000;
+  }
+  return (int32_t)value;
+}
+
+// Returns false if one of the values would be out of the range of 24 bits
+// (i.e. clamped or wrapped by position_float_to_fix24).
+bool fix24x4(
+  const float* values,
+  __m128 scale,
+  int32_t result[4])
+{
+  __m128 scaled = _mm_mul_ps(_mm_loadu_ps(values), scale);
+  __m128 magnitude = _mm_andnot_ps(_mm_set1_ps(-0.0f), scaled);
+  // NaNs fail the comparison as well
+  if (_mm_movemask_ps(_mm_cmplt_ps(magnitude, _mm_set1_ps(8388607.0f))) != 0xF) {
+    return false;
+  }
+  _mm_storeu_si128(reinterpret_cast<__m128i*>(result), _mm_cvttps_epi32(scaled));
+  return true;
+}
+
+__m128i select(
+  __m128i mask,
+  __m128i a,
+  __m128i b)
+{
+  return _mm_or_si128(_mm_and_si128(mask, a), _mm_andnot_si128(mask, b));
+}
+
+// The largest element (by magnitude, the first one of equals) is left out
+// and made positive; the others are sent as sign bit and 9 bits of their
+// magnitude (relative to 1/sqrt(2)), see quatcompress.h.
+void quatcompressx4(
+  const float* q0,
+  const float* q1,
+  const float* q2,
+  const float* q3,
+  uint32_t result[4])
+{
+  const __m128 signMask = _mm_set1_ps(-0.0f);
+  const __m128 zero = _mm_setzero_ps();
+  __m128 q[4] = { _mm_loadu_ps(q0), _mm_loadu_ps(q1), _mm_loadu_ps(q2), _mm_loadu_ps(q3) };
+
+  __m128 largestMagnitude = _mm_andnot_ps(signMask, q[0]);
+  __m128 largestValue = q[0];
+  __m128i largest = _mm_setzero_si128();
+  for (int i = 1; i < 4; ++i) {
+    __m128 magnitude = _mm_andnot_ps(signMask, q[i]);
+    __m128 greater = _mm_cmpgt_ps(magnitude, largestMagnitude);
+    largestMagnitude = _mm_or_ps(_mm_and_ps(greater, magnitude), _mm_andnot_ps(greater, largestMagnitude));
+    largestValue = _mm_or_ps(_mm_and_ps(greater, q[i]), _mm_andnot_ps(greater, largestValue));
+    largest = select(_mm_castps_si128(greater), _mm_set1_epi32(i), largest);
+  }
+  __m128i negate = _mm_castps_si128(_mm_cmplt_ps(largestValue, zero));
+
+  __m128i fields[4];
+  for (int i = 0; i < 4; ++i) {
+    __m128i negbit = _mm_xor_si128(_mm_castps_si128(_mm_cmplt_ps(q[i], zero)), negate);
+    __m128 magnitude = _mm_andnot_ps(signMask, q[i]);
+    __m128 mag = _mm_add_ps(
+      _mm_mul_ps(_mm_set1_ps((1 << 9) - 1), _mm_div_ps(magnitude, _mm_set1_ps((float)M_SQRT1_2))),
+      _mm_set1_ps(0.5f));
+    fields[i] = _mm_or_si128(_mm_and_si128(negbit, _mm_set1_epi32(1 << 9)), _mm_cvttps_epi32(mag));
+  }
+
+  // result without element l: l << 30 | the other three fields
+  __m128i comp = _mm_setzero_si128();
+  for (int l = 0; l < 4; ++l) {
+    __m128i candidate = _mm_set1_epi32(l);
+    for (int i = 0; i < 4; ++i) {
+      if (i != l) {
+        candidate = _mm_or_si128(_mm_slli_epi32(candidate, 10), fields[i]);
+      }
+    }
+    comp = select(_mm_cmpeq_epi32(largest, _mm_set1_epi32(l)), candidate, comp);
+  }
+  _mm_storeu_si128(reinterpret_cast<__m128i*>(result), comp);
+}
+
+// Same as packPoseDataScalar; groups of poses with positions out of the
+// range of the SSE2 version are packed by the scalar functions.
+void packPoseDataSse2(
+  const poseBatch& poses,
+  size_t begin,
+  size_t n,
+  crtpPosExtBringup* requests,
+  size_t slot)
+{
+  const __m128 scale = _mm_set1_ps(fix24Scale());
   size_t i = 0;
-  while (remainingRequests > 0) {
-    if (remainingRequests >= 2) {
-      send2Packets(reinterpret_cast<const uint8_t*>(&requests[i]), 2 * sizeof(crtpPosExtBringup));
-      remainingRequests -= 2;
-      i += 2;
+  for (; i + 4 <= n; i += 4) {
+    size_t k = begin + i;
+    int32_t x[4];
+    int32_t y[4];
+    int32_t z[4];
+    uint32_t quat[4];
+    if (!fix24x4(&poses.x[k], scale, x)
+     || !fix24x4(&poses.y[k], scale, y)
+     || !fix24x4(&poses.z[k], scale, z)) {
+      packPoseDataScalar(poses, k, 4, requests, slot + i);
+      continue;
+    }
+    quatcompressx4(&poses.q0[k], &poses.q1[k], &poses.q2[k], &poses.q3[k], quat);
+    for (size_t j = 0; j < 4; ++j) {
+      size_t s = slot + i + j;
+      auto& pose = requests[s / 2].data.pose[s % 2];
+      // little endian, i.e. the lowest 3 bytes
+      std::memcpy(&pose.x, &x[j], sizeof(pose.x));
+      std::memcpy(&pose.y, &y[j], sizeof(pose.y));
+      std::memcpy(&pose.z, &z[j], sizeof(pose.z));
+      pose.quat = quat[j];
+    }
+  }
+  packPoseDataScalar(poses, begin + i, n - i, requests, slot + i);
+}
+
+bool sse2MatchesScalar()
+{
+  if (sizeof(posFixed24_t) != 3) {
+    return false;
+  }
+
+  // positions within +-20 m (and a few special ones), random unit
+  // quaternions and ones with equal or zero elements
+  poseBatch poses;
+  uint32_t random = 1;
+  auto uniform = [&random](float min, float max) {
+    random = random * 1664525 + 1013904223;
+    return min + (max - min) * (random >> 8) / (float)(1 << 24);
+  };
+  const float specialPositions[] = {0.0f, -0.0f, 0.0005f, -0.0005f, 0.001f, -0.001f, 1.0f, -1.0f, 8000.0f, -8000.0f};
+  const float specialQuats[][4] = {
+    {1, 0, 0, 0}, {0, -1, 0, 0}, {0, 0, 1, 0}, {0, 0, 0, -1},
+    {0.5f, 0.5f, 0.5f, 0.5f}, {-0.5f, 0.5f, -0.5f, 0.5f},
+    {(float)M_SQRT1_2, (float)-M_SQRT1_2, 0, -0.0f}, {-0.0f, 0, (float)M_SQRT1_2, (float)M_SQRT1_2},
+  };
+  for (size_t i = 0; i < 4096; ++i) {
+    float q[4];
+    if (i < sizeof(specialQuats) / sizeof(specialQuats[0])) {
+      std::copy(specialQuats[i], specialQuats[i] + 4, q);
     } else {
-      sendPacket(reinterpret_cast<const uint8_t*>(&requests[i]), sizeof(crtpPosExtBringup));
-      remainingRequests -= 1;
-      i += 1;
+      float norm = 0;
+      for (float& v : q) {
+        v = uniform(-1, 1);
+        norm += v * v;
+      }
+      for (float& v : q) {
+        v /= std::sqrt(norm);
+      }
+    }
+    float x = i < sizeof(specialPositions) / sizeof(specialPositions[0]) ? specialPositions[i] : uniform(-20, 20);
+    poses.push_back(i % 256, x, uniform(-20, 20), uniform(0, 5), q[0], q[1], q[2], q[3]);
+  }
+
+  std::vector<crtpPosExtBringup> scalar(poses.size() / 2);
+  std::vector<crtpPosExtBringup> sse2(poses.size() / 2);
+  packPoseDataScalar(poses, 0, poses.size(), scalar.data(), 0);
+  packPoseDataSse2(poses, 0, poses.size(), sse2.data(), 0);
+  for (size_t s = 0; s < poses.size(); ++s) {
+    const auto& a = scalar[s / 2].data.pose[s % 2];
+    const auto& b = sse2[s / 2].data.pose[s % 2];
+    if (std::memcmp(&a.x, &b.x, sizeof(a.x)) != 0
+     || std::memcmp(&a.y, &b.y, sizeof(a.y)) != 0
+     || std::memcmp(&a.z, &b.z, sizeof(a.z)) != 0
+     || a.quat != b.quat) {
+      return false;
+    }
+  }
+  return true;
+}
+
+#endif
+
+void packPoseData(
+  const poseBatch& poses,
+  size_t begin,
+  size_t n,
+  crtpPosExtBringup* requests,
+  size_t slot)
+{
+#if defined(__SSE2__)
+  static const bool sse2 = sse2MatchesScalar();
+  if (sse2) {
+    packPoseDataSse2(poses, begin, n, requests, slot);
+    return;
+  }
+#endif
+  packPoseDataScalar(poses, begin, n, requests, slot);
+}
+
+} // namespace
+
+void CrazyflieBroadcaster::packPoses(
+  const poseBatch& poses,
+  size_t begin,
+  size_t end,
+  size_t slot)
+{
+  // SSE2 (the x86_64 baseline) where available, else scalar
+  const uint8_t* ids = poses.id.data();
+  for (size_t k = begin, s = slot; k < end; ++k, ++s) {
+    m_positionRequests[s / 2].data.pose[s % 2].id = ids[k];
+    m_positionIds[s] = ids[k];
+  }
+  packPoseData(poses, begin, end - begin, m_positionRequests.data(), slot);
+  for (size_t k = begin; k < end; ++k) {
+    ++m_numPosesRequested[ids[k]];
+  }
+}
+
+void CrazyflieBroadcaster::sendPositionExternalBringup(
+  const poseBatch& poses)
+{
+  if (poses.empty()) {
+    return;
+  }
+  auto start = std::chrono::steady_clock::now();
+
+  // pack the poses in the scheduled order, starting at m_positionOffset.
+  // The packet buffers keep their capacity, i.e. this does not allocate
+  // unless the frame has more poses than any before.
+  size_t numPoses = poses.size();
+  size_t offset = m_positionOffset % numPoses;
+  m_positionRequests.resize((numPoses + 1) / 2);
+  m_positionIds.resize(numPoses);
+  packPoses(poses, offset, numPoses, 0);
+  packPoses(poses, 0, offset, numPoses - offset);
+  if (numPoses % 2) {
+    // the second pose of the last packet is unused
+    m_positionRequests.back().data.pose[1].id = 0;
+  }
+
+  // send the whole frame in as few USB transfers as possible (two packets each)
+  size_t numRequests = m_positionRequests.size();
+  size_t i = 0;
+  {
+    RadioArbiter& arbiter = g_radioArbiter[m_devId];
+    RadioLock lock(arbiter, RadioPriorityPose, radioConfig(m_address, m_channel, m_datarate, false));
+    configureRadio();
+    while (i < numRequests) {
+      // the rest of the frame is dropped for an emergency stop
+      if (i > 0 && arbiter.preempted(RadioPriorityPose)) {
+        break;
+      }
+      if (i > 0 && m_positionFrameBudget > 0) {
+        std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+        if (elapsed.count() > m_positionFrameBudget) {
+          break;
+        }
+      }
+      if (numRequests - i >= 2) {
+        m_transport->send2PacketsNoAck(reinterpret_cast<const uint8_t*>(&m_positionRequests[i]), 2 * sizeof(crtpPosExtBringup));
+        i += 2;
+      } else {
+        m_transport->sendPacketNoAck(reinterpret_cast<const uint8_t*>(&m_positionRequests[i]), sizeof(crtpPosExtBringup));
+        i += 1;
+      }
+    }
+  }
+
+  size_t numSent = std::min(2 * i, numPoses);
+  for (size_t k = 0; k < numSent; ++k) {
+    ++m_numPosesSent[m_positionIds[k]];
+  }
+
+  if (numSent < numPoses) {
+    // the remaining poses are stale now; send the vehicles first next time
+    m_positionOffset = offset + numSent;
+  } else if (m_positionRotation) {
+    m_positionOffset = offset + 2;
+  } else {
+    m_positionOffset = 0;
+  }
+}
+
+void CrazyflieBroadcaster::positionUpdateRates(
+  std::vector<PositionUpdateRate>& rates)
+{
+  auto now = std::chrono::steady_clock::now();
+  std::chrono::duration<double> elapsed = now - m_positionStatsStart;
+  m_positionStatsStart = now;
+
+  rates.clear();
+  for (size_t id = 0; id < 256; ++id) {
+    uint32_t numRequested = m_numPosesRequested[id].exchange(0);
+    uint32_t numSent = m_numPosesSent[id].exchange(0);
+    if (numRequested > 0 && elapsed.count() > 0) {
+      PositionUpdateRate rate;
+      rate.id = id;
+      rate.requested = numRequested / elapsed.count();
+      rate.sent = numSent / elapsed.count();
+      rates.push_back(rate);
+    }
+  }
+}
+
+void CrazyflieBroadcaster::trajectoryAdd(
+  const std::vector<Crazyflie::TrajectoryPiece>& pieces,
+  const std::vector<uint8_t>& sharedPackets,
+  size_t numRepeats,
+  uint8_t firstId)
+{
+  std::vector<crtpTrajectoryAddRequest> requests;
+  float values[trajectoryPieceNumValues];
+  for (size_t i = 0; i < pieces.size() && i < sharedPackets.size(); ++i) {
+    trajectoryPieceValues(pieces[i], values);
+    for (size_t j = 0; j < Crazyflie::TrajectoryPieceNumPackets; ++j) {
+      if (sharedPackets[i] & (1 << j)) {
+        requests.resize(requests.size() + 1);
+        trajectoryPiecePacket(values, firstId + i, j, requests.back());
+      }
+    }
+  }
+
+  // repeat whole rounds rather than single packets, so that a burst of lost
+  // packets does not hit all copies of the same packet
+  for (size_t r = 0; r < numRepeats; ++r) {
+    for (const auto& request : requests) {
+      sendPacket(reinterpret_cast<const uint8_t*>(&request), sizeof(request));
     }
   }
 }
@@ -1372,6 +2519,31 @@ void CrazyflieBroadcaster::sendPacketDropTest(
   sendPacket((const uint8_t*)&request, sizeof(request));
 }
 
+void CrazyflieBroadcaster::sendPacketDropTests(
+    uint64_t seq,
+    size_t count,
+    bool paired)
+{
+  std::vector<crtpPacketDropTest> requests;
+  requests.reserve(count);
+  for (size_t i = 0; i < count; ++i) {
+    requests.push_back(crtpPacketDropTest(seq + i));
+  }
+
+  RadioLock lock(g_radioArbiter[m_devId], RadioPriorityPose, radioConfig(m_address, m_channel, m_datarate, false));
+  configureRadio();
+  size_t i = 0;
+  while (i < count) {
+    if (paired && count - i >= 2) {
+      m_transport->send2PacketsNoAck(reinterpret_cast<const uint8_t*>(&requests[i]), 2 * sizeof(crtpPacketDropTest));
+      i += 2;
+    } else {
+      m_transport->sendPacketNoAck(reinterpret_cast<const uint8_t*>(&requests[i]), sizeof(crtpPacketDropTest));
+      i += 1;
+    }
+  }
+}
+
 void CrazyflieBroadcaster::setParam(
   uint8_t group,
   uint8_t id,
@@ -0,0 +1,430 @@
+#include "CrazyflieSim.h"
+
+#include <cstring>
+#include <thread>
+#include <algorithm>
+
+namespace {
+
+// CRTP TX queue of the firmware; log data is dropped if it is full
+const size_t maxQueueLength = 16;
+
+// maximum payload of a log block
+const size_t maxLogBlockSize = 26;
+
+const uint8_t logTypeFloat = 7;
+const uint8_t paramTypeUint8 = 0x08;
+const uint8_t paramTypeFloat = 0x06;
+
+uint8_t header(
+  uint8_t port,
+  uint8_t channel)
+{
+  return (port << 4) | (3 << 2) | channel;
+}
+
+size_t logTypeSize(
+  uint8_t type)
+{
+  switch (type) {
+    case 1: // uint8
+    case 4: // int8
+      return 1;
+    case 2: // uint16
+    case 5: // int16
+    case 8: // fp16
+      return 2;
+    default:
+      return 4;
+  }
+}
+
+size_t paramTypeSize(
+  uint8_t type)
+{
+  // lowest two bits: log2 of the size in bytes
+  return 1 << (type & 3);
+}
+
+void appendText(
+  std::vector<uint8_t>& response,
+  const std::string& group,
+  const std::string& name)
+{
+  response.insert(response.end(), group.begin(), group.end());
+  response.push_back(0);
+  response.insert(response.end(), name.begin(), name.end());
+  response.push_back(0);
+}
+
+template<class T>
+void append(
+  std::vector<uint8_t>& response,
+  const T& value)
+{
+  const uint8_t* data = reinterpret_cast<const uint8_t*>(&value);
+  response.insert(response.end(), data, data + sizeof(T));
+}
+
+} // namespace
+
+CrazyflieSim::CrazyflieSim(
+  const Config& config)
+  : m_config(config)
+  , m_mutex()
+  , m_random(config.seed)
+  , m_lossDistribution(config.loss)
+  , m_logVariables()
+  , m_params()
+  , m_logBlocks()
+  , m_queue()
+  , m_start(std::chrono::steady_clock::now())
+  , m_stats()
+{
+  std::memset(&m_stats, 0, sizeof(m_stats));
+
+  // some variables used by the driver, then generic ones
+  const logVariable logVariables[] = {
+    {"pm", "vbat", logTypeFloat},
+    {"stabilizer", "roll", logTypeFloat},
+    {"stabilizer", "pitch", logTypeFloat},
+    {"stabilizer", "yaw", logTypeFloat},
+  };
+  for (const auto& variable : logVariables) {
+    if (m_logVariables.size() < m_config.numLogVariables) {
+      m_logVariables.push_back(variable);
+    }
+  }
+  while (m_logVariables.size() < m_config.numLogVariables) {
+    logVariable variable = {"sim", "var" + std::to_string(m_logVariables.size()), logTypeFloat};
+    m_logVariables.push_back(variable);
+  }
+
+  const param params[] = {
+    {"flightmode", "posCtrl", paramTypeUint8, 0},
+    {"ring", "effect", paramTypeUint8, 0},
+    {"ring", "headlightEnable", paramTypeUint8, 0},
+  };
+  for (const auto& p : params) {
+    if (m_params.size() < m_config.numParams) {
+      m_params.push_back(p);
+    }
+  }
+  while (m_params.size() < m_config.numParams) {
+    param p = {"sim", "param" + std::to_string(m_params.size()), paramTypeFloat, 0};
+    m_params.push_back(p);
+  }
+}
+
+void CrazyflieSim::sendPacket(
+  const uint8_t* data,
+  uint32_t length,
+  ITransport::Ack& result)
+{
+  Packet packet = {data, length};
+  sendPackets(&packet, 1, &result);
+}
+
+void CrazyflieSim::sendPacketNoAck(
+  const uint8_t* data,
+  uint32_t length)
+{
+  ITransport::Ack result;
+  sendPacket(data, length, result);
+}
+
+void CrazyflieSim::sendPackets(
+  const ITransport::Packet* packets,
+  size_t numPackets,
+  ITransport::Ack* results)
+{
+  size_t depth = std::max<size_t>(m_config.pipelineDepth, 1);
+  for (size_t i = 0; i < numPackets; i += depth) {
+    latency(1);
+    std::unique_lock<std::mutex> lock(m_mutex);
+    for (size_t j = i; j < std::min(i + depth, numPackets); ++j) {
+      transfer(packets[j].data, packets[j].length, results[j]);
+    }
+  }
+}
+
+CrazyflieSim::Stats CrazyflieSim::stats() const
+{
+  std::unique_lock<std::mutex> lock(m_mutex);
+  return m_stats;
+}
+
+void CrazyflieSim::transfer(
+  const uint8_t* data,
+  uint32_t length,
+  ITransport::Ack& result)
+{
+  ++m_stats.numPackets;
+  // no retries (or power detector) to report; loss is simulated instead
+  result.ack = false;
+  result.powerDet = false;
+  result.retry = 0;
+  result.size = 0;
+  if (m_lossDistribution(m_random)) {
+    ++m_stats.numLost;
+    return;
+  }
+
+  // The ack carries the oldest queued response (as prepared before the
+  // packet is processed). If the ack is lost, the response stays queued.
+  queueLogData();
+  bool ackLost = m_lossDistribution(m_random);
+  if (ackLost) {
+    ++m_stats.numLost;
+  } else {
+    result.ack = true;
+    if (!m_queue.empty()) {
+      const std::vector<uint8_t>& response = m_queue.front();
+      result.size = std::min(response.size(), sizeof(result.data));
+      std::memcpy(result.data, response.data(), result.size);
+      m_queue.pop_front();
+    } else {
+      // empty ack with the signal strength
+      result.data[0] = header(15, 3);
+      result.data[1] = 0x01;
+      result.data[2] = 40;
+      result.size = 3;
+    }
+  }
+
+  handleRequest(data, length);
+}
+
+void CrazyflieSim::handleRequest(
+  const uint8_t* data,
+  uint32_t length)
+{
+  if (length < 2) {
+    // pings
+    return;
+  }
+  uint8_t port = data[0] >> 4;
+  uint8_t channel = data[0] & 0x3;
+  switch (port) {
+    case 2:
+      handleParams(channel, data, length);
+      break;
+    case 5:
+      if (channel == 0) {
+        handleLogToc(data, length);
+      } else if (channel == 1) {
+        handleLogControl(data, length);
+      }
+      break;
+    case 14:
+      if (channel == 1) {
+        // trajectories: acknowledge every command
+        std::vector<uint8_t> response = {
+          header(14, 1), data[1],
+          (uint8_t)(length > 2 ? data[2] : 0),
+          (uint8_t)(length > 3 ? data[3] : 0),
+          0};
+        queueResponse(response);
+      }
+      break;
+    default:
+      // setpoints, external positions, ...
+      break;
+  }
+}
+
+void CrazyflieSim::handleLogToc(
+  const uint8_t* data,
+  uint32_t length)
+{
+  uint8_t command = data[1];
+  std::vector<uint8_t> response = {header(5, 0), command};
+  if (command == 0 && length > 2 && data[2] < m_logVariables.size()) {
+    const logVariable& variable = m_logVariables[data[2]];
+    response.push_back(data[2]);
+    response.push_back(variable.type);
+    appendText(response, variable.group, variable.name);
+    queueResponse(response);
+  } else if (command == 1) {
+    response.push_back(m_logVariables.size());
+    append<uint32_t>(response, 0x51A00000 | m_logVariables.size());
+    response.push_back(16); // max packets
+    response.push_back(128); // max operations
+    queueResponse(response);
+  }
+}
+
+void CrazyflieSim::handleLogControl(
+  const uint8_t* data,
+  uint32_t length)
+{
+  uint8_t command = data[1];
+  uint8_t id = length > 2 ? data[2] : 0;
+  uint8_t result = 0;
+  auto iter = m_logBlocks.find(id);
+  switch (command) {
+    case 0: // create
+    case 1: // append
+      {
+        if (command == 0 && iter != m_logBlocks.end()) {
+          result = 17; // EEXIST
+          break;
+        }
+        if (command == 1 && iter == m_logBlocks.end()) {
+          result = 2; // ENOENT
+          break;
+        }
+        size_t size = command == 1 ? iter->second.size : 0;
+        // the request has a fixed size; unused items are zero
+        for (size_t i = 3; i + 1 < length && (data[i] & 0x0F) != 0; i += 2) {
+          size += logTypeSize(data[i] & 0x0F);
+        }
+        if (size > maxLogBlockSize) {
+          result = 7; // E2BIG
+          break;
+        }
+        logBlock& block = m_logBlocks[id];
+        block.size = size;
+        if (command == 0) {
+          block.running = false;
+        }
+      }
+      break;
+    case 2: // delete
+      if (iter == m_logBlocks.end()) {
+        result = 2; // ENOENT
+      } else {
+        m_logBlocks.erase(iter);
+      }
+      break;
+    case 3: // start
+      if (iter == m_logBlocks.end()) {
+        result = 2; // ENOENT
+      } else {
+        // period in 10 ms (uint8_t) or in ms (uint16_t)
+        int period = 10;
+        if (length == 4) {
+          period = data[3] * 10;
+        } else if (length >= 5) {
+          period = data[3] | (data[4] << 8);
+        }
+        iter->second.running = true;
+        iter->second.period = std::chrono::milliseconds(std::max(period, 1));
+        iter->second.next = std::chrono::steady_clock::now();
+      }
+      break;
+    case 4: // stop
+      if (iter == m_logBlocks.end()) {
+        result = 2; // ENOENT
+      } else {
+        iter->second.running = false;
+      }
+      break;
+    case 5: // reset
+      m_logBlocks.clear();
+      break;
+    default:
+      result = 8; // ENOEXEC
+      break;
+  }
+  std::vector<uint8_t> response = {header(5, 1), command, id, result};
+  queueResponse(response);
+}
+
+void CrazyflieSim::handleParams(
+  uint8_t channel,
+  const uint8_t* data,
+  uint32_t length)
+{
+  switch (channel) {
+    case 0: // TOC
+      {
+        uint8_t command = data[1];
+        std::vector<uint8_t> response = {header(2, 0), command};
+        if (command == 0 && length > 2 && data[2] < m_params.size()) {
+          const param& p = m_params[data[2]];
+          response.push_back(data[2]);
+          response.push_back(p.type);
+          appendText(response, p.group, p.name);
+          queueResponse(response);
+        } else if (command == 1) {
+          response.push_back(m_params.size());
+          append<uint32_t>(response, 0x52A00000 | m_params.size());
+          queueResponse(response);
+        }
+      }
+      break;
+    case 1: // read
+    case 2: // write
+      {
+        uint8_t id = data[1];
+        if (id >= m_params.size()) {
+          break;
+        }
+        param& p = m_params[id];
+        size_t size = paramTypeSize(p.type);
+        if (channel == 2 && length >= 2 + size) {
+          p.value = 0;
+          std::memcpy(&p.value, &data[2], size);
+        }
+        std::vector<uint8_t> response = {header(2, channel), id};
+        const uint8_t* value = reinterpret_cast<const uint8_t*>(&p.value);
+        response.insert(response.end(), value, value + size);
+        queueResponse(response);
+      }
+      break;
+    case 3: // misc: broadcast write (command, group, id, value)
+      if (data[1] == 1 && length > 4 && data[3] < m_params.size()) {
+        param& p = m_params[data[3]];
+        size_t size = paramTypeSize(p.type);
+        if (length >= 4 + size) {
+          p.value = 0;
+          std::memcpy(&p.value, &data[4], size);
+        }
+      }
+      break;
+  }
+}
+
+void CrazyflieSim::queueLogData()
+{
+  auto now = std::chrono::steady_clock::now();
+  uint32_t time_in_ms = std::chrono::duration_cast<std::chrono::milliseconds>(now - m_start).count();
+  for (auto& iter : m_logBlocks) {
+    logBlock& block = iter.second;
+    if (!block.running || block.next > now) {
+      continue;
+    }
+    size_t numDue = (now - block.next) / block.period + 1;
+    block.next += numDue * block.period;
+    for (size_t i = 0; i < numDue; ++i) {
+      if (m_queue.size() >= maxQueueLength) {
+        m_stats.numLogPacketsDropped += numDue - i;
+        break;
+      }
+      std::vector<uint8_t> packet = {
+        header(5, 2), iter.first,
+        (uint8_t)(time_in_ms & 0xFF),
+        (uint8_t)((time_in_ms >> 8) & 0xFF),
+        (uint8_t)((time_in_ms >> 16) & 0xFF)};
+      packet.resize(packet.size() + block.size, 0);
+      m_queue.push_back(packet);
+      ++m_stats.numLogPackets;
+    }
+  }
+}
+
+void CrazyflieSim::queueResponse(
+  const std::vector<uint8_t>& response)
+{
+  m_queue.push_back(response);
+  ++m_stats.numResponses;
+}
+
+void CrazyflieSim::latency(
+  size_t numTransfers)
+{
+  if (m_config.latency > 0) {
+    std::this_thread::sleep_for(std::chrono::duration<double>(m_config.latency * numTransfers));
+  }
+}
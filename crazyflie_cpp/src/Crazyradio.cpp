@@ -2,6 +2,7 @@
 
 #include <sstream>
 #include <stdexcept>
+#include <algorithm>
 
 #include <libusb-1.0/libusb.h>
 
@@ -21,6 +22,160 @@ enum
     LAUNCH_BOOTLOADER   = 0xFF,
 };
 
+namespace {
+
+struct pipelineState;
+
+// One OUT/IN transfer pair; handles one packet at a time
+struct pipelineSlot
+{
+    pipelineState* state;
+    libusb_transfer* out;
+    libusb_transfer* in;
+    size_t packet;
+    bool outPending;
+    bool inPending;
+};
+
+struct pipelineState
+{
+    libusb_device_handle* handle;
+    const ITransport::Packet* packets;
+    ITransport::Ack* results;
+    size_t numPackets;
+    size_t nextPacket;
+    size_t numPending;
+    int completed;
+    std::string error;
+    std::vector<pipelineSlot> slots;
+};
+
+const char* transferStatusName(int status)
+{
+    switch (status) {
+    case LIBUSB_TRANSFER_ERROR:     return "LIBUSB_TRANSFER_ERROR";
+    case LIBUSB_TRANSFER_TIMED_OUT: return "LIBUSB_TRANSFER_TIMED_OUT";
+    case LIBUSB_TRANSFER_CANCELLED: return "LIBUSB_TRANSFER_CANCELLED";
+    case LIBUSB_TRANSFER_STALL:     return "LIBUSB_TRANSFER_STALL";
+    case LIBUSB_TRANSFER_NO_DEVICE: return "LIBUSB_TRANSFER_NO_DEVICE";
+    case LIBUSB_TRANSFER_OVERFLOW:  return "LIBUSB_TRANSFER_OVERFLOW";
+    default:                        return "Unknown transfer status";
+    }
+}
+
+void pipelineFail(pipelineState* state, const std::string& error)
+{
+    if (!state->error.empty()) {
+        return;
+    }
+    state->error = error;
+    // cancel everything still in flight; the callbacks will still fire
+    for (auto& slot : state->slots) {
+        if (slot.outPending) {
+            libusb_cancel_transfer(slot.out);
+        }
+        if (slot.inPending) {
+            libusb_cancel_transfer(slot.in);
+        }
+    }
+}
+
+void pipelineCheckDone(pipelineState* state)
+{
+    if (state->numPending == 0) {
+        state->completed = 1;
+    }
+}
+
+void LIBUSB_CALL pipelineOutCallback(libusb_transfer* transfer);
+void LIBUSB_CALL pipelineInCallback(libusb_transfer* transfer);
+
+void pipelineSubmitNext(pipelineSlot& slot)
+{
+    pipelineState* state = slot.state;
+    if (!state->error.empty() || state->nextPacket >= state->numPackets) {
+        return;
+    }
+
+    slot.packet = state->nextPacket++;
+    const ITransport::Packet& packet = state->packets[slot.packet];
+    ITransport::Ack& result = state->results[slot.packet];
+    result.ack = false;
+    result.size = 0;
+
+    libusb_fill_bulk_transfer(
+        slot.out,
+        state->handle,
+        /* endpoint*/ (0x01 | LIBUSB_ENDPOINT_OUT),
+        (unsigned char*)packet.data,
+        packet.length,
+        pipelineOutCallback,
+        &slot,
+        /*timeout*/ 1000);
+    libusb_fill_bulk_transfer(
+        slot.in,
+        state->handle,
+        /* endpoint*/ (0x81 | LIBUSB_ENDPOINT_IN),
+        (unsigned char*)&result,
+        sizeof(result) - 1,
+        pipelineInCallback,
+        &slot,
+        /*timeout*/ 1000);
+
+    int status = libusb_submit_transfer(slot.out);
+    if (status != LIBUSB_SUCCESS) {
+        pipelineFail(state, libusb_error_name(status));
+        return;
+    }
+    slot.outPending = true;
+    ++state->numPending;
+
+    // The radio answers every OUT packet with exactly one IN packet, in order,
+    // so queuing the IN right behind its OUT keeps the pairs matched.
+    status = libusb_submit_transfer(slot.in);
+    if (status != LIBUSB_SUCCESS) {
+        pipelineFail(state, libusb_error_name(status));
+        return;
+    }
+    slot.inPending = true;
+    ++state->numPending;
+}
+
+void LIBUSB_CALL pipelineOutCallback(libusb_transfer* transfer)
+{
+    pipelineSlot* slot = (pipelineSlot*)transfer->user_data;
+    pipelineState* state = slot->state;
+    slot->outPending = false;
+    --state->numPending;
+
+    if (transfer->status != LIBUSB_TRANSFER_COMPLETED) {
+        pipelineFail(state, transferStatusName(transfer->status));
+    } else if (transfer->actual_length != transfer->length) {
+        std::stringstream sstr;
+        sstr << "Did transfer " << transfer->actual_length << " but " << transfer->length << " was requested!";
+        pipelineFail(state, sstr.str());
+    }
+    pipelineCheckDone(state);
+}
+
+void LIBUSB_CALL pipelineInCallback(libusb_transfer* transfer)
+{
+    pipelineSlot* slot = (pipelineSlot*)transfer->user_data;
+    pipelineState* state = slot->state;
+    slot->inPending = false;
+    --state->numPending;
+
+    if (transfer->status != LIBUSB_TRANSFER_COMPLETED) {
+        pipelineFail(state, transferStatusName(transfer->status));
+    } else {
+        state->results[slot->packet].size = transfer->actual_length - 1;
+        pipelineSubmitNext(*slot);
+    }
+    pipelineCheckDone(state);
+}
+
+} // namespace
+
 Crazyradio::Crazyradio(
     uint32_t devid)
     : ITransport()
@@ -30,6 +185,8 @@ Crazyradio::Crazyradio(
     , m_datarate(Datarate_250KPS)
     , m_ackEnable(true)
     , m_numPacketsSent(0)
+    , m_pipelineDepth(1)
+    , m_transfers()
 {
     open(devid);
     setDatarate(Datarate_2MPS);
@@ -44,6 +201,9 @@ Crazyradio::Crazyradio(
 
 Crazyradio::~Crazyradio()
 {
+    for (auto transfer : m_transfers) {
+        libusb_free_transfer(transfer);
+    }
 }
 
 uint32_t Crazyradio::numDevices()
@@ -81,6 +241,7 @@ void Crazyradio::setAddress(uint64_t address)
     // if (status != LIBUSB_SUCCESS) {
     //     std::cerr << "sendVendorSetup: " << libusb_error_name(status) << std::endl;
     // }
+    ++m_numControlTransfers;
     m_address = address;
 }
 
@@ -131,11 +292,42 @@ void Crazyradio::setAckEnable(bool enable)
     m_ackEnable = enable;
 }
 
+size_t Crazyradio::configure(
+    uint64_t address,
+    uint8_t channel,
+    Datarate datarate,
+    bool ackEnable)
+{
+    size_t numChanges = 0;
+    if (m_address != address) {
+        setAddress(address);
+        ++numChanges;
+    }
+    if (m_channel != channel) {
+        setChannel(channel);
+        ++numChanges;
+    }
+    if (m_datarate != datarate) {
+        setDatarate(datarate);
+        ++numChanges;
+    }
+    if (m_ackEnable != ackEnable) {
+        setAckEnable(ackEnable);
+        ++numChanges;
+    }
+    return numChanges;
+}
+
 void Crazyradio::setContCarrier(bool active)
 {
     sendVendorSetup(SET_CONT_CARRIER, active, 0, NULL, 0);
 }
 
+void Crazyradio::setPipelineDepth(uint32_t depth)
+{
+    m_pipelineDepth = std::max<uint32_t>(depth, 1);
+}
+
 void Crazyradio::sendPacket(
     const uint8_t* data,
     uint32_t length,
@@ -255,3 +447,68 @@ void Crazyradio::send2PacketsNoAck(
     //     std::cout << "#packets: " << m_numPacketsSent << std::endl;
     // }
 }
+
+void Crazyradio::sendPackets(
+    const ITransport::Packet* packets,
+    size_t numPackets,
+    ITransport::Ack* results)
+{
+    if (m_pipelineDepth <= 1 || numPackets <= 1) {
+        ITransport::sendPackets(packets, numPackets, results);
+        return;
+    }
+
+    if (!m_handle) {
+        throw std::runtime_error("No valid device handle!");
+    }
+
+    size_t numSlots = std::min<size_t>(m_pipelineDepth, numPackets);
+    while (m_transfers.size() < 2 * numSlots) {
+        libusb_transfer* transfer = libusb_alloc_transfer(0);
+        if (!transfer) {
+            throw std::runtime_error("Could not allocate USB transfer!");
+        }
+        m_transfers.push_back(transfer);
+    }
+
+    pipelineState state;
+    state.handle = m_handle;
+    state.packets = packets;
+    state.results = results;
+    state.numPackets = numPackets;
+    state.nextPacket = 0;
+    state.numPending = 0;
+    state.completed = 0;
+    state.slots.resize(numSlots);
+    for (size_t i = 0; i < numSlots; ++i) {
+        pipelineSlot& slot = state.slots[i];
+        slot.state = &state;
+        slot.out = m_transfers[2 * i];
+        slot.in = m_transfers[2 * i + 1];
+        slot.packet = 0;
+        slot.outPending = false;
+        slot.inPending = false;
+    }
+
+    for (auto& slot : state.slots) {
+        pipelineSubmitNext(slot);
+    }
+    pipelineCheckDone(&state);
+
+    // The device handles are opened from the default context's device list
+    // (see USBDevice::open), so their events are dispatched there as well.
+    // Never leave while transfers are pending; they reference the state above.
+    while (!state.completed) {
+        struct timeval tv = {1, 0};
+        int status = libusb_handle_events_timeout_completed(NULL, &tv, &state.completed);
+        if (status != LIBUSB_SUCCESS && status != LIBUSB_ERROR_INTERRUPTED) {
+            pipelineFail(&state, libusb_error_name(status));
+        }
+    }
+
+    m_numPacketsSent += state.nextPacket;
+
+    if (!state.error.empty()) {
+        throw std::runtime_error(state.error);
+    }
+}
@@ -0,0 +1,230 @@
+#include "FlightLog.h"
+
+#include <cstring>
+#include <chrono>
+#include <stdexcept>
+#include <algorithm>
+
+namespace {
+
+const char flightLogMagic[4] = {'C', 'F', 'L', 'G'};
+const uint8_t flightLogVersion = 1;
+
+// size of the stdio buffer, i.e. the chunks written to disk
+const size_t flightLogChunkSize = 64 * 1024;
+
+void writeByte(FILE* file, uint8_t value)
+{
+  fwrite(&value, 1, 1, file);
+}
+
+uint8_t readByte(FILE* file)
+{
+  uint8_t value;
+  if (fread(&value, 1, 1, file) != 1) {
+    throw std::runtime_error("Unexpected end of flight log header!");
+  }
+  return value;
+}
+
+} // namespace
+
+FlightLogWriter::FlightLogWriter(
+  const std::string& fileName,
+  size_t capacity)
+  : m_fileName(fileName)
+  , m_file(nullptr)
+  , m_blocks()
+  , m_buffer()
+  , m_mask(0)
+  , m_head(0)
+  , m_tail(0)
+  , m_running(false)
+  , m_numDropped(0)
+  , m_thread()
+{
+  size_t size = 1;
+  while (size < capacity) {
+    size *= 2;
+  }
+  m_buffer.resize(size);
+  m_mask = size - 1;
+}
+
+FlightLogWriter::~FlightLogWriter()
+{
+  stop();
+}
+
+uint8_t FlightLogWriter::addBlock(
+  const FlightLogBlock& block)
+{
+  if (m_file) {
+    throw std::runtime_error("Blocks have to be added before the flight log is started!");
+  }
+  if (block.variables.size() != block.types.size()) {
+    throw std::runtime_error("Number of variables and types doesn't match!");
+  }
+  m_blocks.push_back(block);
+  return m_blocks.size() - 1;
+}
+
+void FlightLogWriter::start()
+{
+  m_file = fopen(m_fileName.c_str(), "wb");
+  if (!m_file) {
+    throw std::runtime_error("Could not open " + m_fileName);
+  }
+  setvbuf(m_file, nullptr, _IOFBF, flightLogChunkSize);
+
+  fwrite(flightLogMagic, 1, sizeof(flightLogMagic), m_file);
+  writeByte(m_file, flightLogVersion);
+  writeByte(m_file, m_blocks.size());
+  for (const auto& block : m_blocks) {
+    writeByte(m_file, block.variables.size());
+    for (size_t i = 0; i < block.variables.size(); ++i) {
+      writeByte(m_file, block.types[i]);
+      writeByte(m_file, block.variables[i].size());
+      fwrite(block.variables[i].data(), 1, block.variables[i].size(), m_file);
+    }
+  }
+
+  m_running = true;
+  m_thread = std::thread(&FlightLogWriter::writerLoop, this);
+}
+
+void FlightLogWriter::stop()
+{
+  if (m_running) {
+    m_running = false;
+    m_thread.join();
+  }
+  if (m_file) {
+    fclose(m_file);
+    m_file = nullptr;
+  }
+}
+
+bool FlightLogWriter::append(
+  uint8_t block,
+  uint32_t time_in_ms,
+  const uint8_t* data,
+  size_t size)
+{
+  size_t head = m_head.load(std::memory_order_relaxed);
+  if (head - m_tail.load(std::memory_order_acquire) >= m_buffer.size()) {
+    ++m_numDropped;
+    return false;
+  }
+
+  FlightLogRecord& record = m_buffer[head & m_mask];
+  record.time_in_ms = time_in_ms;
+  record.block = block;
+  record.size = std::min(size, sizeof(record.data));
+  memcpy(record.data, data, record.size);
+  memset(record.data + record.size, 0, sizeof(record.data) - record.size);
+
+  m_head.store(head + 1, std::memory_order_release);
+  return true;
+}
+
+void FlightLogWriter::writerLoop()
+{
+  while (m_running) {
+    if (writeAvailable() == 0) {
+      std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+  }
+  writeAvailable();
+  fflush(m_file);
+}
+
+size_t FlightLogWriter::writeAvailable()
+{
+  size_t tail = m_tail.load(std::memory_order_relaxed);
+  size_t head = m_head.load(std::memory_order_acquire);
+  size_t numRecords = head - tail;
+
+  // the available records form at most two contiguous ranges of the buffer
+  while (tail != head) {
+    size_t idx = tail & m_mask;
+    size_t count = std::min(head - tail, m_buffer.size() - idx);
+    fwrite(&m_buffer[idx], sizeof(FlightLogRecord), count, m_file);
+    tail += count;
+  }
+  m_tail.store(tail, std::memory_order_release);
+  return numRecords;
+}
+
+////////////////////////////////////////////////////////////////
+
+FlightLogReader::FlightLogReader(
+  const std::string& fileName)
+  : m_file(nullptr)
+  , m_blocks()
+{
+  m_file = fopen(fileName.c_str(), "rb");
+  if (!m_file) {
+    throw std::runtime_error("Could not open " + fileName);
+  }
+
+  char magic[sizeof(flightLogMagic)];
+  if (fread(magic, 1, sizeof(magic), m_file) != sizeof(magic)
+      || memcmp(magic, flightLogMagic, sizeof(magic)) != 0) {
+    fclose(m_file);
+    throw std::runtime_error(fileName + " is not a flight log!");
+  }
+
+  try {
+    uint8_t version = readByte(m_file);
+    if (version != flightLogVersion) {
+      throw std::runtime_error("Unsupported flight log version " + std::to_string((int)version));
+    }
+    m_blocks.resize(readByte(m_file));
+    for (auto& block : m_blocks) {
+      size_t numVariables = readByte(m_file);
+      for (size_t i = 0; i < numVariables; ++i) {
+        block.types.push_back((Crazyflie::LogType)readByte(m_file));
+        std::string name(readByte(m_file), '\0');
+        if (fread(&name[0], 1, name.size(), m_file) != name.size()) {
+          throw std::runtime_error("Unexpected end of flight log header!");
+        }
+        block.variables.push_back(name);
+      }
+    }
+  } catch (...) {
+    fclose(m_file);
+    throw;
+  }
+}
+
+FlightLogReader::~FlightLogReader()
+{
+  fclose(m_file);
+}
+
+bool FlightLogReader::next(
+  FlightLogRecord& record)
+{
+  return fread(&record, sizeof(record), 1, m_file) == 1;
+}
+
+void FlightLogReader::decode(
+  const FlightLogRecord& record,
+  std::vector<double>& values) const
+{
+  values.clear();
+  if (record.block >= m_blocks.size()) {
+    return;
+  }
+  const FlightLogBlock& block = m_blocks[record.block];
+  size_t offset = 0;
+  for (auto type : block.types) {
+    size_t size = Crazyflie::size(type);
+    if (offset + size > record.size) {
+      break;
+    }
+    values.push_back(LogBlockGeneric::decodeValue(type, record.data + offset));
+    offset += size;
+  }
+}
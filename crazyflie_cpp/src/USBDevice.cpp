@@ -11,6 +11,7 @@ USBDevice::USBDevice(
     : m_ctx(NULL)
     , m_handle(NULL)
     , m_version(0.0)
+    , m_numControlTransfers(0)
     , m_idVendor(idVendor)
     , m_idProduct(idProduct)
 {
@@ -153,6 +154,7 @@ void USBDevice::sendVendorSetup(
         throw std::runtime_error("No valid device handle!");
     }
 
+    ++m_numControlTransfers;
     int status = libusb_control_transfer(
         m_handle,
         LIBUSB_REQUEST_TYPE_VENDOR,
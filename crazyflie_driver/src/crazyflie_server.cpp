@@ -2,12 +2,17 @@
 #include <tf/transform_broadcaster.h>
 #include <tf_conversions/tf_eigen.h>
 #include <ros/callback_queue.h>
+#include <boost/make_shared.hpp>
 
 #include "crazyflie_driver/AddCrazyflie.h"
+#include "crazyflie_driver/BroadcastRates.h"
 #include "crazyflie_driver/LogBlock.h"
 #include "crazyflie_driver/GenericLogData.h"
+#include "crazyflie_driver/Latencies.h"
+#include "crazyflie_driver/LinkStatistics.h"
 #include "crazyflie_driver/UpdateParams.h"
 #include "crazyflie_driver/UploadTrajectory.h"
+#include "crazyflie_driver/UploadTrajectories.h"
 #include "crazyflie_driver/StartCannedTrajectory.h"
 #include "crazyflie_driver/AvoidTarget.h"
 #undef major
@@ -28,14 +33,18 @@
 #include "std_msgs/Float32.h"
 
 #include <sensor_msgs/Joy.h>
-#include <sensor_msgs/PointCloud.h>
+#include <pcl_ros/point_cloud.h>
+#include <pcl_conversions/pcl_conversions.h>
 
 //#include <regex>
 #include <thread>
 #include <mutex>
 #include <condition_variable>
+#include <atomic>
 
 #include <crazyflie_cpp/Crazyflie.h>
+#include <crazyflie_cpp/FlightLog.h>
+#include <crazyflie_cpp/FrameWorkerPool.h>
 
 // debug test
 #include <signal.h>
@@ -55,12 +64,19 @@
 // Object tracker
 #include <libobjecttracker/object_tracker.h>
 #include <libobjecttracker/cloudlog.hpp>
+#include "tracker_config.h"
+#include "sharded_object_tracker.h"
 
 #include <fstream>
 #include <future>
+#include <numeric>
+#include <limits>
+#include <algorithm>
 #include <mutex>
 #include <wordexp.h> // tilde expansion
 
+#include "pose_publisher.h"
+
 /*
 Threading
  * There are 2N+1 threads, where N is the number of groups (== number of unique channels)
@@ -74,6 +90,8 @@ Threading
      and broadcasts the result.
    * Service worker: Listens to CF-based service calls (such as upload trajectory) and executes
      them. Those can be potentially long, without interfering with the VICON update.
+   * With radios_per_channel > 1, one broadcast worker per radio, which sends that radio's
+     share of the poses of a frame.
 */
 
 constexpr double pi() { return std::atan(1)*4; }
@@ -119,6 +137,180 @@ public:
 
 static ROSLogger rosLogger;
 
+// Histogram of the latencies (in seconds) of one stage of the mocap->broadcast
+// pipeline. add() is lock-free and may be called by one thread while another
+// thread collects (and resets) the current window.
+// Buckets are logarithmic (4 per power of two, starting at 1 us), i.e. the
+// reported percentiles are upper bounds with a resolution of about 19%.
+class LatencyHistogram
+{
+public:
+  struct summary
+  {
+    uint32_t count;
+    double p50;
+    double p99;
+    double max;
+  };
+
+  LatencyHistogram()
+    : m_buckets()
+    , m_maxUs(0)
+  {
+    for (auto& bucket : m_buckets) {
+      bucket = 0;
+    }
+  }
+
+  void add(double seconds)
+  {
+    uint32_t us = seconds > 0 ? std::min(seconds * 1e6, 4e9) : 0;
+    m_buckets[bucketIdx(us)].fetch_add(1, std::memory_order_relaxed);
+    uint32_t max = m_maxUs.load(std::memory_order_relaxed);
+    while (us > max && !m_maxUs.compare_exchange_weak(max, us, std::memory_order_relaxed)) {
+    }
+  }
+
+  // Returns the statistics since the last call and starts a new window
+  summary collect()
+  {
+    uint32_t counts[numBuckets];
+    summary result;
+    result.count = 0;
+    for (size_t i = 0; i < numBuckets; ++i) {
+      counts[i] = m_buckets[i].exchange(0, std::memory_order_relaxed);
+      result.count += counts[i];
+    }
+    result.max = m_maxUs.exchange(0, std::memory_order_relaxed) * 1e-6;
+    result.p50 = percentile(counts, result.count, 0.50, result.max);
+    result.p99 = percentile(counts, result.count, 0.99, result.max);
+    return result;
+  }
+
+private:
+  static const size_t numBuckets = 128;
+
+  static size_t bucketIdx(uint32_t us)
+  {
+    if (us == 0) {
+      return 0;
+    }
+    return std::min<size_t>(numBuckets - 1, 1 + 4 * std::log2(us));
+  }
+
+  static double percentile(
+    const uint32_t* counts,
+    uint32_t total,
+    double q,
+    double max)
+  {
+    uint32_t rank = std::ceil(q * total);
+    uint32_t sum = 0;
+    for (size_t i = 0; i < numBuckets && total > 0; ++i) {
+      sum += counts[i];
+      if (sum >= rank) {
+        // upper bound of bucket i
+        return std::min(std::pow(2.0, i / 4.0) * 1e-6, max);
+      }
+    }
+    return max;
+  }
+
+private:
+  std::atomic<uint32_t> m_buckets[numBuckets];
+  std::atomic<uint32_t> m_maxUs;
+};
+
+// Predicts the positions broadcast to the CFs to the (expected) time of
+// their transmission, compensating the mocap and processing latency.
+// Uses a constant velocity model (alpha-beta filter) per object id; the
+// velocity is clamped to the limits of the dynamics configuration.
+class PosePredictor
+{
+public:
+  PosePredictor()
+    : m_enabled(false)
+    , m_alpha(1.0)
+    , m_beta(0.0)
+    , m_maxHorizon(0.0)
+    , m_maxVelocity(Eigen::Vector3f::Constant(std::numeric_limits<float>::infinity()))
+    , m_states(256)
+  {
+  }
+
+  void configure(
+    bool enabled,
+    float alpha,
+    float beta,
+    float maxHorizon,
+    const Eigen::Vector3f& maxVelocity)
+  {
+    m_enabled = enabled;
+    m_alpha = alpha;
+    m_beta = beta;
+    m_maxHorizon = maxHorizon;
+    m_maxVelocity = maxVelocity;
+  }
+
+  bool enabled() const {
+    return m_enabled;
+  }
+
+  // Filters the position of object id measured at time t (in s) and
+  // returns it extrapolated by horizon seconds.
+  Eigen::Vector3f predict(
+    uint8_t id,
+    const Eigen::Vector3f& measurement,
+    double t,
+    double horizon)
+  {
+    // restart the filter after gaps (e.g. lost tracking)
+    const double maxGap = 0.1;
+
+    objectState& state = m_states[id];
+    double dt = t - state.time;
+    if (!state.valid || dt <= 0 || dt > maxGap) {
+      state.valid = true;
+      state.position = measurement;
+      state.velocity.setZero();
+    } else {
+      Eigen::Vector3f predicted = state.position + state.velocity * dt;
+      Eigen::Vector3f residual = measurement - predicted;
+      state.position = predicted + m_alpha * residual;
+      state.velocity += (m_beta / dt) * residual;
+      state.velocity = state.velocity.cwiseMin(m_maxVelocity).cwiseMax(-m_maxVelocity);
+    }
+    state.time = t;
+
+    horizon = std::min(std::max(horizon, 0.0), (double)m_maxHorizon);
+    return state.position + state.velocity * horizon;
+  }
+
+private:
+  struct objectState
+  {
+    objectState()
+      : valid(false)
+      , time(0)
+      , position(Eigen::Vector3f::Zero())
+      , velocity(Eigen::Vector3f::Zero())
+    {
+    }
+
+    bool valid;
+    double time;
+    Eigen::Vector3f position;
+    Eigen::Vector3f velocity;
+  };
+
+  bool m_enabled;
+  float m_alpha;
+  float m_beta;
+  float m_maxHorizon;
+  Eigen::Vector3f m_maxVelocity;
+  std::vector<objectState> m_states;
+};
+
 // TODO this is incredibly dumb, fix it
 /*
 std::mutex viconClientMutex;
@@ -156,6 +348,63 @@ static bool viconObjectAllMarkersVisible(
 }
 */
 
+// A "group/name" parameter of an update_params request, resolved against the
+// TOC once. The TOC entry is used as handle for subsequent updates.
+struct resolvedParam
+{
+  std::string rosParam;
+  const Crazyflie::ParamTocEntry* entry;
+};
+
+// A parameter value to be broadcast to (and verified on) the Crazyflies
+struct paramUpdate
+{
+  const Crazyflie::ParamTocEntry* entry;
+  Crazyflie::ParamValue value;
+};
+
+// One motion capture frame, shared (read-only) by the fast workers of all
+// groups and the point cloud publisher. The server keeps a pool of frames,
+// so that the next frame can be received while the groups still process the
+// current one; a frame is only reused once no one holds a reference to it.
+struct mocapFrame
+{
+  mocapFrame()
+    : markers(new pcl::PointCloud<pcl::PointXYZ>)
+    , objects()
+  {
+  }
+
+  pcl::PointCloud<pcl::PointXYZ>::Ptr markers;
+  std::vector<libmotioncapture::Object> objects;
+  std::chrono::high_resolution_clock::time_point startIteration;
+  double mocapLatency;
+};
+
+// "group/name" (as used in ROS parameter names) => "group.name" (TOC)
+std::string tocName(const std::string& param)
+{
+  std::string result(param);
+  size_t pos = result.find("/");
+  if (pos != std::string::npos) {
+    result[pos] = '.';
+  }
+  return result;
+}
+
+void toTrajectoryPiece(
+  const crazyflie_driver::QuadcopterTrajectoryPoly& poly,
+  Crazyflie::TrajectoryPiece& piece)
+{
+  piece.duration = poly.duration.toSec();
+  for (size_t i = 0; i < 8; ++i) {
+    piece.poly_x[i] = i < poly.poly_x.size() ? poly.poly_x[i] : 0;
+    piece.poly_y[i] = i < poly.poly_y.size() ? poly.poly_y[i] : 0;
+    piece.poly_z[i] = i < poly.poly_z.size() ? poly.poly_z[i] : 0;
+    piece.poly_yaw[i] = i < poly.poly_yaw.size() ? poly.poly_yaw[i] : 0;
+  }
+}
+
 class CrazyflieROS
 {
 public:
@@ -185,8 +434,13 @@ public:
     , m_serviceHover()
     , m_serviceAvoidTarget()
     , m_serviceSetGroup()
+    , m_groupMask(0)
+    , m_landedAt(0)
     , m_logBlocks(log_blocks)
     , m_forceNoCache(force_no_cache)
+    , m_startupTimings()
+    , m_resolvedParams()
+    , m_lastLinkStatistics()
   {
     ros::NodeHandle n;
     n.setCallbackQueue(&queue);
@@ -198,16 +452,22 @@ public:
     m_serviceAvoidTarget = n.advertiseService(tf_prefix + "/avoid_target", &CrazyflieROS::avoidTarget, this);
     m_serviceSetGroup = n.advertiseService(tf_prefix + "/set_group", &CrazyflieROS::setGroup, this);
 
+    ros::NodeHandle nl("~");
+    int radioPipelineDepth;
+    nl.param<int>("radio_pipeline_depth", radioPipelineDepth, 1);
+    m_cf.setRadioPipelineDepth(radioPipelineDepth);
+    // requests (e.g. trajectory packets) kept in flight by the batch engine
+    int batchWindow;
+    double batchRetransmitTimeout;
+    nl.param<int>("batch_window", batchWindow, 8);
+    nl.param<double>("batch_retransmit_timeout", batchRetransmitTimeout, 0.01);
+    m_cf.setBatchWindow(batchWindow);
+    m_cf.setBatchRetransmitTimeout(batchRetransmitTimeout);
+
     if (m_enableLogging) {
-      m_logFile.open("logcf" + std::to_string(id) + ".csv");
-      m_logFile << "time,";
       for (auto& logBlock : m_logBlocks) {
         m_pubLogDataGeneric.push_back(n.advertise<crazyflie_driver::GenericLogData>(tf_prefix + "/" + logBlock.topic_name, 10));
-        for (const auto& variableName : logBlock.variables) {
-          m_logFile << variableName << ",";
-        }
       }
-      m_logFile << std::endl;
     }
 
     // m_subscribeJoy = n.subscribe("/joy", 1, &CrazyflieROS::joyChanged, this);
@@ -218,7 +478,12 @@ public:
     m_logBlocks.clear();
     m_logBlocksGeneric.clear();
     m_cf.trySysOff();
-    m_logFile.close();
+    if (m_flightLog) {
+      m_flightLog->stop();
+      if (m_flightLog->numDropped() > 0) {
+        ROS_WARN("[%s] Dropped %lu log records", m_frame.c_str(), m_flightLog->numDropped());
+      }
+    }
   }
 
   const std::string& frame() const {
@@ -233,6 +498,47 @@ public:
     m_cf.sendPing();
   }
 
+  // Appends the statistics of the radio link since the previous call (see
+  // LinkStatistics.msg). Called by the reporting thread only.
+  void appendLinkStatistics(
+    crazyflie_driver::LinkStatistics& msg)
+  {
+    Crazyflie::linkStatistics stats;
+    m_cf.readLinkStatistics(stats);
+    const Crazyflie::linkStatistics& last = m_lastLinkStatistics;
+    uint64_t sent = stats.numSent - last.numSent;
+    uint64_t numRSSI = stats.numRSSI - last.numRSSI;
+    uint64_t transfers = stats.numTransfers - last.numTransfers;
+    msg.ids.push_back(m_id);
+    msg.sent.push_back(sent);
+    msg.ack_ratio.push_back(sent > 0 ? (stats.numAcked - last.numAcked) / (float)sent : 0);
+    msg.retries.push_back(sent > 0 ? (stats.numRetries - last.numRetries) / (float)sent : 0);
+    msg.rssi.push_back(numRSSI > 0 ? (stats.rssiSum - last.rssiSum) / (float)numRSSI : 0);
+    msg.ack_time_avg.push_back(transfers > 0 ? (stats.transferTime - last.transferTime) * 1e-9 / transfers : 0);
+    msg.ack_time_max.push_back(stats.maxTransferTime * 1e-9);
+    msg.radio_wait_avg.push_back(transfers > 0 ? (stats.waitTime - last.waitTime) * 1e-9 / transfers : 0);
+    m_lastLinkStatistics = stats;
+  }
+
+  bool loggingEnabled() const {
+    return m_enableLogging;
+  }
+
+  // Log records per second of all log blocks (0 without logging). Log data
+  // is only sent in acks, i.e. this is about the rate of pings needed.
+  double logRecordRate() const {
+    if (!m_enableLogging) {
+      return 0;
+    }
+    double rate = 0;
+    for (const auto& logBlock : m_logBlocks) {
+      // same period as passed to LogBlockGeneric::start (in 10 ms)
+      int period = std::max(logBlock.frequency / 10, 1);
+      rate += 100.0 / period;
+    }
+    return rate;
+  }
+
   // void joyChanged(
   //       const sensor_msgs::Joy::ConstPtr& msg)
   // {
@@ -292,12 +598,15 @@ public:
     ROS_INFO("[%s] Update parameters", m_frame.c_str());
     m_cf.startSetParamRequest();
     for (auto&& p : req.params) {
-      std::string ros_param = "/" + m_tf_prefix + "/" + p;
-      size_t pos = p.find("/");
-      std::string group(p.begin(), p.begin() + pos);
-      std::string name(p.begin() + pos + 1, p.end());
-
-      auto entry = m_cf.getParamTocEntry(group, name);
+      auto iter = m_resolvedParams.find(p);
+      if (iter == m_resolvedParams.end()) {
+        resolvedParam r;
+        r.rosParam = "/" + m_tf_prefix + "/" + p;
+        r.entry = m_cf.getParamTocEntry(tocName(p));
+        iter = m_resolvedParams.insert(std::make_pair(p, r)).first;
+      }
+      const std::string& ros_param = iter->second.rosParam;
+      auto entry = iter->second.entry;
       if (entry)
       {
         switch (entry->type) {
@@ -325,7 +634,7 @@ public:
         }
       }
       else {
-        ROS_ERROR("Could not find param %s/%s", group.c_str(), name.c_str());
+        ROS_ERROR("Could not find param %s", p.c_str());
       }
     }
     m_cf.setRequestedParams();
@@ -339,20 +648,45 @@ public:
   {
     ROS_INFO("[%s] Upload trajectory", m_frame.c_str());
 
-    m_cf.trajectoryReset();
-
-    for (auto& p : req.polygons) {
-      m_cf.trajectoryAdd(
-        p.duration.toSec(),
-        p.poly_x,
-        p.poly_y,
-        p.poly_z,
-        p.poly_yaw);
+    std::vector<Crazyflie::TrajectoryPiece> pieces(req.polygons.size());
+    for (size_t i = 0; i < pieces.size(); ++i) {
+      toTrajectoryPiece(req.polygons[i], pieces[i]);
     }
+    return uploadTrajectoryPieces(pieces);
+  }
 
-    ROS_INFO("[%s] Uploaded trajectory", m_frame.c_str());
-
+  bool resetTrajectory()
+  {
+    try {
+      m_cf.trajectoryReset();
+    }
+    catch(std::exception& e) {
+      ROS_ERROR("[%s] Trajectory reset failed: %s", m_frame.c_str(), e.what());
+      return false;
+    }
+    return true;
+  }
 
+  // Replaces the trajectory on the Crazyflie; returns false on failure.
+  // Packets marked in sharedPackets are skipped (they are broadcast).
+  bool uploadTrajectoryPieces(
+    const std::vector<Crazyflie::TrajectoryPiece>& pieces,
+    const std::vector<uint8_t>& sharedPackets = std::vector<uint8_t>(),
+    bool reset = true)
+  {
+    auto start = std::chrono::steady_clock::now();
+    try {
+      if (reset) {
+        m_cf.trajectoryReset();
+      }
+      m_cf.trajectoryAdd(pieces, sharedPackets);
+    }
+    catch(std::exception& e) {
+      ROS_ERROR("[%s] Trajectory upload failed: %s", m_frame.c_str(), e.what());
+      return false;
+    }
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+    ROS_INFO("[%s] Uploaded trajectory (%lu pieces, %f s)", m_frame.c_str(), pieces.size(), elapsed.count());
     return true;
   }
 
@@ -381,6 +715,7 @@ public:
     ROS_INFO("[%s] Takeoff", m_frame.c_str());
 
     m_cf.takeoff(req.group, req.height, req.time_from_start.toSec() * 1000);
+    commandedFlight();
 
     return true;
   }
@@ -392,6 +727,7 @@ public:
     ROS_INFO("[%s] Land", m_frame.c_str());
 
     m_cf.land(req.group, req.height, req.time_from_start.toSec() * 1000);
+    commandedLanding(req.time_from_start.toSec());
 
     return true;
   }
@@ -403,6 +739,7 @@ public:
     ROS_INFO("[%s] Hover", m_frame.c_str());
 
     m_cf.trajectoryHover(req.goal.x, req.goal.y, req.goal.z, req.yaw, req.duration.toSec());
+    commandedFlight();
 
     return true;
   }
@@ -416,6 +753,7 @@ public:
     m_cf.avoidTarget(
       req.home.x, req.home.y, req.home.z,
       req.max_displacement, req.max_speed);
+    commandedFlight();
 
     return true;
   }
@@ -427,10 +765,74 @@ public:
     ROS_INFO("[%s] Set Group", m_frame.c_str());
 
     m_cf.setGroup(req.group);
+    m_groupMask = req.group;
 
     return true;
   }
 
+  // True if broadcasts to the given group (0: all groups) reach this CF.
+  // Only known for group masks set by set_group.
+  bool inGroup(uint8_t group) const
+  {
+    return group == 0 || (m_groupMask & group);
+  }
+
+  bool groupMaskKnown() const
+  {
+    return m_groupMask != 0;
+  }
+
+  // Flight state, as far as known from the commands sent to this CF (or
+  // its group). Set by the service threads, read by the fast thread.
+  // A CF counts as landed initially and once a landing has finished.
+  void commandedFlight()
+  {
+    m_landedAt = std::numeric_limits<int64_t>::max();
+  }
+
+  void commandedLanding(
+    double duration)
+  {
+    // allow for the time it takes to settle after the landing trajectory
+    const double margin = 1.0;
+    auto landedAt = std::chrono::steady_clock::now()
+      + std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::duration<double>(duration + margin));
+    m_landedAt = landedAt.time_since_epoch().count();
+  }
+
+  bool landed(
+    std::chrono::steady_clock::time_point now) const
+  {
+    return now.time_since_epoch().count() >= m_landedAt;
+  }
+
+  // Reads the given params back from the Crazyflie; returns true if all of
+  // them have the expected value.
+  bool verifyParams(
+    const std::vector<paramUpdate>& updates)
+  {
+    std::vector<uint8_t> ids;
+    for (const auto& update : updates) {
+      ids.push_back(update.entry->id);
+    }
+    try {
+      m_cf.requestParams(ids);
+    }
+    catch(std::exception& e) {
+      ROS_WARN("[%s] Could not read params: %s", m_frame.c_str(), e.what());
+      return false;
+    }
+    for (const auto& update : updates) {
+      // lowest two bits of the type: log2 of the size in bytes
+      size_t size = 1 << (update.entry->type & 3);
+      Crazyflie::ParamValue value = m_cf.getParam<Crazyflie::ParamValue>(update.entry->id);
+      if (memcmp(&value, &update.value, size) != 0) {
+        return false;
+      }
+    }
+    return true;
+  }
+
   void run(
     ros::CallbackQueue& queue)
   {
@@ -449,6 +851,7 @@ public:
     {
       ROS_INFO("[%s] Requesting parameters...", m_frame.c_str());
       m_cf.requestParamToc(m_forceNoCache);
+      m_resolvedParams.clear();
       for (auto iter = m_cf.paramsBegin(); iter != m_cf.paramsEnd(); ++iter) {
         auto entry = *iter;
         std::string paramName = "/" + m_tf_prefix + "/" + entry.group + "/" + entry.name;
@@ -483,6 +886,7 @@ public:
     auto end1 = std::chrono::system_clock::now();
     std::chrono::duration<double> elapsedSeconds1 = end1-start;
     ROS_INFO("[%s] reqParamTOC: %f s", m_frame.c_str(), elapsedSeconds1.count());
+    m_startupTimings["reqParamTOC"] = elapsedSeconds1.count();
 
     // Logging
     if (m_enableLogging) {
@@ -491,6 +895,11 @@ public:
       auto end2 = std::chrono::system_clock::now();
       std::chrono::duration<double> elapsedSeconds2 = end2-end1;
       ROS_INFO("[%s] reqLogTOC: %f s", m_frame.c_str(), elapsedSeconds2.count());
+      m_startupTimings["reqLogTOC"] = elapsedSeconds2.count();
+
+      // Samples are recorded in a binary log (see crazyflie_tools/logToCsv),
+      // written by a background thread.
+      m_flightLog.reset(new FlightLogWriter("logcf" + std::to_string(m_id) + ".cflog"));
 
       m_logBlocksGeneric.resize(m_logBlocks.size());
       // custom log blocks
@@ -510,12 +919,28 @@ public:
           logBlock.variables,
           (void*)&m_pubLogDataGeneric[i],
           cb));
-        m_logBlocksGeneric[i]->start(logBlock.frequency / 10);
+
+        FlightLogBlock flightLogBlock;
+        flightLogBlock.variables = logBlock.variables;
+        for (const auto& column : m_logBlocksGeneric[i]->columns()) {
+          flightLogBlock.types.push_back(column.type);
+        }
+        uint8_t flightLogBlockId = m_flightLog->addBlock(flightLogBlock);
+        FlightLogWriter* flightLog = m_flightLog.get();
+        m_logBlocksGeneric[i]->setRawCallback(
+          [flightLog, flightLogBlockId](uint32_t time_in_ms, const uint8_t* data, size_t size, void*) {
+            flightLog->append(flightLogBlockId, time_in_ms, data, size);
+          });
         ++i;
       }
+      m_flightLog->start();
+      for (size_t j = 0; j < m_logBlocks.size(); ++j) {
+        m_logBlocksGeneric[j]->start(m_logBlocks[j].frequency / 10);
+      }
       auto end3 = std::chrono::system_clock::now();
       std::chrono::duration<double> elapsedSeconds3 = end3-end2;
-      ROS_INFO("[%s] logBlocks: %f s", m_frame.c_str(), elapsedSeconds1.count());
+      ROS_INFO("[%s] logBlocks: %f s", m_frame.c_str(), elapsedSeconds3.count());
+      m_startupTimings["logBlocks"] = elapsedSeconds3.count();
     }
 
     auto end = std::chrono::system_clock::now();
@@ -540,15 +965,10 @@ public:
 
     ros::Publisher* pub = reinterpret_cast<ros::Publisher*>(userData);
 
-    crazyflie_driver::GenericLogData msg;
+    // reuse the message (and its buffer) for every packet
+    crazyflie_driver::GenericLogData& msg = m_logDataGenericMsg;
     msg.header.stamp = ros::Time(time_in_ms/1000.0);
-    msg.values = *values;
-
-    m_logFile << time_in_ms / 1000.0 << ",";
-    for (const auto& value : *values) {
-      m_logFile << value << ",";
-    }
-    m_logFile << std::endl;
+    msg.values.assign(values->begin(), values->end());
 
     pub->publish(msg);
   }
@@ -560,6 +980,18 @@ public:
     return m_cf.getParamTocEntry(group, name);
   }
 
+  const Crazyflie::ParamTocEntry* getParamTocEntry(
+    const std::string& fullName) const
+  {
+    return m_cf.getParamTocEntry(fullName);
+  }
+
+  // Duration (in s) of each phase of run()
+  const std::map<std::string, double>& startupTimings() const
+  {
+    return m_startupTimings;
+  }
+
 private:
   Crazyflie m_cf;
   std::string m_tf_prefix;
@@ -577,34 +1009,38 @@ private:
   ros::ServiceServer m_serviceHover;
   ros::ServiceServer m_serviceAvoidTarget;
   ros::ServiceServer m_serviceSetGroup;
+  uint8_t m_groupMask;
+  // steady_clock ticks from which on the CF is landed (see landed())
+  std::atomic<int64_t> m_landedAt;
 
   std::vector<crazyflie_driver::LogBlock> m_logBlocks;
   std::vector<ros::Publisher> m_pubLogDataGeneric;
   std::vector<std::unique_ptr<LogBlockGeneric> > m_logBlocksGeneric;
+  crazyflie_driver::GenericLogData m_logDataGenericMsg;
 
   ros::Subscriber m_subscribeJoy;
 
-  std::ofstream m_logFile;
+  std::unique_ptr<FlightLogWriter> m_flightLog;
   bool m_forceNoCache;
+  std::map<std::string, double> m_startupTimings;
+  // update_params: "group/name" => resolved parameter
+  std::unordered_map<std::string, resolvedParam> m_resolvedParams;
+  // snapshot of the previous appendLinkStatistics call
+  Crazyflie::linkStatistics m_lastLinkStatistics;
 };
 
 
-// handles a group of Crazyflies, which share a radio
+// handles a group of Crazyflies, which share a channel and a pool of radios:
+// each CF is assigned one radio of the pool (round robin), which carries its
+// unicast traffic as well as its poses. Other broadcasts are spread over the
+// pool, since every CF of the channel receives them from any radio.
 class CrazyflieGroup
 {
 public:
-  struct latency
-  {
-    double objectTracking;
-    double broadcasting;
-  };
-
   CrazyflieGroup(
     const std::vector<libobjecttracker::DynamicsConfiguration>& dynamicsConfigurations,
     const std::vector<libobjecttracker::MarkerConfiguration>& markerConfigurations,
-    pcl::PointCloud<pcl::PointXYZ>::Ptr pMarkers,
-    std::vector<libmotioncapture::Object>* pMocapObjects,
-    int radio,
+    const std::vector<int>& radios,
     int channel,
     const std::string broadcastAddress,
     bool useMotionCaptureObjectTracking,
@@ -614,28 +1050,128 @@ public:
     )
     : m_cfs()
     , m_tracker(nullptr)
-    , m_radio(radio)
-    , m_pMarkers(pMarkers)
-    , m_pMocapObjects(pMocapObjects)
+    , m_radio(radios.front())
+    , m_radios(radios)
+    , m_channel(channel)
     , m_slowQueue()
-    , m_cfbc("radio://" + std::to_string(radio) + "/" + std::to_string(channel) + "/2M/" + broadcastAddress)
+    , m_slowMutex()
+    , m_numSlowPauses(0)
+    , m_cfbcs()
+    , m_nextBroadcaster(0)
+    , m_radioIndexById(256, 0)
+    , m_poseStripes(radios.size())
+    , m_broadcastWorkers()
+    , m_numFrames(0)
+    , m_lastNumFrames(0)
+    , m_lastNumControlTransfers(0)
     , m_isEmergency(false)
     , m_useMotionCaptureObjectTracking(useMotionCaptureObjectTracking)
-    , m_br()
+    , m_posePublisher()
     , m_interactiveObject(interactiveObject)
-    , m_outputCSVs()
+    , m_latencyObjectTracking()
+    , m_latencyBroadcasting()
     , m_phase(0)
-    , m_phaseStart()
+    , m_resolvedParams()
+    , m_paramVerificationTimeout(0)
+    , m_posePredictor()
+    , m_posePredictionOffset(0)
+    , m_idlePoseInterval(0)
+    , m_idlePoseMotionThreshold(0)
+    , m_idlePoses(256)
+    , m_cfById(256, nullptr)
+    , m_poses()
   {
+    ros::NodeHandle nl("~");
+
+    for (int radio : m_radios) {
+      m_cfbcs.push_back(std::unique_ptr<CrazyflieBroadcaster>(new CrazyflieBroadcaster(
+        "radio://" + std::to_string(radio) + "/" + std::to_string(channel) + "/2M/" + broadcastAddress)));
+    }
+
     std::vector<libobjecttracker::Object> objects;
     readObjects(objects, channel, logBlocks);
-    m_tracker = new libobjecttracker::ObjectTracker(
+    // The objects of a group can be tracked by several threads, each of
+    // them getting the markers within tracker_shard_margin of its objects.
+    int trackerShards;
+    double trackerShardMargin;
+    nl.param("tracker_shards", trackerShards, 1);
+    nl.param("tracker_shard_margin", trackerShardMargin, 0.5);
+    m_tracker = new ShardedObjectTracker(
       dynamicsConfigurations,
       markerConfigurations,
-      objects);
+      objects,
+      std::max(trackerShards, 1),
+      trackerShardMargin);
     m_tracker->setLogWarningCallback(logWarn);
-    if (writeCSVs) {
-      m_outputCSVs.resize(m_cfs.size());
+    // tf (and the CSVs) are published by a separate thread, at most
+    // tf_publish_rate times per second (0: every frame)
+    double tfPublishRate;
+    nl.param("tf_publish_rate", tfPublishRate, 100.0);
+    m_posePublisher.reset(new PosePublisher(tfPublishRate, writeCSVs ? m_cfs.size() : 0));
+
+    bool broadcastRotate;
+    double broadcastFrameBudget;
+    nl.param("broadcast_rotate", broadcastRotate, false);
+    nl.param("broadcast_frame_budget", broadcastFrameBudget, 0.0);
+    for (auto& cfbc : m_cfbcs) {
+      cfbc->setPositionRotation(broadcastRotate);
+      cfbc->setPositionFrameBudget(broadcastFrameBudget);
+    }
+    // 0 disables the read back of broadcast params
+    nl.param("param_verification_timeout", m_paramVerificationTimeout, 1.0);
+
+    // Extrapolate the broadcast positions by the mocap latency, the time
+    // spent since the frame arrived and pose_prediction_offset (radio).
+    bool posePrediction;
+    double posePredictionAlpha;
+    double posePredictionBeta;
+    double posePredictionMaxHorizon;
+    nl.param("pose_prediction", posePrediction, false);
+    nl.param("pose_prediction_alpha", posePredictionAlpha, 0.8);
+    nl.param("pose_prediction_beta", posePredictionBeta, 0.3);
+    nl.param("pose_prediction_max_horizon", posePredictionMaxHorizon, 0.05);
+    nl.param("pose_prediction_offset", m_posePredictionOffset, 0.002);
+    Eigen::Vector3f maxVelocity = Eigen::Vector3f::Constant(std::numeric_limits<float>::infinity());
+    if (!dynamicsConfigurations.empty()) {
+      // all objects use the first dynamics configuration (see readObjects)
+      maxVelocity = Eigen::Vector3f(
+        dynamicsConfigurations[0].maxXVelocity,
+        dynamicsConfigurations[0].maxYVelocity,
+        dynamicsConfigurations[0].maxZVelocity);
+    }
+    m_posePredictor.configure(
+      posePrediction,
+      posePredictionAlpha,
+      posePredictionBeta,
+      posePredictionMaxHorizon,
+      maxVelocity);
+
+    // Landed CFs which do not move get a pose every idle_pose_interval s
+    // only, leaving the radio to the flying ones. 0 disables this.
+    double idlePoseInterval;
+    double idlePoseMotionThreshold;
+    nl.param("idle_pose_interval", idlePoseInterval, 0.0);
+    nl.param("idle_pose_motion_threshold", idlePoseMotionThreshold, 0.01);
+    m_idlePoseInterval = std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+      std::chrono::duration<double>(idlePoseInterval));
+    m_idlePoseMotionThreshold = idlePoseMotionThreshold;
+    for (auto& pose : m_idlePoses) {
+      pose.valid = false;
+    }
+    for (auto cf : m_cfs) {
+      m_cfById[cf->id()] = cf;
+    }
+    // all CFs and the interactive object
+    m_poses.reserve(m_cfs.size() + 1);
+
+    // the radios of the pool send their share of each frame in parallel
+    if (m_cfbcs.size() > 1) {
+      std::vector<std::function<void()> > jobs;
+      for (size_t r = 0; r < m_cfbcs.size(); ++r) {
+        m_poseStripes[r].reserve(m_cfs.size() + 1);
+        jobs.push_back([this, r] { m_cfbcs[r]->sendPositionExternalBringup(m_poseStripes[r]); });
+      }
+      m_broadcastWorkers.start(jobs, std::vector<int>());
     }
   }
 
@@ -647,80 +1183,97 @@ public:
     delete m_tracker;
   }
 
-  const latency& lastLatency() const {
-    return m_latency;
+  LatencyHistogram& objectTrackingLatency() {
+    return m_latencyObjectTracking;
+  }
+
+  LatencyHistogram& broadcastingLatency() {
+    return m_latencyBroadcasting;
+  }
+
+  void positionUpdateRates(
+    std::vector<CrazyflieBroadcaster::PositionUpdateRate>& rates)
+  {
+    rates.clear();
+    std::vector<CrazyflieBroadcaster::PositionUpdateRate> cfbcRates;
+    for (auto& cfbc : m_cfbcs) {
+      cfbc->positionUpdateRates(cfbcRates);
+      rates.insert(rates.end(), cfbcRates.begin(), cfbcRates.end());
+    }
   }
 
   int radio() const {
     return m_radio;
   }
 
-  void runInteractiveObject(std::vector<stateExternalBringup> &states)
+  // Link statistics of each CF and of the radios since the previous call
+  void linkStatistics(
+    crazyflie_driver::LinkStatistics& msg)
   {
-    publishRigidBody(m_interactiveObject, 0xFF, states);
+    msg.channel = m_channel;
+    for (auto cf : m_cfs) {
+      cf->appendLinkStatistics(msg);
+    }
+
+    uint64_t numFrames = m_numFrames;
+    uint64_t numControlTransfers = 0;
+    for (auto& cfbc : m_cfbcs) {
+      numControlTransfers += cfbc->numRadioControlTransfers();
+    }
+    msg.frames = numFrames - m_lastNumFrames;
+    msg.control_transfers = numControlTransfers - m_lastNumControlTransfers;
+    msg.control_transfers_per_frame = msg.frames > 0 ? msg.control_transfers / (float)msg.frames : 0;
+    m_lastNumFrames = numFrames;
+    m_lastNumControlTransfers = numControlTransfers;
   }
 
-  void runFast()
+  void runInteractiveObject(
+    const mocapFrame& frame,
+    poseBatch& states)
+  {
+    publishRigidBody(frame, m_interactiveObject, 0xFF, states);
+  }
+
+  void runFast(
+    const mocapFrame& frame)
   {
     auto stamp = std::chrono::high_resolution_clock::now();
 
-    std::vector<stateExternalBringup> states;
+    poseBatch& states = m_poses;
+    states.clear();
 
     if (!m_interactiveObject.empty()) {
-      runInteractiveObject(states);
+      runInteractiveObject(frame, states);
     }
 
     if (m_useMotionCaptureObjectTracking) {
       for (auto cf : m_cfs) {
-        publishRigidBody(cf->frame(), cf->id(), states);
+        publishRigidBody(frame, cf->frame(), cf->id(), states);
       }
     } else {
       // run object tracker
       {
         auto start = std::chrono::high_resolution_clock::now();
-        m_tracker->update(m_pMarkers);
+        m_tracker->update(frame.markers);
         auto end = std::chrono::high_resolution_clock::now();
         std::chrono::duration<double> elapsedSeconds = end-start;
-        m_latency.objectTracking = elapsedSeconds.count();
-        // totalLatency += elapsedSeconds.count();
-        // ROS_INFO("Tracking: %f s", elapsedSeconds.count());
+        m_latencyObjectTracking.add(elapsedSeconds.count());
       }
 
       for (size_t i = 0; i < m_cfs.size(); ++i) {
-        if (m_tracker->objects()[i].lastTransformationValid()) {
+        if (m_tracker->object(i).lastTransformationValid()) {
 
-          const Eigen::Affine3f& transform = m_tracker->objects()[i].transformation();
+          const Eigen::Affine3f& transform = m_tracker->object(i).transformation();
           Eigen::Quaternionf q(transform.rotation());
           const auto& translation = transform.translation();
 
-          states.resize(states.size() + 1);
-          states.back().id = m_cfs[i]->id();
-          states.back().x = translation.x();
-          states.back().y = translation.y();
-          states.back().z = translation.z();
-          states.back().q0 = q.x();
-          states.back().q1 = q.y();
-          states.back().q2 = q.z();
-          states.back().q3 = q.w();
-
-          tf::Transform tftransform;
-          tftransform.setOrigin(tf::Vector3(translation.x(), translation.y(), translation.z()));
-          tftransform.setRotation(tf::Quaternion(q.x(), q.y(), q.z(), q.w()));
-          // Eigen::Affine3d transformd = transform.cast<double>();
-          // tf::transformEigenToTF(transformd, tftransform);
-          // tftransform.setOrigin(tf::Vector3(translation.x(), translation.y(), translation.z()));
-          // tf::Quaternion tfq(q.x(), q.y(), q.z(), q.w());
-          m_br.sendTransform(tf::StampedTransform(tftransform, ros::Time::now(), "world", m_cfs[i]->frame()));
-
-          if (m_outputCSVs.size() > 0) {
-            std::chrono::duration<double> tDuration = stamp - m_phaseStart;
-            double t = tDuration.count();
-            auto rpy = q.toRotationMatrix().eulerAngles(0, 1, 2);
-            *m_outputCSVs[i] << t << "," << states.back().x << "," << states.back().y << "," << states.back().z
-                                  << "," << rpy(0) << "," << rpy(1) << "," << rpy(2) << "\n";
-          }
+          states.push_back(m_cfs[i]->id(),
+            translation.x(), translation.y(), translation.z(),
+            q.x(), q.y(), q.z(), q.w());
+
+          m_posePublisher->add(m_cfs[i]->frame(), translation, q, i);
         } else {
-          std::chrono::duration<double> elapsedSeconds = stamp - m_tracker->objects()[i].lastValidTime();
+          std::chrono::duration<double> elapsedSeconds = stamp - m_tracker->object(i).lastValidTime();
           ROS_WARN("No updated pose for CF %s for %f s.",
             m_cfs[i]->frame().c_str(),
             elapsedSeconds.count());
@@ -728,16 +1281,31 @@ public:
       }
     }
 
+    if (m_idlePoseInterval.count() > 0) {
+      dropIdlePoses(states);
+    }
+
+    if (m_posePredictor.enabled()) {
+      predictPositions(frame, states);
+    }
+
     {
       auto start = std::chrono::high_resolution_clock::now();
-      m_cfbc.sendPositionExternalBringup(states);
+      if (m_cfbcs.size() == 1) {
+        m_cfbcs[0]->sendPositionExternalBringup(states);
+      } else {
+        stripePoses(states);
+        m_broadcastWorkers.run();
+      }
       auto end = std::chrono::high_resolution_clock::now();
       std::chrono::duration<double> elapsedSeconds = end-start;
-      m_latency.broadcasting = elapsedSeconds.count();
-      // totalLatency += elapsedSeconds.count();
-      // ROS_INFO("Broadcasting: %f s", elapsedSeconds.count());
+      m_latencyBroadcasting.add(elapsedSeconds.count());
+      ++m_numFrames;
     }
 
+    // visualization only after the poses are on the air
+    m_posePublisher->publish(frame.startIteration);
+
     // auto time = std::chrono::duration_cast<std::chrono::microseconds>(
     //   std::chrono::high_resolution_clock::now().time_since_epoch()).count();
     // for (const auto& state : states) {
@@ -746,26 +1314,164 @@ public:
 
   }
 
+  // Handles the service calls of the CFs as they arrive and, with logging,
+  // pings every CF at log_ping_factor times the rate of its log records,
+  // but at least log_ping_min_rate times per second (which also polls the
+  // console and other downlink traffic of CFs without log blocks).
+  // Both run on this thread, since a Crazyflie may only be used by one
+  // thread at a time.
   void runSlow()
   {
     ros::NodeHandle nl("~");
-    bool enableLogging;
-    nl.getParam("enable_logging", enableLogging);
+    double logPingFactor;
+    nl.param("log_ping_factor", logPingFactor, 1.5);
+    // about the rate of the former fixed 10 ms ping loop
+    double logPingMinRate;
+    nl.param("log_ping_min_rate", logPingMinRate, 100.0);
+
+    typedef std::chrono::steady_clock clock;
+    struct pingSchedule
+    {
+      CrazyflieROS* cf;
+      clock::duration period;
+      clock::time_point next;
+    };
+    std::vector<pingSchedule> pings;
+    auto now = clock::now();
+    for (auto cf : m_cfs) {
+      if (!cf->loggingEnabled()) {
+        continue;
+      }
+      double rate = std::max(cf->logRecordRate() * logPingFactor, logPingMinRate);
+      if (rate > 0) {
+        auto period = std::chrono::duration_cast<clock::duration>(
+          std::chrono::duration<double>(1.0 / rate));
+        pings.push_back({cf, period, now});
+      }
+    }
 
     while(ros::ok() && !m_isEmergency) {
-      if (enableLogging) {
-        for (const auto& cf : m_cfs) {
-          cf->sendPing();
+      // wait for callbacks until the next ping is due (at most 100 ms, to
+      // notice the shutdown)
+      clock::duration timeout = std::chrono::milliseconds(100);
+      for (const auto& ping : pings) {
+        timeout = std::min(timeout, ping.next - now);
+      }
+      std::chrono::duration<double> timeoutSeconds = timeout;
+
+      while (m_numSlowPauses > 0) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+      }
+      {
+        std::unique_lock<std::mutex> lock(m_slowMutex);
+        m_slowQueue.callAvailable(ros::WallDuration(std::max(timeoutSeconds.count(), 0.0)));
+
+        now = clock::now();
+        for (auto& ping : pings) {
+          if (ping.next <= now) {
+            ping.cf->sendPing();
+            // don't catch up on missed pings
+            ping.next = std::max(ping.next + ping.period, now);
+          }
         }
       }
-      m_slowQueue.callAvailable(ros::WallDuration(0));
-      std::this_thread::sleep_for(std::chrono::milliseconds(10));
     }
   }
 
-  void emergency()
+  // Pauses the slow thread until the returned lock is released. Since the
+  // slow thread waits for callbacks while holding m_slowMutex, it is woken
+  // up and kept from taking the mutex again until we have it.
+  std::unique_lock<std::mutex> pauseSlow()
+  {
+    ++m_numSlowPauses;
+    m_slowQueue.addCallback(boost::make_shared<wakeUpCallback>());
+    std::unique_lock<std::mutex> lock(m_slowMutex);
+    --m_numSlowPauses;
+    return lock;
+  }
+
+  // Uploads the given trajectories (by frame) to the CFs of this group, one
+  // thread per CF, so that their packets interleave on the shared radio.
+  // The slow thread of the group is paused meanwhile.
+  // With deduplicate, packets which are identical for all CFs are broadcast
+  // (numRepeats times) instead. This is only done if every CF of the group
+  // gets a trajectory, since the broadcasts reach all of them. Broadcasts are
+  // not acknowledged, i.e. success only covers the packets sent to each CF.
+  void uploadTrajectories(
+    const std::map<std::string, std::vector<Crazyflie::TrajectoryPiece> >& trajectories,
+    bool deduplicate,
+    size_t numRepeats,
+    std::map<std::string, bool>& success,
+    size_t& numSharedPackets)
+  {
+    std::unique_lock<std::mutex> lock = pauseSlow();
+
+    std::vector<std::pair<CrazyflieROS*, const std::vector<Crazyflie::TrajectoryPiece>*> > uploads;
+    for (auto cf : m_cfs) {
+      auto iter = trajectories.find(cf->frame());
+      if (iter != trajectories.end()) {
+        uploads.push_back(std::make_pair(cf, &iter->second));
+      }
+    }
+
+    // runs f for all uploads in parallel; false marks an upload as failed
+    auto runAll = [&](std::function<bool(CrazyflieROS*, const std::vector<Crazyflie::TrajectoryPiece>&)> f) {
+      std::vector<std::future<bool> > handles;
+      for (const auto& upload : uploads) {
+        CrazyflieROS* cf = upload.first;
+        const std::vector<Crazyflie::TrajectoryPiece>* pieces = upload.second;
+        bool ok = success.find(cf->frame()) == success.end() || success[cf->frame()];
+        handles.push_back(std::async(std::launch::async, [=] { return ok && f(cf, *pieces); }));
+      }
+      for (size_t i = 0; i < uploads.size(); ++i) {
+        success[uploads[i].first->frame()] = handles[i].get();
+      }
+    };
+
+    std::vector<uint8_t> sharedPackets;
+    if (deduplicate && uploads.size() > 1 && uploads.size() == m_cfs.size()) {
+      std::vector<const std::vector<Crazyflie::TrajectoryPiece>*> pieces;
+      for (const auto& upload : uploads) {
+        pieces.push_back(upload.second);
+      }
+      sharedPackets = Crazyflie::sharedTrajectoryPackets(pieces);
+    }
+    numSharedPackets = 0;
+    for (uint8_t shared : sharedPackets) {
+      for (size_t j = 0; j < Crazyflie::TrajectoryPieceNumPackets; ++j) {
+        numSharedPackets += (shared >> j) & 1;
+      }
+    }
+
+    if (numSharedPackets == 0) {
+      runAll([](CrazyflieROS* cf, const std::vector<Crazyflie::TrajectoryPiece>& pieces) {
+        return cf->uploadTrajectoryPieces(pieces);
+      });
+      return;
+    }
+
+    // reset all, broadcast the shared packets, then send the rest
+    runAll([](CrazyflieROS* cf, const std::vector<Crazyflie::TrajectoryPiece>& pieces) {
+      return cf->resetTrajectory();
+    });
+    broadcaster().trajectoryAdd(*uploads[0].second, sharedPackets, numRepeats);
+    runAll([&](CrazyflieROS* cf, const std::vector<Crazyflie::TrajectoryPiece>& pieces) {
+      return cf->uploadTrajectoryPieces(pieces, sharedPackets, /*reset*/ false);
+    });
+  }
+
+  // Called by the emergency thread of the server, i.e. possibly while the
+  // other threads of this group use the radio.
+  void emergency(
+    size_t numRepeats)
   {
     m_isEmergency = true;
+    // the first stop goes out on every radio of the pool
+    for (size_t i = 0; i < numRepeats; ++i) {
+      for (auto& cfbc : m_cfbcs) {
+        cfbc->emergencyStop(1);
+      }
+    }
   }
 
   void takeoff(
@@ -774,9 +1480,10 @@ public:
     uint16_t time_in_ms)
   {
     // for (size_t i = 0; i < 10; ++i) {
-    m_cfbc.takeoff(group, targetHeight, time_in_ms);
+    broadcaster().takeoff(group, targetHeight, time_in_ms);
       // std::this_thread::sleep_for(std::chrono::milliseconds(1));
     // }
+    commandedFlight(group);
   }
 
   void land(
@@ -785,9 +1492,15 @@ public:
     uint16_t time_in_ms)
   {
     // for (size_t i = 0; i < 10; ++i) {
-      m_cfbc.land(group, targetHeight, time_in_ms);
+      broadcaster().land(group, targetHeight, time_in_ms);
       // std::this_thread::sleep_for(std::chrono::milliseconds(1));
     // }
+    for (auto cf : m_cfs) {
+      // CFs whose group mask is unknown keep their full pose rate
+      if (cf->inGroup(group)) {
+        cf->commandedLanding(time_in_ms / 1000.0);
+      }
+    }
   }
 
   void startTrajectory(
@@ -795,27 +1508,30 @@ public:
     bool reversed)
   {
     // for (size_t i = 0; i < 10; ++i) {
-      m_cfbc.trajectoryStart(group, reversed);
+      broadcaster().trajectoryStart(group, reversed);
       // std::this_thread::sleep_for(std::chrono::milliseconds(1));
     // }
+    commandedFlight(group);
   }
 
   void startEllipse(
     uint8_t group)
   {
     // for (size_t i = 0; i < 10; ++i) {
-      m_cfbc.ellipse(group);
+      broadcaster().ellipse(group);
       // std::this_thread::sleep_for(std::chrono::milliseconds(1));
     // }
+    commandedFlight(group);
   }
 
   void goHome(
     uint8_t group)
   {
     // for (size_t i = 0; i < 10; ++i) {
-      m_cfbc.goHome(group);
+      broadcaster().goHome(group);
       // std::this_thread::sleep_for(std::chrono::milliseconds(1));
     // }
+    commandedFlight(group);
   }
 
   void startCannedTrajectory(
@@ -823,104 +1539,283 @@ public:
     uint16_t trajectory,
     float timescale)
   {
-      m_cfbc.startCannedTrajectory(group, trajectory, timescale);
+      broadcaster().startCannedTrajectory(group, trajectory, timescale);
+      commandedFlight(group);
   }
 
   void nextPhase()
   {
-      for (size_t i = 0; i < m_outputCSVs.size(); ++i) {
-        auto& file = *m_outputCSVs[i];
-        file.close();
-        file.open("cf" + std::to_string(m_cfs[i]->id()) + "_phase" + std::to_string(m_phase + 1) + ".csv");
-        file << "t,x,y,z,roll,pitch,yaw\n";
+      std::vector<std::string> fileNames;
+      for (auto cf : m_cfs) {
+        fileNames.push_back("cf" + std::to_string(cf->id()) + "_phase" + std::to_string(m_phase + 1) + ".csv");
       }
+      m_posePublisher->openCSVs(fileNames);
       m_phase += 1;
-      m_phaseStart = std::chrono::system_clock::now();
   }
 
+  // Broadcasts the given params to a group of CFs (0: all groups). After
+  // each broadcast, the CFs of this radio which are in that group read the
+  // params back, and the broadcast is repeated only while some of them don't
+  // report the new values yet (at most until param_verification_timeout).
+  // The frames of the CFs that missed the update are added to missed.
+  // CFs whose group mask is unknown might be in the group but can't be
+  // verified, i.e. the params are broadcast at least numRepeats times if
+  // there are any (as it is without any CF to verify).
+  // The slow thread of the group is paused meanwhile.
+  void updateParams(
+    uint8_t group,
+    const std::vector<std::string>& params,
+    size_t numRepeats,
+    int delayBetweenRepeatsMs,
+    std::vector<std::string>& missed)
+  {
+    std::unique_lock<std::mutex> lock = pauseSlow();
+
+    std::vector<paramUpdate> updates;
+    resolveParams(group, params, updates);
+    if (updates.empty()) {
+      return;
+    }
+
+    std::vector<CrazyflieROS*> pending;
+    bool unverifiable = false;
+    for (auto cf : m_cfs) {
+      if (group != 0 && !cf->groupMaskKnown()) {
+        unverifiable = true;
+      } else if (cf->inGroup(group) && m_paramVerificationTimeout > 0) {
+        pending.push_back(cf);
+      }
+    }
+
+    size_t round = 0;
+    auto start = std::chrono::steady_clock::now();
+    while (!pending.empty()) {
+      ++round;
+      broadcastParams(group, updates);
+
+      std::vector<std::future<bool> > handles;
+      for (auto cf : pending) {
+        handles.push_back(std::async(std::launch::async,
+          &CrazyflieROS::verifyParams, cf, std::cref(updates)));
+      }
+      std::vector<CrazyflieROS*> stillPending;
+      for (size_t i = 0; i < pending.size(); ++i) {
+        if (!handles[i].get()) {
+          stillPending.push_back(pending[i]);
+        }
+      }
+      pending.swap(stillPending);
+
+      std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+      if (pending.empty() || elapsed.count() > m_paramVerificationTimeout) {
+        ROS_INFO("Group %d: params broadcast %lu time(s) in %f s, %lu CF(s) missed them",
+          group, round, elapsed.count(), pending.size());
+        break;
+      }
+    }
+
+    for (auto cf : pending) {
+      missed.push_back(cf->frame());
+    }
+
+    if (round == 0 || unverifiable) {
+      for (; round < numRepeats; ++round) {
+        broadcastParams(group, updates);
+        std::this_thread::sleep_for(std::chrono::milliseconds(delayBetweenRepeatsMs));
+      }
+    }
+  }
+
+private:
+
   template<class T, class U>
-  void updateParam(uint8_t group, uint8_t id, Crazyflie::ParamType type, const std::string& ros_param) {
+  Crazyflie::ParamValue readParam(const std::string& ros_param) {
       U value;
       ros::param::get(ros_param, value);
-      m_cfbc.setParam<T>(group, id, type, (T)value);
+      T typedValue = (T)value;
+      Crazyflie::ParamValue result;
+      result.valueUint32 = 0;
+      memcpy(&result, &typedValue, sizeof(typedValue));
+      return result;
   }
 
-  void updateParams(
+  // Looks up the TOC entries and the current values (ROS parameters) of the
+  // given "group/name" params.
+  void resolveParams(
     uint8_t group,
-    const std::vector<std::string>& params)
+    const std::vector<std::string>& params,
+    std::vector<paramUpdate>& updates)
   {
+    auto& resolvedParams = m_resolvedParams[group];
     for (const auto& p : params) {
-      std::string ros_param = "/cfgroup" + std::to_string((int)group) + "/" + p;
-      size_t pos = p.find("/");
-      std::string g(p.begin(), p.begin() + pos);
-      std::string n(p.begin() + pos + 1, p.end());
-
-      // TODO: this assumes that all IDs are identically
-      //       should use byName lookup instead!
-      auto entry = m_cfs.front()->getParamTocEntry(g, n);
+      auto iter = resolvedParams.find(p);
+      if (iter == resolvedParams.end()) {
+        resolvedParam r;
+        r.rosParam = "/cfgroup" + std::to_string((int)group) + "/" + p;
+        // a broadcast addresses the param by id, i.e. all CFs have to agree
+        // on its id and type
+        r.entry = m_cfs.front()->getParamTocEntry(tocName(p));
+        for (auto cf : m_cfs) {
+          auto entry = cf->getParamTocEntry(tocName(p));
+          if (r.entry && (!entry || entry->id != r.entry->id || entry->type != r.entry->type)) {
+            ROS_ERROR("Param %s differs between the TOCs of %s and %s; it can't be broadcast",
+              p.c_str(), m_cfs.front()->frame().c_str(), cf->frame().c_str());
+            r.entry = nullptr;
+          }
+        }
+        iter = resolvedParams.insert(std::make_pair(p, r)).first;
+      }
+      const std::string& ros_param = iter->second.rosParam;
+      auto entry = iter->second.entry;
       if (entry)
       {
+        paramUpdate update;
+        update.entry = entry;
         switch (entry->type) {
           case Crazyflie::ParamTypeUint8:
-            updateParam<uint8_t, int>(group, entry->id, entry->type, ros_param);
+            update.value = readParam<uint8_t, int>(ros_param);
             break;
           case Crazyflie::ParamTypeInt8:
-            updateParam<int8_t, int>(group, entry->id, entry->type, ros_param);
+            update.value = readParam<int8_t, int>(ros_param);
             break;
           case Crazyflie::ParamTypeUint16:
-            updateParam<uint16_t, int>(group, entry->id, entry->type, ros_param);
+            update.value = readParam<uint16_t, int>(ros_param);
             break;
           case Crazyflie::ParamTypeInt16:
-            updateParam<int16_t, int>(group, entry->id, entry->type, ros_param);
+            update.value = readParam<int16_t, int>(ros_param);
             break;
           case Crazyflie::ParamTypeUint32:
-            updateParam<uint32_t, int>(group, entry->id, entry->type, ros_param);
+            update.value = readParam<uint32_t, int>(ros_param);
             break;
           case Crazyflie::ParamTypeInt32:
-            updateParam<int32_t, int>(group, entry->id, entry->type, ros_param);
+            update.value = readParam<int32_t, int>(ros_param);
             break;
           case Crazyflie::ParamTypeFloat:
-            updateParam<float, float>(group, entry->id, entry->type, ros_param);
+            update.value = readParam<float, float>(ros_param);
             break;
         }
+        updates.push_back(update);
       }
       else {
-        ROS_ERROR("Could not find param %s/%s", g.c_str(), n.c_str());
+        ROS_ERROR("Could not broadcast param %s", p.c_str());
       }
     }
   }
 
-private:
+  // next broadcaster of the pool (round robin)
+  CrazyflieBroadcaster& broadcaster()
+  {
+    return *m_cfbcs[m_nextBroadcaster++ % m_cfbcs.size()];
+  }
+
+  // Sorts the poses by the radio of their CF (the interactive object goes
+  // to the first one).
+  void stripePoses(
+    const poseBatch& states)
+  {
+    for (auto& stripe : m_poseStripes) {
+      stripe.clear();
+    }
+    for (size_t i = 0; i < states.size(); ++i) {
+      m_poseStripes[m_radioIndexById[states.id[i]]].push_back(
+        states.id[i],
+        states.x[i], states.y[i], states.z[i],
+        states.q0[i], states.q1[i], states.q2[i], states.q3[i]);
+    }
+  }
 
-  void publishRigidBody(const std::string& name, uint8_t id, std::vector<stateExternalBringup> &states)
+  void broadcastParams(
+    uint8_t group,
+    const std::vector<paramUpdate>& updates)
+  {
+    for (const auto& update : updates) {
+      broadcaster().setParam(group, update.entry->id, update.entry->type, update.value);
+    }
+  }
+
+  // CFs which might have received a broadcast to group start flying;
+  // this includes CFs whose group mask is unknown.
+  void commandedFlight(
+    uint8_t group)
+  {
+    for (auto cf : m_cfs) {
+      if (cf->inGroup(group) || !cf->groupMaskKnown()) {
+        cf->commandedFlight();
+      }
+    }
+  }
+
+  // Drops the poses of landed CFs which did not move (more than
+  // idle_pose_motion_threshold) since their last sent pose, unless that
+  // one is older than idle_pose_interval.
+  void dropIdlePoses(
+    poseBatch& states)
+  {
+    auto now = std::chrono::steady_clock::now();
+    size_t numKept = 0;
+    for (size_t i = 0; i < states.size(); ++i) {
+      idlePose& last = m_idlePoses[states.id[i]];
+      Eigen::Vector3f position(states.x[i], states.y[i], states.z[i]);
+      CrazyflieROS* cf = m_cfById[states.id[i]];
+      bool idle = cf
+        && cf->landed(now)
+        && last.valid
+        && (position - last.position).norm() < m_idlePoseMotionThreshold
+        && now - last.time < m_idlePoseInterval;
+      if (!idle) {
+        last.valid = true;
+        last.position = position;
+        last.time = now;
+        states.copy(i, numKept++);
+      }
+    }
+    states.resize(numKept);
+  }
+
+  void predictPositions(
+    const mocapFrame& frame,
+    poseBatch& states)
+  {
+    auto now = std::chrono::high_resolution_clock::now();
+    // time of the measurement
+    std::chrono::duration<double> t = frame.startIteration.time_since_epoch();
+    double measured = t.count() - frame.mocapLatency;
+    std::chrono::duration<double> processing = now - frame.startIteration;
+    double horizon = frame.mocapLatency + processing.count() + m_posePredictionOffset;
+
+    for (size_t i = 0; i < states.size(); ++i) {
+      Eigen::Vector3f position = m_posePredictor.predict(
+        states.id[i],
+        Eigen::Vector3f(states.x[i], states.y[i], states.z[i]),
+        measured,
+        horizon);
+      states.x[i] = position.x();
+      states.y[i] = position.y();
+      states.z[i] = position.z();
+    }
+  }
+
+  void publishRigidBody(
+    const mocapFrame& frame,
+    const std::string& name,
+    uint8_t id,
+    poseBatch &states)
   {
     bool found = false;
-    for (const auto& rigidBody : *m_pMocapObjects) {
+    for (const auto& rigidBody : frame.objects) {
       if (   rigidBody.name() == name
           && !rigidBody.occluded()) {
 
-        states.resize(states.size() + 1);
-        states.back().id = id;
-        states.back().x = rigidBody.position().x();
-        states.back().y = rigidBody.position().y();
-        states.back().z = rigidBody.position().z();
-        states.back().q0 = rigidBody.rotation().x();
-        states.back().q1 = rigidBody.rotation().y();
-        states.back().q2 = rigidBody.rotation().z();
-        states.back().q3 = rigidBody.rotation().w();
-
-        tf::Transform transform;
-        transform.setOrigin(tf::Vector3(
-          states.back().x,
-          states.back().y,
-          states.back().z));
-        tf::Quaternion q(
-          states.back().q0,
-          states.back().q1,
-          states.back().q2,
-          states.back().q3);
-        transform.setRotation(q);
-        m_br.sendTransform(tf::StampedTransform(transform, ros::Time::now(), "world", name));
+        states.push_back(id,
+          rigidBody.position().x(),
+          rigidBody.position().y(),
+          rigidBody.position().z(),
+          rigidBody.rotation().x(),
+          rigidBody.rotation().y(),
+          rigidBody.rotation().z(),
+          rigidBody.rotation().w());
+
+        m_posePublisher->add(name, rigidBody.position(), rigidBody.rotation());
         found = true;
         break;
       }
@@ -978,22 +1873,15 @@ private:
         sstr << std::setfill ('0') << std::setw(2) << std::hex << id;
         std::string idHex = sstr.str();
 
-        std::string uri = "radio://" + std::to_string(m_radio) + "/" + std::to_string(channel) + "/2M/E7E7E7E7" + idHex;
+        size_t radioIndex = cfConfigs.size() % m_radios.size();
+        m_radioIndexById[id] = radioIndex;
+        std::string uri = "radio://" + std::to_string(m_radios[radioIndex]) + "/" + std::to_string(channel) + "/2M/E7E7E7E7" + idHex;
         std::string tf_prefix = "cf" + std::to_string(id);
         std::string frame = "cf" + std::to_string(id);
         cfConfigs.push_back({uri, tf_prefix, frame, id});
       }
     }
 
-    // Turn all CFs on
-    for (const auto& config : cfConfigs) {
-      Crazyflie cf(config.uri);
-      cf.syson();
-      for (size_t i = 0; i < 50; ++i) {
-        cf.sendPing();
-      }
-    }
-
     ros::NodeHandle nl("~");
     bool enableLogging;
     bool enableParameters;
@@ -1003,19 +1891,84 @@ private:
     nl.getParam("enable_parameters", enableParameters);
     nl.getParam("force_no_cache", forceNoCache);
 
-    // add Crazyflies
-    for (const auto& config : cfConfigs) {
-      addCrazyflie(config.uri, config.tf_prefix, config.frame, "/world", enableParameters, enableLogging, config.idNumber, logBlocks, forceNoCache);
+    // Bring up all CFs of this group concurrently, one thread per CF. They
+    // all share our radio; since the radio is locked per (batch of) packets
+    // only, the threads take turns between the different addresses. The
+    // total time is therefore close to the slowest CF rather than the sum.
+    auto start = std::chrono::high_resolution_clock::now();
+    std::vector<CrazyflieROS*> cfs(cfConfigs.size(), nullptr);
+    std::map<std::string, std::vector<double> > phaseTimings;
+    std::mutex phaseTimingsMutex;
+    std::vector<std::exception_ptr> errors(cfConfigs.size());
+    std::vector<std::thread> threads;
+    for (size_t i = 0; i < cfConfigs.size(); ++i) {
+      threads.push_back(std::thread([&, i]() {
+        const CFConfig& config = cfConfigs[i];
+        try {
+          std::map<std::string, double> timings;
+
+          // Turn CF on
+          auto t0 = std::chrono::high_resolution_clock::now();
+          {
+            Crazyflie cf(config.uri);
+            cf.syson();
+            for (size_t j = 0; j < 50; ++j) {
+              cf.sendPing();
+            }
+          }
+          auto t1 = std::chrono::high_resolution_clock::now();
+          timings["syson"] = std::chrono::duration<double>(t1 - t0).count();
 
-      auto start = std::chrono::high_resolution_clock::now();
-      updateParams(m_cfs.back());
-      auto end = std::chrono::high_resolution_clock::now();
-      std::chrono::duration<double> elapsed = end - start;
-      ROS_INFO("Update params: %f s", elapsed.count());
+          cfs[i] = addCrazyflie(config.uri, config.tf_prefix, config.frame, "/world", enableParameters, enableLogging, config.idNumber, logBlocks, forceNoCache);
+
+          auto t2 = std::chrono::high_resolution_clock::now();
+          updateParams(cfs[i]);
+          auto t3 = std::chrono::high_resolution_clock::now();
+          timings["updateParams"] = std::chrono::duration<double>(t3 - t2).count();
+          timings["total"] = std::chrono::duration<double>(t3 - t0).count();
+
+          timings.insert(cfs[i]->startupTimings().begin(), cfs[i]->startupTimings().end());
+          std::unique_lock<std::mutex> lock(phaseTimingsMutex);
+          for (const auto& timing : timings) {
+            phaseTimings[timing.first].push_back(timing.second);
+          }
+        } catch (...) {
+          errors[i] = std::current_exception();
+        }
+      }));
+    }
+    for (auto& thread : threads) {
+      thread.join();
+    }
+
+    for (size_t i = 0; i < cfConfigs.size(); ++i) {
+      if (errors[i]) {
+        for (auto cf : cfs) {
+          delete cf;
+        }
+        ROS_ERROR("Startup of %s failed!", cfConfigs[i].uri.c_str());
+        std::rethrow_exception(errors[i]);
+      }
+    }
+
+    // keep the same order as objects
+    m_cfs = cfs;
+
+    auto end = std::chrono::high_resolution_clock::now();
+    std::chrono::duration<double> elapsed = end - start;
+    ROS_INFO("Startup of %lu CFs on %lu radio(s) starting at %d: %f s", cfConfigs.size(), m_radios.size(), m_radio, elapsed.count());
+    for (const auto& phase : phaseTimings) {
+      const std::vector<double>& t = phase.second;
+      double sum = std::accumulate(t.begin(), t.end(), 0.0);
+      ROS_INFO("  %s: min %f s, avg %f s, max %f s",
+        phase.first.c_str(),
+        *std::min_element(t.begin(), t.end()),
+        sum / t.size(),
+        *std::max_element(t.begin(), t.end()));
     }
   }
 
-  void addCrazyflie(
+  CrazyflieROS* addCrazyflie(
     const std::string& uri,
     const std::string& tf_prefix,
     const std::string& frame,
@@ -1028,7 +1981,7 @@ private:
   {
     ROS_INFO("Adding CF: %s (%s, %s)...", tf_prefix.c_str(), uri.c_str(), frame.c_str());
     auto start = std::chrono::high_resolution_clock::now();
-    CrazyflieROS* cf = new CrazyflieROS(
+    std::unique_ptr<CrazyflieROS> cf(new CrazyflieROS(
       uri,
       tf_prefix,
       frame,
@@ -1038,7 +1991,7 @@ private:
       id,
       logBlocks,
       m_slowQueue,
-      forceNoCache);
+      forceNoCache));
     auto end = std::chrono::high_resolution_clock::now();
     std::chrono::duration<double> elapsed = end - start;
     ROS_INFO("CF ctor: %f s", elapsed.count());
@@ -1046,7 +1999,7 @@ private:
     auto end2 = std::chrono::high_resolution_clock::now();
     std::chrono::duration<double> elapsed2 = end2 - end;
     ROS_INFO("CF run: %f s", elapsed2.count());
-    m_cfs.push_back(cf);
+    return cf.release();
   }
 
   void updateParams(
@@ -1091,20 +2044,60 @@ private:
 private:
   std::vector<CrazyflieROS*> m_cfs;
   std::string m_interactiveObject;
-  libobjecttracker::ObjectTracker* m_tracker;
+  ShardedObjectTracker* m_tracker;
+  // first radio of the pool
   int m_radio;
+  std::vector<int> m_radios;
+  int m_channel;
   // ViconDataStreamSDK::CPP::Client* m_pClient;
-  pcl::PointCloud<pcl::PointXYZ>::Ptr m_pMarkers;
-  std::vector<libmotioncapture::Object>* m_pMocapObjects;
   ros::CallbackQueue m_slowQueue;
-  CrazyflieBroadcaster m_cfbc;
-  bool m_isEmergency;
+  // held by the slow thread while it runs; see pauseSlow
+  std::mutex m_slowMutex;
+  std::atomic<int> m_numSlowPauses;
+  // only wakes up the slow thread
+  struct wakeUpCallback : public ros::CallbackInterface
+  {
+    virtual CallResult call()
+    {
+      return Success;
+    }
+  };
+  // one per radio of the pool
+  std::vector<std::unique_ptr<CrazyflieBroadcaster> > m_cfbcs;
+  std::atomic<size_t> m_nextBroadcaster;
+  // index (in m_radios) of the radio of each CF
+  std::vector<size_t> m_radioIndexById;
+  // poses of the current frame by radio index
+  std::vector<poseBatch> m_poseStripes;
+  FrameWorkerPool m_broadcastWorkers;
+  // frames broadcast; the snapshots of the previous linkStatistics call
+  std::atomic<uint64_t> m_numFrames;
+  uint64_t m_lastNumFrames;
+  uint64_t m_lastNumControlTransfers;
+  std::atomic<bool> m_isEmergency;
   bool m_useMotionCaptureObjectTracking;
-  tf::TransformBroadcaster m_br;
-  latency m_latency;
-  std::vector<std::unique_ptr<std::ofstream>> m_outputCSVs;
+  std::unique_ptr<PosePublisher> m_posePublisher;
+  LatencyHistogram m_latencyObjectTracking;
+  LatencyHistogram m_latencyBroadcasting;
   int m_phase;
-  std::chrono::high_resolution_clock::time_point m_phaseStart;
+  // broadcast update_params: group => "group/name" => resolved parameter
+  std::map<uint8_t, std::unordered_map<std::string, resolvedParam> > m_resolvedParams;
+  double m_paramVerificationTimeout;
+  PosePredictor m_posePredictor;
+  double m_posePredictionOffset;
+  // reduced pose rate of landed CFs
+  struct idlePose
+  {
+    bool valid;
+    Eigen::Vector3f position;
+    std::chrono::steady_clock::time_point time;
+  };
+  std::chrono::steady_clock::duration m_idlePoseInterval;
+  float m_idlePoseMotionThreshold;
+  std::vector<idlePose> m_idlePoses;
+  std::vector<CrazyflieROS*> m_cfById;
+  // poses of the current frame; reused for every frame
+  poseBatch m_poses;
 };
 
 // handles all Crazyflies
@@ -1125,11 +2118,23 @@ public:
     , m_lastInteractiveObjectPosition(-10, -10, 1)
     , m_broadcastingNumRepeats(15)
     , m_broadcastingDelayBetweenRepeatsMs(1)
+    , m_latencyMocap()
+    , m_latencyPointCloud()
+    , m_latencyGroups()
+    , m_latencyProcessing()
+    , m_latencyTotal()
+    , m_latencyStages()
+    , m_latencyStagesReady(false)
+    , m_latencyReportInterval(1.0)
+    , m_printLatency(false)
   {
     ros::NodeHandle nh;
     nh.setCallbackQueue(&m_queue);
 
-    m_serviceEmergency = nh.advertiseService("emergency", &CrazyflieServer::emergency, this);
+    // served by its own thread, i.e. never waits behind other service calls
+    ros::NodeHandle nhEmergency;
+    nhEmergency.setCallbackQueue(&m_emergencyQueue);
+    m_serviceEmergency = nhEmergency.advertiseService("emergency", &CrazyflieServer::emergency, this);
     m_serviceStartTrajectory = nh.advertiseService("start_trajectory", &CrazyflieServer::startTrajectory, this);
     m_serviceStartTrajectoryReversed = nh.advertiseService("start_trajectory_reversed", &CrazyflieServer::startTrajectoryReversed, this);
     m_serviceTakeoff = nh.advertiseService("takeoff", &CrazyflieServer::takeoff, this);
@@ -1140,8 +2145,13 @@ public:
 
     m_serviceNextPhase = nh.advertiseService("next_phase", &CrazyflieServer::nextPhase, this);
     m_serviceUpdateParams = nh.advertiseService("update_params", &CrazyflieServer::updateParams, this);
+    m_serviceUploadTrajectories = nh.advertiseService("upload_trajectories", &CrazyflieServer::uploadTrajectories, this);
 
-    m_pubPointCloud = nh.advertise<sensor_msgs::PointCloud>("pointCloud", 1);
+    m_pubPointCloud = nh.advertise<pcl::PointCloud<pcl::PointXYZ> >("pointCloud", 1);
+    m_pubLatencies = nh.advertise<crazyflie_driver::Latencies>("latencies", 1);
+    m_pubBroadcastRates = nh.advertise<crazyflie_driver::BroadcastRates>("broadcast_rates", 1);
+    // one message per group
+    m_pubLinkStatistics = nh.advertise<crazyflie_driver::LinkStatistics>("link_statistics", 10);
 
     m_subscribeVirtualInteractiveObject = nh.subscribe("virtual_interactive_object", 1, &CrazyflieServer::virtualInteractiveObjectCallback, this);
   }
@@ -1164,8 +2174,17 @@ public:
   void run()
   {
     std::thread tSlow(&CrazyflieServer::runSlow, this);
+    std::thread tEmergency(&CrazyflieServer::runEmergency, this);
     runFast();
     tSlow.join();
+    tEmergency.join();
+  }
+
+  void runEmergency()
+  {
+    while (ros::ok() && !m_isEmergency) {
+      m_emergencyQueue.callAvailable(ros::WallDuration(0.1));
+    }
   }
 
   void runFast()
@@ -1200,7 +2219,6 @@ public:
     bool useMotionCaptureObjectTracking;
     std::string logFilePath;
     std::string interactiveObject;
-    bool printLatency;
     bool writeCSVs;
     std::string motionCaptureType;
 
@@ -1211,13 +2229,29 @@ public:
     nl.getParam("broadcast_address", broadcastAddress);
     nl.param<std::string>("save_point_clouds", logFilePath, "");
     nl.param<std::string>("interactive_object", interactiveObject, "");
-    nl.getParam("print_latency", printLatency);
+    nl.param("print_latency", m_printLatency, false);
     nl.getParam("write_csvs", writeCSVs);
     nl.param<std::string>("motion_capture_type", motionCaptureType, "vicon");
 
     nl.param<int>("broadcasting_num_repeats", m_broadcastingNumRepeats, 15);
     nl.param<int>("broadcasting_delay_between_repeats_ms", m_broadcastingDelayBetweenRepeatsMs, 1);
 
+    // latency statistics are published on "latencies" every latency_report_interval s (0: disabled)
+    nl.param<double>("latency_report_interval", m_latencyReportInterval, 1.0);
+    // warn if the processing of a frame / the mocap latency exceeds the threshold (0: disabled)
+    double latencyWarningThreshold;
+    double mocapLatencyWarningThreshold;
+    nl.param<double>("latency_warning_threshold", latencyWarningThreshold, 0.009);
+    nl.param<double>("mocap_latency_warning_threshold", mocapLatencyWarningThreshold, 0.035);
+
+    // optional: core to pin the fast (mocap) worker of each group to
+    std::vector<int> fastWorkerCpus;
+    nl.param("fast_worker_cpus", fastWorkerCpus, std::vector<int>());
+
+    // directory of the (shared) log/param TOC cache
+    std::string tocCacheDir;
+    nl.param<std::string>("toc_cache_dir", tocCacheDir, "");
+
     // tilde-expansion
     wordexp_t wordexp_result;
     if (wordexp(logFilePath.c_str(), &wordexp_result, 0) == 0) {
@@ -1225,6 +2259,11 @@ public:
       logFilePath = wordexp_result.we_wordv[0];
     }
     wordfree(&wordexp_result);
+    if (!tocCacheDir.empty() && wordexp(tocCacheDir.c_str(), &wordexp_result, 0) == 0) {
+      tocCacheDir = wordexp_result.we_wordv[0];
+      wordfree(&wordexp_result);
+    }
+    Crazyflie::setTocCacheDirectory(tocCacheDir);
 
     libobjecttracker::PointCloudLogger pointCloudLogger(logFilePath);
     const bool logClouds = !logFilePath.empty();
@@ -1294,26 +2333,34 @@ public:
       throw std::runtime_error("Unknown motion capture type!");
     }
 
-    pcl::PointCloud<pcl::PointXYZ>::Ptr markers(new pcl::PointCloud<pcl::PointXYZ>);
-    std::vector<libmotioncapture::Object> mocapObjects;
+    // frame processed by the groups; only changed while they are idle
+    std::shared_ptr<const mocapFrame> currentFrame;
+    std::vector<std::shared_ptr<mocapFrame> > framePool;
 
     // Create all groups in parallel and launch threads
     {
       std::vector<std::future<CrazyflieGroup*> > handles;
+      // Each channel gets radios_per_channel consecutive radios; more radios
+      // allow more CFs per channel.
+      int radiosPerChannel;
+      nl.param("radios_per_channel", radiosPerChannel, 1);
+      radiosPerChannel = std::max(radiosPerChannel, 1);
       int r = 0;
       std::cout << "ch: " << channels.size() << std::endl;
       for (int channel : channels) {
+        std::vector<int> radios;
+        for (int i = 0; i < radiosPerChannel; ++i) {
+          radios.push_back(r++);
+        }
         auto handle = std::async(std::launch::async,
-            [&](int channel, int radio)
+            [&](int channel, std::vector<int> radios)
             {
               // std::cout << "radio: " << radio << std::endl;
               return new CrazyflieGroup(
                 dynamicsConfigurations,
                 markerConfigurations,
                 // &client,
-                markers,
-                &mocapObjects,
-                radio,
+                radios,
                 channel,
                 broadcastAddress,
                 useMotionCaptureObjectTracking,
@@ -1322,10 +2369,9 @@ public:
                 writeCSVs);
             },
             channel,
-            r
+            radios
           );
         handles.push_back(std::move(handle));
-        ++r;
       }
 
       for (auto& handle : handles) {
@@ -1339,7 +2385,32 @@ public:
       threads.push_back(std::thread(&CrazyflieGroup::runSlow, group));
     }
 
-    ROS_INFO("Started %lu threads", threads.size());
+    // one long-lived fast worker per group, woken up for each mocap frame
+    FrameWorkerPool fastWorkers;
+    {
+      std::vector<std::function<void()> > jobs;
+      for (auto group : m_groups) {
+        jobs.push_back([group, &currentFrame] { group->runFast(*currentFrame); });
+      }
+      if (!fastWorkers.start(jobs, fastWorkerCpus)) {
+        ROS_WARN("Could not pin all fast workers to fast_worker_cpus");
+      }
+    }
+
+    ROS_INFO("Started %lu threads", threads.size() + m_groups.size());
+
+    // the groups are complete now; the slow thread may start reporting
+    m_latencyStages.push_back({"mocap", &m_latencyMocap});
+    m_latencyStages.push_back({"pointCloud", &m_latencyPointCloud});
+    for (auto group : m_groups) {
+      std::string name = "group" + std::to_string(group->radio());
+      m_latencyStages.push_back({name + "/objectTracking", &group->objectTrackingLatency()});
+      m_latencyStages.push_back({name + "/broadcasting", &group->broadcastingLatency()});
+    }
+    m_latencyStages.push_back({"groups", &m_latencyGroups});
+    m_latencyStages.push_back({"processing", &m_latencyProcessing});
+    m_latencyStages.push_back({"total", &m_latencyTotal});
+    m_latencyStagesReady = true;
 
     // Connect to a server
     // ROS_INFO("Connecting to %s ...", hostName.c_str());
@@ -1352,56 +2423,63 @@ public:
     //   ros::spinOnce();
     // }
 
-    // setup messages
-    sensor_msgs::PointCloud msgPointCloud;
-    msgPointCloud.header.seq = 0;
-    msgPointCloud.header.frame_id = "world";
+    uint32_t pointCloudSeq = 0;
 
-    auto startTime = std::chrono::high_resolution_clock::now();
+    std::vector<libmotioncapture::LatencyInfo> mocapLatency;
 
-    struct latencyEntry {
-      std::string name;
-      double secs;
-    };
-    std::vector<latencyEntry> latencies;
+    // Called once the groups finished processing a frame
+    auto frameDone = [&](
+      const mocapFrame& frame,
+      std::chrono::high_resolution_clock::time_point endRunGroups,
+      std::chrono::high_resolution_clock::time_point startRunGroups)
+    {
+      std::chrono::duration<double> elapsedRunGroups = endRunGroups - startRunGroups;
+      m_latencyGroups.add(elapsedRunGroups.count());
 
-    std::vector<double> latencyTotal(6 + 3 * 2, 0.0);
-    uint32_t latencyCount = 0;
-    std::vector<libmotioncapture::LatencyInfo> mocapLatency;
+      std::chrono::duration<double> elapsed = endRunGroups - frame.startIteration;
+      double elapsedSeconds = elapsed.count();
+      m_latencyProcessing.add(elapsedSeconds);
+      m_latencyTotal.add(frame.mocapLatency + elapsedSeconds);
+      if (latencyWarningThreshold > 0 && elapsedSeconds > latencyWarningThreshold) {
+        ROS_WARN_THROTTLE(1.0, "Latency too high! Is %f s.", elapsedSeconds);
+      }
+    };
+    std::chrono::high_resolution_clock::time_point startRunGroups;
 
     while (ros::ok() && !m_isEmergency) {
-      // Get a frame
+      // Get a frame (while the groups may still process the previous one)
       mocap->waitForNextFrame();
 
-      latencies.clear();
-
       auto startIteration = std::chrono::high_resolution_clock::now();
-      double totalLatency = 0;
+
+      std::shared_ptr<mocapFrame> frame;
+      for (const auto& f : framePool) {
+        if (f.use_count() == 1 && f->markers.use_count() == 1) {
+          frame = f;
+          break;
+        }
+      }
+      if (!frame) {
+        frame.reset(new mocapFrame);
+        framePool.push_back(frame);
+      }
+      frame->startIteration = startIteration;
 
       // Get the latency
       mocap->getLatency(mocapLatency);
-      float viconLatency = 0;
+      double viconLatency = 0;
       for (const auto& item : mocapLatency) {
         viconLatency += item.value();
       }
-      if (viconLatency > 0.035) {
+      m_latencyMocap.add(viconLatency);
+      frame->mocapLatency = viconLatency;
+      if (mocapLatencyWarningThreshold > 0 && viconLatency > mocapLatencyWarningThreshold) {
         std::stringstream sstr;
         sstr << "VICON Latency high: " << viconLatency << " s." << std::endl;
         for (const auto& item : mocapLatency) {
           sstr << "  Latency: " << item.name() << ": " << item.value() << " s." << std::endl;
         }
-        ROS_WARN("%s", sstr.str().c_str());
-      }
-
-      if (printLatency) {
-        size_t i = 0;
-        for (const auto& item : mocapLatency) {
-          latencies.push_back({item.name(), item.value()});
-          latencyTotal[i] += item.value();
-          totalLatency += item.value();
-          latencyTotal.back() += item.value();
-        }
-        ++i;
+        ROS_WARN_THROTTLE(1.0, "%s", sstr.str().c_str());
       }
 
       // size_t latencyCount = client.GetLatencySampleCount().Count;
@@ -1414,31 +2492,30 @@ public:
 
       // Get the unlabeled markers and create point cloud
       if (!useMotionCaptureObjectTracking) {
+        auto startPointCloud = std::chrono::high_resolution_clock::now();
+        pcl::PointCloud<pcl::PointXYZ>::Ptr& markers = frame->markers;
         mocap->getPointCloud(markers);
 
-        msgPointCloud.header.seq += 1;
-        msgPointCloud.header.stamp = ros::Time::now();
-        msgPointCloud.points.resize(markers->size());
-        for (size_t i = 0; i < markers->size(); ++i) {
-          const pcl::PointXYZ& point = markers->at(i);
-          msgPointCloud.points[i].x = point.x;
-          msgPointCloud.points[i].y = point.y;
-          msgPointCloud.points[i].z = point.z;
-        }
-        m_pubPointCloud.publish(msgPointCloud);
+        // published from the frame buffer (serialized by pcl_ros)
+        markers->header.seq = ++pointCloudSeq;
+        markers->header.stamp = pcl_conversions::toPCL(ros::Time::now());
+        markers->header.frame_id = "world";
+        m_pubPointCloud.publish(pcl::PointCloud<pcl::PointXYZ>::ConstPtr(markers));
 
         if (logClouds) {
           pointCloudLogger.log(markers);
         }
-      } 
+        std::chrono::duration<double> elapsedPointCloud = std::chrono::high_resolution_clock::now() - startPointCloud;
+        m_latencyPointCloud.add(elapsedPointCloud.count());
+      }
 
       if (useMotionCaptureObjectTracking || !interactiveObject.empty()) {
         // get mocap rigid bodies
-        mocapObjects.clear();
-        mocap->getObjects(mocapObjects);
+        frame->objects.clear();
+        mocap->getObjects(frame->objects);
         if (interactiveObject == "virtual") {
           Eigen::Quaternionf quat(0, 0, 0, 1);
-          mocapObjects.push_back(
+          frame->objects.push_back(
             libmotioncapture::Object(
               interactiveObject,
               m_lastInteractiveObjectPosition,
@@ -1446,67 +2523,29 @@ public:
         }
       }
 
-      auto startRunGroups = std::chrono::high_resolution_clock::now();
-      std::vector<std::future<void> > handles;
-      for (auto group : m_groups) {
-        auto handle = std::async(std::launch::async, &CrazyflieGroup::runFast, group);
-        handles.push_back(std::move(handle));
-      }
-
-      for (auto& handle : handles) {
-        handle.wait();
-      }
-      auto endRunGroups = std::chrono::high_resolution_clock::now();
-      if (printLatency) {
-        std::chrono::duration<double> elapsedRunGroups = endRunGroups - startRunGroups;
-        latencies.push_back({"Run All Groups", elapsedRunGroups.count()});
-        latencyTotal[4] += elapsedRunGroups.count();
-        totalLatency += elapsedRunGroups.count();
-        latencyTotal.back() += elapsedRunGroups.count();
-        int groupId = 0;
-        for (auto group : m_groups) {
-          auto latency = group->lastLatency();
-          int radio = group->radio();
-          latencies.push_back({"Group " + std::to_string(radio) + " objectTracking", latency.objectTracking});
-          latencies.push_back({"Group " + std::to_string(radio) + " broadcasting", latency.broadcasting});
-          latencyTotal[5 + 2*groupId] += latency.objectTracking;
-          latencyTotal[6 + 2*groupId] += latency.broadcasting;
-          ++groupId;
-        }
-      }
-
-      auto endIteration = std::chrono::high_resolution_clock::now();
-      std::chrono::duration<double> elapsed = endIteration - startIteration;
-      double elapsedSeconds = elapsed.count();
-      if (elapsedSeconds > 0.009) {
-        ROS_WARN("Latency too high! Is %f s.", elapsedSeconds);
-      }
-
-      if (printLatency) {
-        ++latencyCount;
-        std::cout << "Latencies" << std::endl;
-        for (auto& latency : latencies) {
-          std::cout << latency.name << ": " << latency.secs * 1000 << " ms" << std::endl;
-        }
-        std::cout << "Total " << totalLatency * 1000 << " ms" << std::endl;
-        // // if (latencyCount % 100 == 0) {
-          std::cout << "Avg " << latencyCount << std::endl;
-          for (size_t i = 0; i < latencyTotal.size(); ++i) {
-            std::cout << latencyTotal[i] / latencyCount * 1000.0 << ",";
-          }
-          std::cout << std::endl;
-        // // }
+      // hand the frame over once the groups are done with the previous one
+      if (currentFrame) {
+        frameDone(*currentFrame, fastWorkers.wait(), startRunGroups);
       }
+      currentFrame = frame;
+      startRunGroups = std::chrono::high_resolution_clock::now();
+      fastWorkers.runAsync();
 
       // ROS_INFO("Latency: %f s", elapsedSeconds.count());
 
       // m_fastQueue.callAvailable(ros::WallDuration(0));
     }
 
+    if (currentFrame) {
+      frameDone(*currentFrame, fastWorkers.wait(), startRunGroups);
+    }
+
     if (logClouds) {
       pointCloudLogger.flush();
     }
 
+    fastWorkers.stop();
+
     // wait for other threads
     for (auto& thread : threads) {
       thread.join();
@@ -1515,9 +2554,90 @@ public:
 
   void runSlow()
   {
+    auto lastReport = std::chrono::steady_clock::now();
     while(ros::ok() && !m_isEmergency) {
-      m_queue.callAvailable(ros::WallDuration(0));
-      std::this_thread::sleep_for(std::chrono::milliseconds(10));
+      // handle service calls (e.g. emergency) as they arrive; wake up for
+      // the next report (at most after 100 ms, to notice the shutdown)
+      double timeout = 0.1;
+      if (m_latencyStagesReady && m_latencyReportInterval > 0) {
+        std::chrono::duration<double> sinceReport = std::chrono::steady_clock::now() - lastReport;
+        timeout = std::min(timeout, m_latencyReportInterval - sinceReport.count());
+      }
+      m_queue.callAvailable(ros::WallDuration(std::max(timeout, 0.0)));
+
+      auto now = std::chrono::steady_clock::now();
+      std::chrono::duration<double> sinceReport = now - lastReport;
+      if (m_latencyStagesReady
+          && m_latencyReportInterval > 0
+          && sinceReport.count() >= m_latencyReportInterval) {
+        reportLatencies(sinceReport.count());
+        reportBroadcastRates();
+        reportLinkStatistics(sinceReport.count());
+        lastReport = now;
+      }
+    }
+  }
+
+  // Publishes the achieved pose update rate of each vehicle since the last call
+  void reportBroadcastRates()
+  {
+    crazyflie_driver::BroadcastRates msg;
+    msg.header.stamp = ros::Time::now();
+    std::vector<CrazyflieBroadcaster::PositionUpdateRate> rates;
+    for (auto group : m_groups) {
+      group->positionUpdateRates(rates);
+      for (const auto& rate : rates) {
+        msg.ids.push_back(rate.id);
+        msg.requested.push_back(rate.requested);
+        msg.sent.push_back(rate.sent);
+        if (m_printLatency && rate.sent < rate.requested) {
+          ROS_INFO("CF %d: %.1f of %.1f poses/s sent", rate.id, rate.sent, rate.requested);
+        }
+      }
+    }
+    m_pubBroadcastRates.publish(msg);
+  }
+
+  // Publishes the link statistics of each group over the last window
+  void reportLinkStatistics(double window)
+  {
+    for (auto group : m_groups) {
+      crazyflie_driver::LinkStatistics msg;
+      msg.header.stamp = ros::Time::now();
+      msg.window = window;
+      group->linkStatistics(msg);
+      m_pubLinkStatistics.publish(msg);
+      if (m_printLatency && msg.frames > 0) {
+        ROS_INFO("Channel %d: %.1f control transfers per frame", msg.channel, msg.control_transfers_per_frame);
+      }
+    }
+  }
+
+  // Publishes (and optionally prints) the latency statistics of the last window
+  void reportLatencies(double window)
+  {
+    crazyflie_driver::Latencies msg;
+    msg.header.stamp = ros::Time::now();
+    msg.window = window;
+    msg.stages.resize(m_latencyStages.size());
+    std::stringstream sstr;
+    for (size_t i = 0; i < m_latencyStages.size(); ++i) {
+      LatencyHistogram::summary summary = m_latencyStages[i].histogram->collect();
+      crazyflie_driver::LatencyStage& stage = msg.stages[i];
+      stage.name = m_latencyStages[i].name;
+      stage.count = summary.count;
+      stage.p50 = summary.p50;
+      stage.p99 = summary.p99;
+      stage.max = summary.max;
+      if (m_printLatency && summary.count > 0) {
+        sstr << std::endl << "  " << stage.name << ": p50 " << stage.p50 * 1000
+             << " ms, p99 " << stage.p99 * 1000 << " ms, max " << stage.max * 1000
+             << " ms (" << stage.count << " samples)";
+      }
+    }
+    m_pubLatencies.publish(msg);
+    if (m_printLatency) {
+      ROS_INFO("Latencies over the last %.1f s:%s", window, sstr.str().c_str());
     }
   }
 
@@ -1527,11 +2647,21 @@ private:
     std_srvs::Empty::Request& req,
     std_srvs::Empty::Response& res)
   {
+    auto start = std::chrono::high_resolution_clock::now();
     ROS_FATAL("Emergency requested!");
-    for (auto& group : m_groups) {
-      group->emergency();
-    }
     m_isEmergency = true;
+    // stop waiting for TOCs, param updates, trajectory uploads, ...
+    Crazyflie::abortRequests();
+    // groups on different radios stop in parallel
+    std::vector<std::thread> threads;
+    for (auto group : m_groups) {
+      threads.push_back(std::thread(&CrazyflieGroup::emergency, group, m_broadcastingNumRepeats));
+    }
+    for (auto& thread : threads) {
+      thread.join();
+    }
+    std::chrono::duration<double> elapsed = std::chrono::high_resolution_clock::now() - start;
+    ROS_FATAL("Emergency stop sent to %lu groups in %f ms", m_groups.size(), elapsed.count() * 1000);
 
     return true;
   }
@@ -1665,68 +2795,97 @@ private:
     crazyflie_driver::UpdateParams::Response& res)
   {
     ROS_INFO("UpdateParams!");
+    auto start = std::chrono::steady_clock::now();
+
+    // all groups (radios) in parallel
+    std::vector<std::vector<std::string> > missed(m_groups.size());
+    std::vector<std::future<void> > handles;
+    for (size_t i = 0; i < m_groups.size(); ++i) {
+      CrazyflieGroup* group = m_groups[i];
+      std::vector<std::string>* groupMissed = &missed[i];
+      handles.push_back(std::async(std::launch::async, [&, group, groupMissed] {
+        group->updateParams(req.group, req.params, m_broadcastingNumRepeats,
+          m_broadcastingDelayBetweenRepeatsMs, *groupMissed);
+      }));
+    }
+    for (auto& handle : handles) {
+      handle.get();
+    }
 
-    for (size_t i = 0; i < m_broadcastingNumRepeats; ++i) {
-      for (auto& group : m_groups) {
-        group->updateParams(req.group, req.params);
+    for (const auto& frames : missed) {
+      for (const auto& frame : frames) {
+        ROS_WARN("%s did not confirm the param update", frame.c_str());
+        res.missed.push_back(frame);
       }
-      std::this_thread::sleep_for(std::chrono::milliseconds(m_broadcastingDelayBetweenRepeatsMs));
     }
 
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+    ROS_INFO("Updated %lu params in %f s (%lu CF(s) missed them)",
+      req.params.size(), elapsed.count(), res.missed.size());
+
     return true;
   }
 
-//
-  void readMarkerConfigurations(
-    std::vector<libobjecttracker::MarkerConfiguration>& markerConfigurations)
+  bool uploadTrajectories(
+    crazyflie_driver::UploadTrajectories::Request& req,
+    crazyflie_driver::UploadTrajectories::Response& res)
   {
-    markerConfigurations.clear();
-    ros::NodeHandle nl("~");
-    int numConfigurations;
-    nl.getParam("numMarkerConfigurations", numConfigurations);
-    for (int i = 0; i < numConfigurations; ++i) {
-      markerConfigurations.push_back(pcl::PointCloud<pcl::PointXYZ>::Ptr(new pcl::PointCloud<pcl::PointXYZ>));
-      std::stringstream sstr;
-      sstr << "markerConfigurations/" << i << "/numPoints";
-      int numPoints;
-      nl.getParam(sstr.str(), numPoints);
-
-      std::vector<double> offset;
-      std::stringstream sstr2;
-      sstr2 << "markerConfigurations/" << i << "/offset";
-      nl.getParam(sstr2.str(), offset);
-      for (int j = 0; j < numPoints; ++j) {
-        std::stringstream sstr3;
-        sstr3 << "markerConfigurations/" << i << "/points/" << j;
-        std::vector<double> points;
-        nl.getParam(sstr3.str(), points);
-        markerConfigurations.back()->push_back(pcl::PointXYZ(points[0] + offset[0], points[1] + offset[1], points[2] + offset[2]));
+    ROS_INFO("Upload trajectories!");
+    auto start = std::chrono::steady_clock::now();
+
+    std::map<std::string, std::vector<Crazyflie::TrajectoryPiece> > trajectories;
+    for (const auto& trajectory : req.trajectories) {
+      auto& pieces = trajectories[trajectory.frame];
+      pieces.resize(trajectory.polygons.size());
+      for (size_t i = 0; i < pieces.size(); ++i) {
+        toTrajectoryPiece(trajectory.polygons[i], pieces[i]);
       }
     }
-  }
 
-  void readDynamicsConfigurations(
-    std::vector<libobjecttracker::DynamicsConfiguration>& dynamicsConfigurations)
-  {
-    ros::NodeHandle nl("~");
-    int numConfigurations;
-    nl.getParam("numDynamicsConfigurations", numConfigurations);
-    dynamicsConfigurations.resize(numConfigurations);
-    for (int i = 0; i < numConfigurations; ++i) {
-      std::stringstream sstr;
-      sstr << "dynamicsConfigurations/" << i;
-      nl.getParam(sstr.str() + "/maxXVelocity", dynamicsConfigurations[i].maxXVelocity);
-      nl.getParam(sstr.str() + "/maxYVelocity", dynamicsConfigurations[i].maxYVelocity);
-      nl.getParam(sstr.str() + "/maxZVelocity", dynamicsConfigurations[i].maxZVelocity);
-      nl.getParam(sstr.str() + "/maxPitchRate", dynamicsConfigurations[i].maxPitchRate);
-      nl.getParam(sstr.str() + "/maxRollRate", dynamicsConfigurations[i].maxRollRate);
-      nl.getParam(sstr.str() + "/maxYawRate", dynamicsConfigurations[i].maxYawRate);
-      nl.getParam(sstr.str() + "/maxRoll", dynamicsConfigurations[i].maxRoll);
-      nl.getParam(sstr.str() + "/maxPitch", dynamicsConfigurations[i].maxPitch);
-      nl.getParam(sstr.str() + "/maxFitnessScore", dynamicsConfigurations[i].maxFitnessScore);
+    // all groups (radios) in parallel
+    std::vector<std::map<std::string, bool> > results(m_groups.size());
+    std::vector<size_t> numSharedPackets(m_groups.size(), 0);
+    std::vector<std::future<void> > handles;
+    for (size_t i = 0; i < m_groups.size(); ++i) {
+      handles.push_back(std::async(std::launch::async,
+        &CrazyflieGroup::uploadTrajectories, m_groups[i],
+        std::cref(trajectories), (bool)req.deduplicate, (size_t)m_broadcastingNumRepeats,
+        std::ref(results[i]), std::ref(numSharedPackets[i])));
     }
+    for (auto& handle : handles) {
+      handle.get();
+    }
+    res.num_broadcast_packets = std::accumulate(numSharedPackets.begin(), numSharedPackets.end(), 0);
+
+    size_t numFailed = 0;
+    for (const auto& trajectory : req.trajectories) {
+      bool success = false;
+      bool unconfirmed = false;
+      for (size_t i = 0; i < results.size(); ++i) {
+        auto iter = results[i].find(trajectory.frame);
+        if (iter != results[i].end()) {
+          success = iter->second;
+          unconfirmed = numSharedPackets[i] > 0;
+        }
+      }
+      if (!success) {
+        ROS_WARN("Could not upload trajectory to %s", trajectory.frame.c_str());
+        ++numFailed;
+      }
+      res.frames.push_back(trajectory.frame);
+      res.success.push_back(success);
+      res.unconfirmed_broadcasts.push_back(unconfirmed);
+    }
+
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+    res.duration = elapsed.count();
+    ROS_INFO("Uploaded %lu trajectories (%lu failed, %u packets broadcast) in %f s",
+      req.trajectories.size(), numFailed, res.num_broadcast_packets, res.duration);
+
+    return true;
   }
 
+//
   void readChannels(
     std::set<int>& channels)
   {
@@ -1748,7 +2907,7 @@ private:
 
 private:
   std::string m_worldFrame;
-  bool m_isEmergency;
+  std::atomic<bool> m_isEmergency;
   ros::ServiceServer m_serviceEmergency;
   ros::ServiceServer m_serviceStartTrajectory;
   ros::ServiceServer m_serviceStartTrajectoryReversed;
@@ -1759,8 +2918,12 @@ private:
   ros::ServiceServer m_serviceStartCannedTrajectory;
   ros::ServiceServer m_serviceNextPhase;
   ros::ServiceServer m_serviceUpdateParams;
+  ros::ServiceServer m_serviceUploadTrajectories;
 
   ros::Publisher m_pubPointCloud;
+  ros::Publisher m_pubLatencies;
+  ros::Publisher m_pubBroadcastRates;
+  ros::Publisher m_pubLinkStatistics;
   // tf::TransformBroadcaster m_br;
 
   std::vector<CrazyflieGroup*> m_groups;
@@ -1771,14 +2934,33 @@ private:
   int m_broadcastingNumRepeats;
   int m_broadcastingDelayBetweenRepeatsMs;
 
+  struct latencyStage
+  {
+    std::string name;
+    LatencyHistogram* histogram;
+  };
+  // written by the fast thread ...
+  LatencyHistogram m_latencyMocap;
+  LatencyHistogram m_latencyPointCloud;
+  LatencyHistogram m_latencyGroups;
+  LatencyHistogram m_latencyProcessing;
+  LatencyHistogram m_latencyTotal;
+  // ... and collected by the slow thread, once m_latencyStagesReady is set
+  std::vector<latencyStage> m_latencyStages;
+  std::atomic<bool> m_latencyStagesReady;
+  double m_latencyReportInterval;
+  bool m_printLatency;
+
 private:
-  // We have two callback queues
-  // 1. Fast queue handles pose and emergency callbacks. Those are high-priority and can be served quickly
+  // We have three callback queues
+  // 1. Fast queue handles pose callbacks. Those are high-priority and can be served quickly
   // 2. Slow queue handles all other requests.
+  // 3. Emergency queue handles the emergency service only, so that it never waits behind another request.
   // Each queue is handled in its own thread. We don't want a thread per CF to make sure that the fast queue
   //  gets called frequently enough.
 
   ros::CallbackQueue m_queue;
+  ros::CallbackQueue m_emergencyQueue;
   // ros::CallbackQueue m_slowQueue;
 };
 
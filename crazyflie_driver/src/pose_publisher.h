@@ -0,0 +1,273 @@
+#pragma once
+
+#include "ros/ros.h"
+#include <tf/transform_broadcaster.h>
+
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <fstream>
+#include <memory>
+#include <string>
+#include <vector>
+#include <chrono>
+#include <Eigen/Geometry>
+
+// Publishes the poses of a group (tf, and optionally one CSV file per CF) on
+// its own thread, so that neither adds to the latency of the pose broadcast.
+// The fast path adds the poses of a frame and hands them over with publish(),
+// which only swaps buffers. The thread sends all transforms of the latest
+// frame in one sendTransform call with a single stamp, at most rate times
+// per second (0: every frame); frames in between are skipped. Every frame is
+// written to the CSV files, though.
+class PosePublisher
+{
+public:
+  typedef std::chrono::high_resolution_clock clock;
+
+  PosePublisher(
+    double rate,
+    size_t numCSVs)
+    : m_br()
+    , m_period(std::chrono::duration_cast<clock::duration>(
+        std::chrono::duration<double>(rate > 0 ? 1.0 / rate : 0.0)))
+    , m_writing()
+    , m_pending()
+    , m_publishing()
+    , m_hasPending(false)
+    , m_csvWriting()
+    , m_csvPending()
+    , m_csvRows()
+    , m_transforms()
+    , m_mutex()
+    , m_condition()
+    , m_csvMutex()
+    , m_csvs()
+    , m_phaseStart(clock::now())
+    , m_stop(false)
+    , m_thread()
+  {
+    for (size_t i = 0; i < numCSVs; ++i) {
+      m_csvs.push_back(std::unique_ptr<std::ofstream>(new std::ofstream));
+    }
+    m_thread = std::thread(&PosePublisher::run, this);
+  }
+
+  ~PosePublisher()
+  {
+    {
+      std::unique_lock<std::mutex> lock(m_mutex);
+      m_stop = true;
+    }
+    m_condition.notify_one();
+    m_thread.join();
+  }
+
+  // Called by the fast path for each pose of the current frame.
+  // csv is the index of the CSV file (-1: none).
+  void add(
+    const std::string& frameId,
+    const Eigen::Vector3f& position,
+    const Eigen::Quaternionf& rotation,
+    int csv = -1)
+  {
+    // reuse the strings of earlier frames
+    if (m_writing.numPoses == m_writing.poses.size()) {
+      m_writing.poses.resize(m_writing.numPoses + 1);
+    }
+    pose& p = m_writing.poses[m_writing.numPoses++];
+    p.frameId.assign(frameId);
+    setPose(p.pose, position, rotation);
+
+    if (csv >= 0 && csv < static_cast<int>(m_csvs.size())) {
+      m_csvWriting.resize(m_csvWriting.size() + 1);
+      m_csvWriting.back().csv = csv;
+      setPose(m_csvWriting.back().pose, position, rotation);
+    }
+  }
+
+  // Hands the poses added since the last call over to the publisher thread.
+  // stamp is the time of the frame.
+  void publish(
+    clock::time_point stamp)
+  {
+    for (auto& row : m_csvWriting) {
+      row.stamp = stamp;
+    }
+    m_writing.stamp = stamp;
+    {
+      std::unique_lock<std::mutex> lock(m_mutex);
+      std::swap(m_writing, m_pending);
+      m_hasPending = true;
+      m_csvPending.insert(m_csvPending.end(), m_csvWriting.begin(), m_csvWriting.end());
+    }
+    m_condition.notify_one();
+    m_writing.numPoses = 0;
+    m_csvWriting.clear();
+  }
+
+  // Closes the current CSV files and starts the given ones (one per CF, with
+  // a header line); t restarts at 0. Can be called from any thread.
+  void openCSVs(
+    const std::vector<std::string>& fileNames)
+  {
+    std::unique_lock<std::mutex> lock(m_csvMutex);
+    for (size_t i = 0; i < m_csvs.size() && i < fileNames.size(); ++i) {
+      auto& file = *m_csvs[i];
+      file.close();
+      file.open(fileNames[i]);
+      file << "t,x,y,z,roll,pitch,yaw\n";
+    }
+    m_phaseStart = clock::now();
+  }
+
+private:
+  struct poseValue
+  {
+    float x;
+    float y;
+    float z;
+    float qx;
+    float qy;
+    float qz;
+    float qw;
+  };
+
+  struct pose
+  {
+    std::string frameId;
+    poseValue pose;
+  };
+
+  struct frame
+  {
+    frame()
+      : poses()
+      , numPoses(0)
+      , stamp()
+    {
+    }
+
+    // the first numPoses are valid
+    std::vector<pose> poses;
+    size_t numPoses;
+    clock::time_point stamp;
+  };
+
+  struct csvRow
+  {
+    int csv;
+    poseValue pose;
+    clock::time_point stamp;
+  };
+
+  static void setPose(
+    poseValue& value,
+    const Eigen::Vector3f& position,
+    const Eigen::Quaternionf& rotation)
+  {
+    value.x = position.x();
+    value.y = position.y();
+    value.z = position.z();
+    value.qx = rotation.x();
+    value.qy = rotation.y();
+    value.qz = rotation.z();
+    value.qw = rotation.w();
+  }
+
+  void run()
+  {
+    auto next = clock::now();
+    while (true) {
+      {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        m_condition.wait(lock, [this] { return m_stop || m_hasPending; });
+        // write the remaining CSV rows before stopping
+        if (m_stop && !m_hasPending) {
+          return;
+        }
+        std::swap(m_pending, m_publishing);
+        m_pending.numPoses = 0;
+        m_hasPending = false;
+        std::swap(m_csvPending, m_csvRows);
+      }
+
+      sendTransforms();
+      writeCSVs();
+
+      if (m_period.count() > 0) {
+        // newer frames replace the pending one meanwhile
+        next += m_period;
+        auto now = clock::now();
+        if (next < now) {
+          next = now;
+        }
+        std::unique_lock<std::mutex> lock(m_mutex);
+        m_condition.wait_until(lock, next, [this] { return m_stop; });
+      }
+    }
+  }
+
+  void sendTransforms()
+  {
+    if (m_publishing.numPoses == 0) {
+      return;
+    }
+    // one stamp for the whole frame: the time of the frame
+    std::chrono::duration<double> age = clock::now() - m_publishing.stamp;
+    ros::Time stamp = ros::Time::now() - ros::Duration(age.count());
+
+    m_transforms.clear();
+    for (size_t i = 0; i < m_publishing.numPoses; ++i) {
+      const pose& p = m_publishing.poses[i];
+      tf::Transform transform;
+      transform.setOrigin(tf::Vector3(p.pose.x, p.pose.y, p.pose.z));
+      transform.setRotation(tf::Quaternion(p.pose.qx, p.pose.qy, p.pose.qz, p.pose.qw));
+      m_transforms.push_back(tf::StampedTransform(transform, stamp, "world", p.frameId));
+    }
+    m_br.sendTransform(m_transforms);
+  }
+
+  void writeCSVs()
+  {
+    if (m_csvRows.empty()) {
+      return;
+    }
+    std::unique_lock<std::mutex> lock(m_csvMutex);
+    for (const auto& row : m_csvRows) {
+      auto& file = *m_csvs[row.csv];
+      if (!file.is_open()) {
+        continue;
+      }
+      std::chrono::duration<double> t = row.stamp - m_phaseStart;
+      Eigen::Quaternionf q(row.pose.qw, row.pose.qx, row.pose.qy, row.pose.qz);
+      auto rpy = q.toRotationMatrix().eulerAngles(0, 1, 2);
+      file << t.count() << "," << row.pose.x << "," << row.pose.y << "," << row.pose.z
+           << "," << rpy(0) << "," << rpy(1) << "," << rpy(2) << "\n";
+    }
+    m_csvRows.clear();
+  }
+
+private:
+  tf::TransformBroadcaster m_br;
+  clock::duration m_period;
+  // filled by the fast path
+  frame m_writing;
+  // latest frame handed over (guarded by m_mutex)
+  frame m_pending;
+  // published by the thread
+  frame m_publishing;
+  bool m_hasPending;
+  std::vector<csvRow> m_csvWriting;
+  std::vector<csvRow> m_csvPending;
+  std::vector<csvRow> m_csvRows;
+  std::vector<tf::StampedTransform> m_transforms;
+  std::mutex m_mutex;
+  std::condition_variable m_condition;
+  // guards the CSV files and m_phaseStart
+  std::mutex m_csvMutex;
+  std::vector<std::unique_ptr<std::ofstream> > m_csvs;
+  clock::time_point m_phaseStart;
+  bool m_stop;
+  std::thread m_thread;
+};
@@ -0,0 +1,286 @@
+#pragma once
+
+#include <vector>
+#include <memory>
+#include <algorithm>
+#include <numeric>
+#include <unordered_map>
+#include <cmath>
+#include <stdexcept>
+
+#include <libobjecttracker/object_tracker.h>
+#include <crazyflie_cpp/FrameWorkerPool.h>
+
+// Object tracker for the CFs of one group, split into shards which are
+// tracked in parallel.
+// The objects are partitioned spatially (k-d split of their initial
+// positions) into numShards ObjectTrackers. For each frame, the markers are
+// sorted into a voxel grid once; each shard then only gets the markers
+// within margin (in m) of the bounding box of its objects' last poses, and
+// only looks at the voxels of that box.
+// Shards keep their objects, i.e. the pre-filter gets less selective if the
+// objects of a shard spread out.
+// With a single shard, the full point cloud is passed to the tracker.
+class ShardedObjectTracker
+{
+public:
+  ShardedObjectTracker(
+    const std::vector<libobjecttracker::DynamicsConfiguration>& dynamicsConfigurations,
+    const std::vector<libobjecttracker::MarkerConfiguration>& markerConfigurations,
+    const std::vector<libobjecttracker::Object>& objects,
+    size_t numShards,
+    float margin)
+    : m_shards()
+    , m_objects()
+    , m_margin(margin)
+    , m_markers()
+    , m_voxels()
+    , m_numVoxels(0)
+    , m_voxelIndex()
+    , m_workers()
+  {
+    numShards = std::max<size_t>(std::min(numShards, objects.size()), 1);
+    // the margin is the edge length of the voxels
+    if (numShards > 1 && !(margin > 0)) {
+      throw std::runtime_error("tracker_shard_margin has to be positive!");
+    }
+
+    std::vector<size_t> indices(objects.size());
+    std::iota(indices.begin(), indices.end(), 0);
+    std::vector<std::vector<size_t> > partition;
+    split(objects, indices.begin(), indices.end(), numShards, partition);
+
+    m_objects.resize(objects.size());
+    for (size_t s = 0; s < partition.size(); ++s) {
+      std::vector<libobjecttracker::Object> shardObjects;
+      for (size_t i = 0; i < partition[s].size(); ++i) {
+        shardObjects.push_back(objects[partition[s][i]]);
+        m_objects[partition[s][i]] = {s, i};
+      }
+      m_shards.push_back(std::unique_ptr<shard>(new shard));
+      m_shards.back()->tracker.reset(new libobjecttracker::ObjectTracker(
+        dynamicsConfigurations,
+        markerConfigurations,
+        shardObjects));
+      m_shards.back()->markers.reset(new pcl::PointCloud<pcl::PointXYZ>);
+    }
+
+    if (m_shards.size() > 1) {
+      std::vector<std::function<void()> > jobs;
+      for (size_t s = 0; s < m_shards.size(); ++s) {
+        jobs.push_back(std::bind(&ShardedObjectTracker::updateShard, this, s));
+      }
+      m_workers.start(jobs, std::vector<int>());
+    }
+  }
+
+  size_t numShards() const {
+    return m_shards.size();
+  }
+
+  void setLogWarningCallback(
+    std::function<void(const std::string&)> logWarn)
+  {
+    for (auto& s : m_shards) {
+      s->tracker->setLogWarningCallback(logWarn);
+    }
+  }
+
+  void update(
+    pcl::PointCloud<pcl::PointXYZ>::Ptr markers)
+  {
+    if (m_shards.size() == 1) {
+      m_shards[0]->tracker->update(markers);
+      return;
+    }
+
+    m_markers = markers;
+    buildVoxelGrid(*markers);
+    m_workers.run();
+    m_markers.reset();
+  }
+
+  // Object i as passed to the constructor
+  const libobjecttracker::Object& object(
+    size_t i) const
+  {
+    const objectIndex& idx = m_objects[i];
+    return m_shards[idx.shard]->tracker->objects()[idx.index];
+  }
+
+private:
+  struct shard
+  {
+    std::unique_ptr<libobjecttracker::ObjectTracker> tracker;
+    pcl::PointCloud<pcl::PointXYZ>::Ptr markers;
+  };
+
+  struct objectIndex
+  {
+    size_t shard;
+    size_t index;
+  };
+
+  struct voxel
+  {
+    int x;
+    int y;
+    int z;
+    std::vector<size_t> points;
+  };
+
+  // Splits [begin, end) into numShards parts of about the same size
+  // along the axis with the largest extent (recursively).
+  static void split(
+    const std::vector<libobjecttracker::Object>& objects,
+    std::vector<size_t>::iterator begin,
+    std::vector<size_t>::iterator end,
+    size_t numShards,
+    std::vector<std::vector<size_t> >& partition)
+  {
+    if (numShards == 1) {
+      partition.push_back(std::vector<size_t>(begin, end));
+      return;
+    }
+    auto position = [&](size_t i) {
+      return objects[i].transformation().translation();
+    };
+    Eigen::Vector3f min = position(*begin);
+    Eigen::Vector3f max = min;
+    for (auto iter = begin; iter != end; ++iter) {
+      min = min.cwiseMin(position(*iter));
+      max = max.cwiseMax(position(*iter));
+    }
+    int axis;
+    (max - min).maxCoeff(&axis);
+
+    size_t numLeft = numShards / 2;
+    auto mid = begin + (end - begin) * numLeft / numShards;
+    std::nth_element(begin, mid, end, [&](size_t a, size_t b) {
+      return position(a)(axis) < position(b)(axis);
+    });
+    split(objects, begin, mid, numLeft, partition);
+    split(objects, mid, end, numShards - numLeft, partition);
+  }
+
+  int voxelCoordinate(
+    float value) const
+  {
+    return std::floor(value / m_margin);
+  }
+
+  static uint64_t voxelKey(
+    int x,
+    int y,
+    int z)
+  {
+    // 21 bits per coordinate
+    return ((uint64_t)(x & 0x1FFFFF) << 42)
+         | ((uint64_t)(y & 0x1FFFFF) << 21)
+         | ((uint64_t)(z & 0x1FFFFF));
+  }
+
+  void buildVoxelGrid(
+    const pcl::PointCloud<pcl::PointXYZ>& markers)
+  {
+    for (auto& v : m_voxels) {
+      v.points.clear();
+    }
+    size_t numVoxels = 0;
+    m_voxelIndex.clear();
+    for (size_t i = 0; i < markers.size(); ++i) {
+      const pcl::PointXYZ& p = markers[i];
+      int x = voxelCoordinate(p.x);
+      int y = voxelCoordinate(p.y);
+      int z = voxelCoordinate(p.z);
+      uint64_t key = voxelKey(x, y, z);
+      auto iter = m_voxelIndex.find(key);
+      if (iter == m_voxelIndex.end()) {
+        iter = m_voxelIndex.insert(std::make_pair(key, numVoxels++)).first;
+        if (m_voxels.size() < numVoxels) {
+          m_voxels.resize(numVoxels);
+        }
+        voxel& v = m_voxels[iter->second];
+        v.x = x;
+        v.y = y;
+        v.z = z;
+      }
+      m_voxels[iter->second].points.push_back(i);
+    }
+    m_numVoxels = numVoxels;
+  }
+
+  // Runs on the worker of shard s
+  void updateShard(
+    size_t s)
+  {
+    shard& sh = *m_shards[s];
+    const auto& objects = sh.tracker->objects();
+
+    Eigen::Vector3f min = objects[0].transformation().translation();
+    Eigen::Vector3f max = min;
+    for (const auto& object : objects) {
+      min = min.cwiseMin(object.transformation().translation());
+      max = max.cwiseMax(object.transformation().translation());
+    }
+    min.array() -= m_margin;
+    max.array() += m_margin;
+
+    int minX = voxelCoordinate(min.x());
+    int minY = voxelCoordinate(min.y());
+    int minZ = voxelCoordinate(min.z());
+    int maxX = voxelCoordinate(max.x());
+    int maxY = voxelCoordinate(max.y());
+    int maxZ = voxelCoordinate(max.z());
+
+    auto addMarkers = [&](const voxel& v) {
+      for (size_t idx : v.points) {
+        const pcl::PointXYZ& p = (*m_markers)[idx];
+        if (p.x >= min.x() && p.x <= max.x()
+         && p.y >= min.y() && p.y <= max.y()
+         && p.z >= min.z() && p.z <= max.z()) {
+          sh.markers->push_back(p);
+        }
+      }
+    };
+
+    sh.markers->clear();
+    // Visits the cells of the box, unless the objects of the shard spread
+    // out so far that the box has more cells than there are occupied voxels.
+    // (The index is only read here, i.e. the workers can share it.)
+    double numCells = (double)(maxX - minX + 1) * (maxY - minY + 1) * (maxZ - minZ + 1);
+    if (numCells <= m_numVoxels) {
+      for (int x = minX; x <= maxX; ++x) {
+        for (int y = minY; y <= maxY; ++y) {
+          for (int z = minZ; z <= maxZ; ++z) {
+            auto iter = m_voxelIndex.find(voxelKey(x, y, z));
+            if (iter != m_voxelIndex.end()) {
+              addMarkers(m_voxels[iter->second]);
+            }
+          }
+        }
+      }
+    } else {
+      for (size_t i = 0; i < m_numVoxels; ++i) {
+        const voxel& v = m_voxels[i];
+        if (v.x >= minX && v.x <= maxX
+         && v.y >= minY && v.y <= maxY
+         && v.z >= minZ && v.z <= maxZ) {
+          addMarkers(v);
+        }
+      }
+    }
+    sh.tracker->update(sh.markers);
+  }
+
+private:
+  std::vector<std::unique_ptr<shard> > m_shards;
+  std::vector<objectIndex> m_objects;
+  float m_margin;
+  pcl::PointCloud<pcl::PointXYZ>::Ptr m_markers;
+  // voxels (of size margin) of the current frame; the first m_numVoxels are used
+  std::vector<voxel> m_voxels;
+  size_t m_numVoxels;
+  std::unordered_map<uint64_t, size_t> m_voxelIndex;
+  FrameWorkerPool m_workers;
+};
@@ -0,0 +1,258 @@
+#include "ros/ros.h"
+
+#include <chrono>
+#include <thread>
+#include <fstream>
+#include <algorithm>
+#include <memory>
+
+#include <crazyflie_cpp/Crazyflie.h>
+#include <libobjecttracker/object_tracker.h>
+#include "tracker_config.h"
+#include "sharded_object_tracker.h"
+
+/*
+Offline benchmark of the per-frame work of the crazyflie_server
+(CrazyflieGroup::runFast with object tracking): replays a point cloud log
+(as written with save_point_clouds) through the object tracker and packs the
+resulting poses using a CrazyflieBroadcaster on a null transport.
+
+Reads the same parameters as the server (crazyflies, markerConfigurations,
+dynamicsConfigurations), plus:
+  ~cloud_log   point cloud log to replay
+  ~realtime    replay with the recorded timing instead of as fast as possible
+  ~channel     only track the CFs of that channel (-1: all)
+  ~repeat      number of times the log is replayed
+  ~output_csv  optional file for the per-frame latencies
+  ~tracker_shards, ~tracker_shard_margin  as for crazyflie_server
+
+Point cloud log format (libobjecttracker::PointCloudLogger), per frame:
+  uint32_t time in ms since start, uint32_t number of points, float x, y, z
+*/
+
+namespace {
+
+struct cloudFrame
+{
+  uint32_t time_in_ms;
+  pcl::PointCloud<pcl::PointXYZ>::Ptr markers;
+};
+
+void readCloudLog(
+  const std::string& fileName,
+  std::vector<cloudFrame>& frames)
+{
+  std::ifstream file(fileName, std::ios::binary);
+  if (!file) {
+    throw std::runtime_error("Could not open " + fileName);
+  }
+  frames.clear();
+  while (true) {
+    uint32_t header[2];
+    if (!file.read(reinterpret_cast<char*>(header), sizeof(header))) {
+      break;
+    }
+    cloudFrame frame;
+    frame.time_in_ms = header[0];
+    frame.markers.reset(new pcl::PointCloud<pcl::PointXYZ>);
+    std::vector<float> points(3 * header[1]);
+    if (!file.read(reinterpret_cast<char*>(points.data()), points.size() * sizeof(float))) {
+      ROS_WARN("Point cloud log is truncated, ignoring the last frame.");
+      break;
+    }
+    for (size_t i = 0; i < header[1]; ++i) {
+      frame.markers->push_back(pcl::PointXYZ(points[3*i], points[3*i+1], points[3*i+2]));
+    }
+    frames.push_back(frame);
+  }
+}
+
+// Accepts broadcasts without sending them anywhere
+class NullTransport
+  : public ITransport
+{
+public:
+  NullTransport()
+    : m_numPackets(0)
+  {
+  }
+
+  virtual void sendPacket(
+    const uint8_t* data,
+    uint32_t length,
+    Ack& result)
+  {
+    ++m_numPackets;
+    result.ack = true;
+    result.size = 0;
+  }
+
+  virtual void sendPacketNoAck(
+    const uint8_t* data,
+    uint32_t length)
+  {
+    ++m_numPackets;
+  }
+
+  size_t numPackets() const {
+    return m_numPackets;
+  }
+
+private:
+  size_t m_numPackets;
+};
+
+void printStage(
+  const std::string& name,
+  std::vector<double>& latencies)
+{
+  if (latencies.empty()) {
+    return;
+  }
+  std::sort(latencies.begin(), latencies.end());
+  double sum = 0;
+  for (double l : latencies) {
+    sum += l;
+  }
+  auto percentile = [&](double p) {
+    return latencies[std::min<size_t>(p * latencies.size(), latencies.size() - 1)] * 1e3;
+  };
+  ROS_INFO("%-12s mean %8.3f ms, p50 %8.3f ms, p99 %8.3f ms, max %8.3f ms",
+    name.c_str(), sum / latencies.size() * 1e3, percentile(0.5), percentile(0.99), latencies.back() * 1e3);
+}
+
+} // namespace
+
+int main(int argc, char **argv)
+{
+  ros::init(argc, argv, "tracker_benchmark");
+  ros::NodeHandle nl("~");
+  ros::NodeHandle nGlobal;
+
+  std::string cloudLog;
+  bool realtime;
+  int channel;
+  int repeat;
+  std::string outputCSV;
+  int trackerShards;
+  double trackerShardMargin;
+  nl.getParam("cloud_log", cloudLog);
+  nl.param("realtime", realtime, false);
+  nl.param("channel", channel, -1);
+  nl.param("repeat", repeat, 1);
+  nl.param<std::string>("output_csv", outputCSV, "");
+  nl.param("tracker_shards", trackerShards, 1);
+  nl.param("tracker_shard_margin", trackerShardMargin, 0.5);
+
+  try {
+    std::vector<libobjecttracker::MarkerConfiguration> markerConfigurations;
+    std::vector<libobjecttracker::DynamicsConfiguration> dynamicsConfigurations;
+    readMarkerConfigurations(markerConfigurations);
+    readDynamicsConfigurations(dynamicsConfigurations);
+
+    // objects as in CrazyflieGroup::readObjects
+    std::vector<libobjecttracker::Object> objects;
+    std::vector<uint8_t> ids;
+    XmlRpc::XmlRpcValue crazyflies;
+    nGlobal.getParam("crazyflies", crazyflies);
+    ROS_ASSERT(crazyflies.getType() == XmlRpc::XmlRpcValue::TypeArray);
+    for (int32_t i = 0; i < crazyflies.size(); ++i) {
+      XmlRpc::XmlRpcValue crazyflie = crazyflies[i];
+      int id = crazyflie["id"];
+      int ch = crazyflie["channel"];
+      if (channel >= 0 && ch != channel) {
+        continue;
+      }
+      XmlRpc::XmlRpcValue pos = crazyflie["initialPosition"];
+      ROS_ASSERT(pos.getType() == XmlRpc::XmlRpcValue::TypeArray);
+      Eigen::Affine3f m;
+      m = Eigen::Translation3f(
+        static_cast<double>(pos[0]), static_cast<double>(pos[1]), static_cast<double>(pos[2]));
+      objects.push_back(libobjecttracker::Object(0, 0, m));
+      ids.push_back(id);
+    }
+
+    std::vector<cloudFrame> frames;
+    readCloudLog(cloudLog, frames);
+    ROS_INFO("Replaying %lu frames for %lu CFs", frames.size(), objects.size());
+
+    ShardedObjectTracker tracker(
+      dynamicsConfigurations,
+      markerConfigurations,
+      objects,
+      std::max(trackerShards, 1),
+      trackerShardMargin);
+    ROS_INFO("Tracking with %lu shard(s)", tracker.numShards());
+    NullTransport transport;
+    CrazyflieBroadcaster cfbc(&transport);
+
+    std::unique_ptr<std::ofstream> csv;
+    if (!outputCSV.empty()) {
+      csv.reset(new std::ofstream(outputCSV));
+      *csv << "frame,markers,tracked,tracking,broadcasting,total\n";
+    }
+
+    typedef std::chrono::high_resolution_clock clock;
+    std::vector<double> latencyTracking;
+    std::vector<double> latencyBroadcasting;
+    std::vector<double> latencyTotal;
+    size_t numPoses = 0;
+    poseBatch states;
+    states.reserve(ids.size());
+
+    for (int r = 0; r < repeat && ros::ok(); ++r) {
+      auto replayStart = clock::now();
+      for (size_t f = 0; f < frames.size() && ros::ok(); ++f) {
+        const cloudFrame& frame = frames[f];
+        if (realtime) {
+          std::this_thread::sleep_until(replayStart + std::chrono::milliseconds(frame.time_in_ms - frames[0].time_in_ms));
+        }
+
+        auto start = clock::now();
+        tracker.update(frame.markers);
+        auto tracked = clock::now();
+
+        states.clear();
+        for (size_t i = 0; i < ids.size(); ++i) {
+          if (tracker.object(i).lastTransformationValid()) {
+            const Eigen::Affine3f& transform = tracker.object(i).transformation();
+            Eigen::Quaternionf q(transform.rotation());
+            const auto& translation = transform.translation();
+
+            states.push_back(ids[i],
+              translation.x(), translation.y(), translation.z(),
+              q.x(), q.y(), q.z(), q.w());
+          }
+        }
+        cfbc.sendPositionExternalBringup(states);
+        auto end = clock::now();
+
+        std::chrono::duration<double> tracking = tracked - start;
+        std::chrono::duration<double> broadcasting = end - tracked;
+        std::chrono::duration<double> total = end - start;
+        latencyTracking.push_back(tracking.count());
+        latencyBroadcasting.push_back(broadcasting.count());
+        latencyTotal.push_back(total.count());
+        numPoses += states.size();
+
+        if (csv) {
+          *csv << f << "," << frame.markers->size() << "," << states.size() << ","
+               << tracking.count() << "," << broadcasting.count() << "," << total.count() << "\n";
+        }
+      }
+    }
+
+    size_t numFrames = latencyTotal.size();
+    ROS_INFO("%lu frames, %f poses per frame (of %lu CFs), %lu packets",
+      numFrames, numFrames ? (double)numPoses / numFrames : 0.0, ids.size(), transport.numPackets());
+    printStage("tracking", latencyTracking);
+    printStage("broadcasting", latencyBroadcasting);
+    printStage("total", latencyTotal);
+
+    return 0;
+  }
+  catch(std::exception& e) {
+    ROS_ERROR("%s", e.what());
+    return 1;
+  }
+}
@@ -0,0 +1,60 @@
+#pragma once
+
+#include "ros/ros.h"
+#include <sstream>
+#include <vector>
+
+#include <libobjecttracker/object_tracker.h>
+
+// Object tracker configuration, read from the private parameters of the node
+// (shared by crazyflie_server and tracker_benchmark)
+
+inline void readMarkerConfigurations(
+  std::vector<libobjecttracker::MarkerConfiguration>& markerConfigurations)
+{
+  markerConfigurations.clear();
+  ros::NodeHandle nl("~");
+  int numConfigurations;
+  nl.getParam("numMarkerConfigurations", numConfigurations);
+  for (int i = 0; i < numConfigurations; ++i) {
+    markerConfigurations.push_back(pcl::PointCloud<pcl::PointXYZ>::Ptr(new pcl::PointCloud<pcl::PointXYZ>));
+    std::stringstream sstr;
+    sstr << "markerConfigurations/" << i << "/numPoints";
+    int numPoints;
+    nl.getParam(sstr.str(), numPoints);
+
+    std::vector<double> offset;
+    std::stringstream sstr2;
+    sstr2 << "markerConfigurations/" << i << "/offset";
+    nl.getParam(sstr2.str(), offset);
+    for (int j = 0; j < numPoints; ++j) {
+      std::stringstream sstr3;
+      sstr3 << "markerConfigurations/" << i << "/points/" << j;
+      std::vector<double> points;
+      nl.getParam(sstr3.str(), points);
+      markerConfigurations.back()->push_back(pcl::PointXYZ(points[0] + offset[0], points[1] + offset[1], points[2] + offset[2]));
+    }
+  }
+}
+
+inline void readDynamicsConfigurations(
+  std::vector<libobjecttracker::DynamicsConfiguration>& dynamicsConfigurations)
+{
+  ros::NodeHandle nl("~");
+  int numConfigurations;
+  nl.getParam("numDynamicsConfigurations", numConfigurations);
+  dynamicsConfigurations.resize(numConfigurations);
+  for (int i = 0; i < numConfigurations; ++i) {
+    std::stringstream sstr;
+    sstr << "dynamicsConfigurations/" << i;
+    nl.getParam(sstr.str() + "/maxXVelocity", dynamicsConfigurations[i].maxXVelocity);
+    nl.getParam(sstr.str() + "/maxYVelocity", dynamicsConfigurations[i].maxYVelocity);
+    nl.getParam(sstr.str() + "/maxZVelocity", dynamicsConfigurations[i].maxZVelocity);
+    nl.getParam(sstr.str() + "/maxPitchRate", dynamicsConfigurations[i].maxPitchRate);
+    nl.getParam(sstr.str() + "/maxRollRate", dynamicsConfigurations[i].maxRollRate);
+    nl.getParam(sstr.str() + "/maxYawRate", dynamicsConfigurations[i].maxYawRate);
+    nl.getParam(sstr.str() + "/maxRoll", dynamicsConfigurations[i].maxRoll);
+    nl.getParam(sstr.str() + "/maxPitch", dynamicsConfigurations[i].maxPitch);
+    nl.getParam(sstr.str() + "/maxFitnessScore", dynamicsConfigurations[i].maxFitnessScore);
+  }
+}
@@ -1,7 +1,12 @@
 #include <iostream>
 #include <fstream>
+#include <thread>
+#include <mutex>
+#include <chrono>
+#include <functional>
 
 #include <boost/program_options.hpp>
+#include <boost/crc.hpp>
 #include <crazyflie_cpp/Crazyflie.h>
 
 std::istream& operator>>(std::istream& in, Crazyflie::BootloaderTarget& target)
@@ -37,6 +42,108 @@ std::istream& operator>>(std::istream& in, Mode& mode)
   return in;
 }
 
+uint32_t crc32(
+  const uint8_t* data,
+  size_t size)
+{
+  boost::crc_32_type crc;
+  crc.process_bytes(data, size);
+  return crc.checksum();
+}
+
+// Flashes all given Crazyflies at once: first all of them are rebooted into
+// the bootloader, then each is flashed from its own thread. The bootloaders
+// are spread over all radios; packets of vehicles on the same radio
+// interleave. Prints one CSV line per vehicle.
+bool flashFleet(
+  const std::vector<std::string>& uris,
+  Crazyflie::BootloaderTarget target,
+  Mode mode,
+  const std::vector<uint8_t>& targetData,
+  uint32_t numRadios,
+  uint32_t pipelineDepth)
+{
+  struct vehicle
+  {
+    std::string uri;
+    std::string bootloaderUri;
+    bool success;
+    double duration;
+    uint32_t crc;
+    std::string error;
+  };
+  std::vector<vehicle> vehicles(uris.size());
+  const uint32_t targetCrc = crc32(targetData.data(), targetData.size());
+
+  auto runAll = [&](std::function<void(size_t)> f) {
+    std::vector<std::thread> threads;
+    for (size_t i = 0; i < vehicles.size(); ++i) {
+      threads.push_back(std::thread([&f, &vehicles, i] {
+        try {
+          f(i);
+        }
+        catch(std::exception& e) {
+          vehicles[i].success = false;
+          vehicles[i].error = e.what();
+        }
+      }));
+    }
+    for (auto& thread : threads) {
+      thread.join();
+    }
+  };
+
+  // reboot all vehicles into the bootloader
+  runAll([&](size_t i) {
+    vehicle& v = vehicles[i];
+    v.uri = uris[i];
+    v.success = true;
+    v.duration = 0;
+    v.crc = 0;
+    Crazyflie cf(v.uri);
+    uint64_t address = cf.rebootToBootloader();
+    char addr[17];
+    std::sprintf(addr, "%lx", address);
+    v.bootloaderUri = "radio://" + std::to_string(i % numRadios) + "/0/2M/" + std::string(addr);
+  });
+
+  runAll([&](size_t i) {
+    vehicle& v = vehicles[i];
+    if (!v.success) {
+      return;
+    }
+    auto start = std::chrono::steady_clock::now();
+    Crazyflie cf(v.bootloaderUri);
+    cf.setRadioPipelineDepth(pipelineDepth);
+
+    if (mode == FlashAndVerify || mode == FlashOnly) {
+      cf.writeFlash(target, targetData);
+    }
+    if (mode == FlashAndVerify || mode == VerifyOnly) {
+      std::vector<uint8_t> currentData;
+      cf.readFlash(target, targetData.size(), currentData);
+      v.crc = crc32(currentData.data(), currentData.size());
+      if (v.crc != targetCrc) {
+        v.success = false;
+        v.error = "verification failed";
+      }
+    }
+    cf.reboot();
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+    v.duration = elapsed.count();
+  });
+
+  bool success = true;
+  std::cout << "uri,bootloader_uri,success,duration,crc,expected_crc,error" << std::endl;
+  for (const auto& v : vehicles) {
+    std::cout << v.uri << "," << v.bootloaderUri << "," << v.success << "," << v.duration
+              << "," << std::hex << v.crc << "," << targetCrc << std::dec
+              << "," << v.error << std::endl;
+    success = success && v.success;
+  }
+  return success;
+}
+
 int main(int argc, char **argv)
 {
 
@@ -45,6 +152,9 @@ int main(int argc, char **argv)
   std::string defaultUri("radio://0/0/2M");
   Crazyflie::BootloaderTarget target;
   Mode mode = FlashAndVerify;
+  std::vector<std::string> uris;
+  uint32_t numRadios = 0;
+  uint32_t pipelineDepth = 1;
 
   namespace po = boost::program_options;
 
@@ -55,6 +165,9 @@ int main(int argc, char **argv)
     ("filename", po::value<std::string>(&fileName)->required(), "file to flash")
     ("uri", po::value<std::string>(&uri)->default_value(defaultUri), "unique ressource identifier")
     ("mode", po::value<Mode>(&mode)->default_value(mode), "mode {default=flashAndVerify, flashOnly, verifyOnly}")
+    ("uris", po::value<std::vector<std::string> >(&uris)->multitoken(), "flash all given Crazyflies in parallel")
+    ("radios", po::value<uint32_t>(&numRadios), "number of radios to use for --uris (default: all)")
+    ("pipeline-depth", po::value<uint32_t>(&pipelineDepth)->default_value(pipelineDepth), "packets in flight per radio")
   ;
 
   try
@@ -77,6 +190,18 @@ int main(int argc, char **argv)
 
   try
   {
+    std::ifstream stream(fileName.c_str(), std::ios::binary);
+    std::vector<uint8_t> targetData((
+      std::istreambuf_iterator<char>(stream)),
+      (std::istreambuf_iterator<char>()));
+
+    if (!uris.empty()) {
+      if (numRadios == 0) {
+        numRadios = std::max<uint32_t>(Crazyradio::numDevices(), 1);
+      }
+      return flashFleet(uris, target, mode, targetData, numRadios, pipelineDepth) ? 0 : 1;
+    }
+
     bool success = true;
     if (uri != defaultUri) {
       // std::cout << "Reboot to Bootloader...";
@@ -89,12 +214,8 @@ int main(int argc, char **argv)
       defaultUri += "/" + std::string(addr);
     }
 
-    std::ifstream stream(fileName.c_str(), std::ios::binary);
-    std::vector<uint8_t> targetData((
-      std::istreambuf_iterator<char>(stream)),
-      (std::istreambuf_iterator<char>()));
-
     Crazyflie cf(defaultUri);
+    cf.setRadioPipelineDepth(pipelineDepth);
 
     if (mode == FlashAndVerify || mode == FlashOnly) {
       // std::cout << "Flashing " << targetData.size() / 1024 << " kB" << std::endl;
@@ -0,0 +1,300 @@
+#include <iostream>
+#include <thread>
+#include <mutex>
+#include <chrono>
+#include <atomic>
+#include <memory>
+#include <limits>
+#include <algorithm>
+#include <stdexcept>
+
+#include <boost/program_options.hpp>
+#include <crazyflie_cpp/Crazyflie.h>
+
+// Measures the latency and loss of broadcasts on real hardware. Frames of
+// drop test packets (one packet per two vehicles, like a frame of poses) are
+// broadcast at each of the given rates, and every Crazyflie given by --cf
+// logs the sequence number it received last and how many it received.
+// The onboard clock is mapped to the host clock with the log records that
+// arrived fastest, i.e. latencies include the minimal latency of a log
+// record (and, without --time-variable, a log period of resolution).
+// Prints CSV lines:
+// rate,vehicles,paired,uri,sent,received,loss,samples,latency_min,latency_p50,latency_p99,latency_max
+
+namespace {
+
+typedef std::chrono::steady_clock benchmarkClock;
+
+struct logRecord
+{
+  // host time the record arrived
+  benchmarkClock::time_point received;
+  uint32_t time_in_ms;
+  uint32_t seq;
+  uint32_t count;
+  // onboard time of the last receive (if logged)
+  uint32_t rxTime_in_us;
+};
+
+struct vehicle
+{
+  vehicle(
+    const std::string& uri)
+    : uri(uri)
+    , cf(uri)
+    , mutex()
+    , records()
+  {
+  }
+
+  std::string uri;
+  Crazyflie cf;
+  std::mutex mutex;
+  std::vector<logRecord> records;
+};
+
+double percentile(
+  const std::vector<double>& sorted,
+  double p)
+{
+  if (sorted.empty()) {
+    return 0;
+  }
+  size_t idx = std::min<size_t>(p * sorted.size(), sorted.size() - 1);
+  return sorted[idx];
+}
+
+void evaluate(
+  double rate,
+  size_t numVehicles,
+  bool paired,
+  vehicle& v,
+  const std::vector<logRecord>& records,
+  size_t numBaseline,
+  uint32_t firstSeq,
+  size_t packetsPerFrame,
+  const std::vector<benchmarkClock::time_point>& sendTimes,
+  bool hasRxTime)
+{
+  if (numBaseline == 0 || records.size() <= numBaseline) {
+    throw std::runtime_error(v.uri + ": no log data");
+  }
+
+  // offset between onboard and host clock (+ minimal log latency)
+  benchmarkClock::time_point epoch = sendTimes.front();
+  double offset = std::numeric_limits<double>::max();
+  for (const auto& record : records) {
+    std::chrono::duration<double> received = record.received - epoch;
+    offset = std::min(offset, received.count() - record.time_in_ms * 1e-3);
+  }
+
+  size_t numSent = sendTimes.size() * packetsPerFrame;
+  uint32_t numReceived = records.back().count - records[numBaseline - 1].count;
+
+  // a new sequence number in a record is the first sign of its frame
+  std::vector<double> latencies;
+  uint32_t lastSeq = records[numBaseline - 1].seq;
+  for (size_t i = numBaseline; i < records.size(); ++i) {
+    const logRecord& record = records[i];
+    if (record.seq != lastSeq && record.seq - firstSeq < numSent) {
+      uint32_t frame = (record.seq - firstSeq) / packetsPerFrame;
+      double onboard = hasRxTime ? record.rxTime_in_us * 1e-6 : record.time_in_ms * 1e-3;
+      std::chrono::duration<double> sent = sendTimes[frame] - epoch;
+      latencies.push_back(onboard + offset - sent.count());
+    }
+    lastSeq = record.seq;
+  }
+  std::sort(latencies.begin(), latencies.end());
+
+  std::cout << rate << ","
+            << numVehicles << ","
+            << paired << ","
+            << v.uri << ","
+            << numSent << ","
+            << numReceived << ","
+            << 1.0 - numReceived / (double)numSent << ","
+            << latencies.size() << ","
+            << percentile(latencies, 0) << ","
+            << percentile(latencies, 0.5) << ","
+            << percentile(latencies, 0.99) << ","
+            << percentile(latencies, 1) << std::endl;
+}
+
+} // namespace
+
+int main(int argc, char **argv)
+{
+
+  std::string uri;
+  std::string defaultUri("radio://0/80/2M/FFE7E7E7E7");
+  std::vector<std::string> cfUris;
+  std::vector<double> rates;
+  std::vector<size_t> vehicleCounts;
+  std::vector<bool> pairings;
+  double duration = 5.0;
+  uint32_t logPeriod = 1;
+  std::string seqVariable("pacDrop.seq");
+  std::string countVariable("pacDrop.total");
+  std::string timeVariable;
+
+  namespace po = boost::program_options;
+
+  po::options_description desc("Allowed options");
+  desc.add_options()
+    ("help", "produce help message")
+    ("uri", po::value<std::string>(&uri)->default_value(defaultUri), "unique ressource identifier of the broadcasts")
+    ("cf", po::value<std::vector<std::string> >(&cfUris)->multitoken()->required(), "Crazyflies that report what they received")
+    ("rates", po::value<std::vector<double> >(&rates)->multitoken(), "frames per second (default: 50 100 200)")
+    ("vehicles", po::value<std::vector<size_t> >(&vehicleCounts)->multitoken(), "vehicles per frame, two per packet (default: 2 10 20)")
+    ("paired", po::value<std::vector<bool> >(&pairings)->multitoken(), "send two packets per USB transfer (default: 0 1)")
+    ("duration", po::value<double>(&duration)->default_value(duration), "s of broadcasts per combination")
+    ("log-period", po::value<uint32_t>(&logPeriod)->default_value(logPeriod), "log period in 10 ms")
+    ("seq-variable", po::value<std::string>(&seqVariable)->default_value(seqVariable), "log variable of the sequence number received last")
+    ("count-variable", po::value<std::string>(&countVariable)->default_value(countVariable), "log variable of the number of packets received")
+    ("time-variable", po::value<std::string>(&timeVariable), "log variable of the onboard time (us) of the last receive (default: use the log timestamp)")
+  ;
+
+  try
+  {
+    po::variables_map vm;
+    po::store(po::parse_command_line(argc, argv, desc), vm);
+
+    if (vm.count("help")) {
+      std::cout << desc << "\n";
+      return 0;
+    }
+    po::notify(vm);
+  }
+  catch(po::error& e)
+  {
+    std::cerr << e.what() << std::endl << std::endl;
+    std::cerr << desc << std::endl;
+    return 1;
+  }
+
+  if (rates.empty()) {
+    rates = {50, 100, 200};
+  }
+  if (vehicleCounts.empty()) {
+    vehicleCounts = {2, 10, 20};
+  }
+  if (pairings.empty()) {
+    pairings = {false, true};
+  }
+  if (logPeriod == 0 || logPeriod > 255) {
+    std::cerr << "log-period has to be within 1..255" << std::endl;
+    return 1;
+  }
+
+  if (duration <= 0 || *std::min_element(rates.begin(), rates.end()) <= 0) {
+    std::cerr << "rates and duration have to be positive" << std::endl;
+    return 1;
+  }
+
+  // the ping threads have to stop before the vehicles are destroyed
+  std::vector<std::unique_ptr<vehicle> > vehicles;
+  std::vector<std::unique_ptr<LogBlockGeneric> > logBlocks;
+  std::atomic<bool> done(false);
+  std::vector<std::thread> threads;
+  try
+  {
+    CrazyflieBroadcaster cfb(uri);
+
+    std::vector<std::string> variables = {seqVariable, countVariable};
+    bool hasRxTime = !timeVariable.empty();
+    if (hasRxTime) {
+      variables.push_back(timeVariable);
+    }
+
+    for (const auto& cfUri : cfUris) {
+      vehicles.push_back(std::unique_ptr<vehicle>(new vehicle(cfUri)));
+      vehicle* v = vehicles.back().get();
+      v->cf.requestLogToc();
+      std::function<void(uint32_t, std::vector<double>*, void*)> cb =
+        [v, hasRxTime](uint32_t time_in_ms, std::vector<double>* values, void*) {
+          logRecord record;
+          record.received = benchmarkClock::now();
+          record.time_in_ms = time_in_ms;
+          record.seq = (*values)[0];
+          record.count = (*values)[1];
+          record.rxTime_in_us = hasRxTime ? (*values)[2] : 0;
+          std::unique_lock<std::mutex> lock(v->mutex);
+          v->records.push_back(record);
+        };
+      logBlocks.push_back(std::unique_ptr<LogBlockGeneric>(new LogBlockGeneric(&v->cf, variables, nullptr, cb)));
+      logBlocks.back()->start(logPeriod);
+    }
+
+    // log data only arrives with acks, i.e. keep pinging (on the same radio
+    // as the broadcasts if the URIs share it)
+    for (auto& v : vehicles) {
+      vehicle* ptr = v.get();
+      threads.push_back(std::thread([ptr, &done] {
+        while (!done) {
+          ptr->cf.sendPing();
+        }
+      }));
+    }
+
+    std::chrono::duration<double> settle(std::max(0.2, 3 * logPeriod * 0.01));
+    std::cout << "rate,vehicles,paired,uri,sent,received,loss,samples,latency_min,latency_p50,latency_p99,latency_max" << std::endl;
+    uint32_t seq = 1;
+    for (double rate : rates) {
+      for (size_t numVehicles : vehicleCounts) {
+        for (bool paired : pairings) {
+          size_t packetsPerFrame = std::max<size_t>((numVehicles + 1) / 2, 1);
+          size_t numFrames = std::max<size_t>(rate * duration, 1);
+          uint32_t firstSeq = seq;
+
+          // records before the first frame are the baseline
+          for (auto& v : vehicles) {
+            std::unique_lock<std::mutex> lock(v->mutex);
+            v->records.clear();
+          }
+          std::this_thread::sleep_for(settle);
+          std::vector<size_t> numBaseline;
+          for (auto& v : vehicles) {
+            std::unique_lock<std::mutex> lock(v->mutex);
+            numBaseline.push_back(v->records.size());
+          }
+
+          std::vector<benchmarkClock::time_point> sendTimes;
+          auto start = benchmarkClock::now();
+          for (size_t k = 0; k < numFrames; ++k) {
+            std::this_thread::sleep_until(start + std::chrono::duration_cast<benchmarkClock::duration>(std::chrono::duration<double>(k / rate)));
+            sendTimes.push_back(benchmarkClock::now());
+            cfb.sendPacketDropTests(seq, packetsPerFrame, paired);
+            seq += packetsPerFrame;
+          }
+          std::this_thread::sleep_for(settle);
+
+          for (size_t i = 0; i < vehicles.size(); ++i) {
+            std::vector<logRecord> records;
+            {
+              std::unique_lock<std::mutex> lock(vehicles[i]->mutex);
+              records = vehicles[i]->records;
+            }
+            evaluate(rate, numVehicles, paired, *vehicles[i], records, numBaseline[i],
+              firstSeq, packetsPerFrame, sendTimes, hasRxTime);
+          }
+        }
+      }
+    }
+
+    done = true;
+    for (auto& thread : threads) {
+      thread.join();
+    }
+
+    return 0;
+  }
+  catch(std::exception& e)
+  {
+    done = true;
+    for (auto& thread : threads) {
+      thread.join();
+    }
+    std::cerr << e.what() << std::endl;
+    return 1;
+  }
+}
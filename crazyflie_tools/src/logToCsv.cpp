@@ -0,0 +1,90 @@
+#include <iostream>
+#include <fstream>
+#include <memory>
+
+#include <boost/program_options.hpp>
+#include <crazyflie_cpp/FlightLog.h>
+
+// Converts a binary flight log (as written by FlightLogWriter) to one CSV
+// file per log block.
+int main(int argc, char **argv)
+{
+
+  std::string input;
+  std::string output;
+
+  namespace po = boost::program_options;
+
+  po::options_description desc("Allowed options");
+  desc.add_options()
+    ("help", "produce help message")
+    ("input", po::value<std::string>(&input)->required(), "binary flight log")
+    ("output", po::value<std::string>(&output), "prefix of the CSV files (default: input without extension)")
+  ;
+
+  try
+  {
+    po::variables_map vm;
+    po::store(po::parse_command_line(argc, argv, desc), vm);
+
+    if (vm.count("help")) {
+      std::cout << desc << "\n";
+      return 0;
+    }
+    po::notify(vm);
+  }
+  catch(po::error& e)
+  {
+    std::cerr << e.what() << std::endl << std::endl;
+    std::cerr << desc << std::endl;
+    return 1;
+  }
+
+  if (output.empty()) {
+    output = input.substr(0, input.find_last_of('.'));
+  }
+
+  try
+  {
+    FlightLogReader reader(input);
+
+    std::vector<std::unique_ptr<std::ofstream> > files;
+    for (size_t i = 0; i < reader.blocks().size(); ++i) {
+      std::string fileName = output + "_" + std::to_string(i) + ".csv";
+      files.emplace_back(new std::ofstream(fileName));
+      std::ofstream& file = *files.back();
+      file << "time";
+      for (const auto& variable : reader.blocks()[i].variables) {
+        file << "," << variable;
+      }
+      file << "\n";
+      std::cout << "Block " << i << ": " << fileName << std::endl;
+    }
+
+    FlightLogRecord record;
+    std::vector<double> values;
+    size_t numRecords = 0;
+    while (reader.next(record)) {
+      if (record.block >= files.size()) {
+        std::cerr << "Skipping record of unknown block " << (int)record.block << std::endl;
+        continue;
+      }
+      reader.decode(record, values);
+      std::ofstream& file = *files[record.block];
+      file << record.time_in_ms / 1000.0;
+      for (double value : values) {
+        file << "," << value;
+      }
+      file << "\n";
+      ++numRecords;
+    }
+    std::cout << "Converted " << numRecords << " records." << std::endl;
+
+    return 0;
+  }
+  catch(std::exception& e)
+  {
+    std::cerr << e.what() << std::endl;
+    return 1;
+  }
+}
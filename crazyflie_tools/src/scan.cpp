@@ -1,22 +1,134 @@
 #include <iostream>
+#include <sstream>
+#include <iomanip>
+#include <thread>
+#include <atomic>
+#include <algorithm>
 
 #include <boost/program_options.hpp>
 #include <crazyflie_cpp/Crazyradio.h>
 #include <crazyflie_cpp/CrazyflieUSB.h>
 
+namespace {
+
+const uint8_t numDatarates = 3;
+const uint8_t numChannels = 126;
+
+const char* datarateName(uint8_t datarate)
+{
+  switch(datarate) {
+  case Crazyradio::Datarate_250KPS:
+    return "250K";
+  case Crazyradio::Datarate_1MPS:
+    return "1M";
+  case Crazyradio::Datarate_2MPS:
+    return "2M";
+  }
+  return "";
+}
+
+struct result
+{
+  uint32_t radio;
+  uint8_t datarate;
+  uint8_t channel;
+  // index into the list of addresses
+  size_t address;
+};
+
+// Each radio takes the next (datarate, channel) pair, tunes to it once and
+// pings all addresses there.
+std::vector<result> scan(
+  const std::vector<uint64_t>& addresses,
+  uint32_t numRadios)
+{
+  std::atomic<size_t> next(0);
+  std::vector<std::vector<result> > found(numRadios);
+  std::vector<std::string> errors(numRadios);
+
+  std::vector<std::thread> threads;
+  for (uint32_t r = 0; r < numRadios; ++r) {
+    threads.push_back(std::thread([&, r] {
+      try {
+        Crazyradio radio(r);
+        if (r == 0) {
+          std::cerr << "Found Crazyradio with version " << radio.version() << std::endl;
+        }
+        // with a single address, only the channel changes between pings
+        if (addresses.size() == 1) {
+          radio.setAddress(addresses[0]);
+        }
+        uint8_t lastDatarate = numDatarates;
+        for (size_t i = next++; i < numDatarates * numChannels; i = next++) {
+          uint8_t datarate = i / numChannels;
+          uint8_t channel = i % numChannels;
+          if (datarate != lastDatarate) {
+            radio.setDatarate((Crazyradio::Datarate)datarate);
+            lastDatarate = datarate;
+          }
+          radio.setChannel(channel);
+
+          for (size_t a = 0; a < addresses.size(); ++a) {
+            if (addresses.size() > 1) {
+              radio.setAddress(addresses[a]);
+            }
+            uint8_t test[] = {0xFF};
+            Crazyradio::Ack ack;
+            radio.sendPacket(test, sizeof(test), ack);
+            if (ack.ack) {
+              found[r].push_back({r, datarate, channel, a});
+            }
+          }
+        }
+      }
+      catch(std::exception& e) {
+        errors[r] = e.what();
+      }
+    }));
+  }
+  for (auto& thread : threads) {
+    thread.join();
+  }
+  for (const auto& error : errors) {
+    if (!error.empty()) {
+      throw std::runtime_error(error);
+    }
+  }
+
+  std::vector<result> results;
+  for (const auto& f : found) {
+    results.insert(results.end(), f.begin(), f.end());
+  }
+  std::sort(results.begin(), results.end(), [](const result& a, const result& b) {
+    if (a.datarate != b.datarate) {
+      return a.datarate < b.datarate;
+    }
+    if (a.channel != b.channel) {
+      return a.channel < b.channel;
+    }
+    return a.address < b.address;
+  });
+  return results;
+}
+
+} // namespace
 
 int main(int argc, char **argv)
 {
 
-  std::string addressStr;
+  std::vector<std::string> addressStrs;
   std::string defaultAddressStr("0xE7E7E7E7E7");
+  uint32_t numRadios = 0;
+  std::string format("text");
 
   namespace po = boost::program_options;
 
   po::options_description desc("Allowed options");
   desc.add_options()
     ("help", "produce help message")
-    ("address", po::value<std::string>(&addressStr)->default_value(defaultAddressStr), "device address")
+    ("address", po::value<std::vector<std::string> >(&addressStrs)->multitoken(), "device address(es) (default: 0xE7E7E7E7E7)")
+    ("radios", po::value<uint32_t>(&numRadios), "number of radios to scan with in parallel (default: all)")
+    ("format", po::value<std::string>(&format)->default_value(format), "output format {text, csv, json}")
   ;
 
   try
@@ -29,6 +141,9 @@ int main(int argc, char **argv)
       std::cout << desc << "\n";
       return 0;
     }
+    if (format != "text" && format != "csv" && format != "json") {
+      throw po::invalid_option_value(format);
+    }
   }
   catch(po::error& e)
   {
@@ -37,63 +152,90 @@ int main(int argc, char **argv)
     return 1;
   }
 
+  if (addressStrs.empty()) {
+    addressStrs.push_back(defaultAddressStr);
+  }
+
   try
   {
-    uint32_t numCrazyradios = Crazyradio::numDevices();
-    if (numCrazyradios > 0) {
+    std::vector<uint64_t> addresses;
+    for (const auto& addressStr : addressStrs) {
       uint64_t address;
       std::stringstream sstr;
       sstr << std::hex << addressStr;
       sstr >> address;
+      addresses.push_back(address);
+    }
 
-      Crazyradio radio(0);
-      std::cout << "Found Crazyradio with version " << radio.version() << std::endl;
-      radio.setAddress(address);
-
-      for (uint8_t datarate = 0; datarate < 3; ++datarate) {
-        radio.setDatarate((Crazyradio::Datarate)datarate);
-        for (uint8_t channel = 0; channel <= 125; ++channel) {
-          radio.setChannel(channel);
-
-          uint8_t test[] = {0xFF};
-          Crazyradio::Ack ack;
-          radio.sendPacket(test, sizeof(test), ack);
-          if (ack.ack) {
-            std::cout << "radio://0/" << (uint32_t)channel << "/";
-            switch(datarate) {
-            case Crazyradio::Datarate_250KPS:
-              std::cout << "250K";
-              break;
-            case Crazyradio::Datarate_1MPS:
-              std::cout << "1M";
-              break;
-            case Crazyradio::Datarate_2MPS:
-              std::cout << "2M";
-              break;
-            }
-
-            if (defaultAddressStr != addressStr) {
-              std::cout << "/" << addressStr.substr(2);
-            }
-            std::cout << std::endl;
-          }
-        }
-      }
+    uint32_t numCrazyradios = Crazyradio::numDevices();
+    if (numRadios == 0 || numRadios > numCrazyradios) {
+      numRadios = numCrazyradios;
+    }
+    std::vector<result> results;
+    if (numRadios > 0) {
+      results = scan(addresses, numRadios);
     } else {
-      std::cout << "No Crazyradio found." << std::endl;
+      std::cerr << "No Crazyradio found." << std::endl;
     }
 
+    auto uri = [&](const result& r) {
+      std::stringstream sstr;
+      sstr << "radio://" << r.radio << "/" << (uint32_t)r.channel << "/" << datarateName(r.datarate);
+      if (addresses[r.address] != 0xE7E7E7E7E7) {
+        sstr << "/" << std::uppercase << std::hex << addresses[r.address];
+      }
+      return sstr.str();
+    };
+    auto addressHex = [&](const result& r) {
+      std::stringstream sstr;
+      sstr << std::uppercase << std::hex << std::setw(10) << std::setfill('0') << addresses[r.address];
+      return sstr.str();
+    };
+
     uint32_t numCFoverUSB = CrazyflieUSB::numDevices();
-    if (numCFoverUSB > 0) {
-      CrazyflieUSB cfusb(0);
-      std::cout << "Found Crazyflie via USB with version " << cfusb.version() << std::endl;
 
+    if (format == "csv") {
+      std::cout << "uri,radio,channel,datarate,address" << std::endl;
+      for (const auto& r : results) {
+        std::cout << uri(r) << "," << r.radio << "," << (uint32_t)r.channel << ","
+                  << datarateName(r.datarate) << "," << addressHex(r) << std::endl;
+      }
       for (uint32_t i = 0; i < numCFoverUSB; ++i) {
-        std::cout << "usb://" << i << std::endl;
+        std::cout << "usb://" << i << ",,,," << std::endl;
       }
-
+    } else if (format == "json") {
+      std::cout << "[";
+      bool first = true;
+      for (const auto& r : results) {
+        std::cout << (first ? "" : ",") << std::endl
+                  << "  {\"uri\": \"" << uri(r) << "\", \"radio\": " << r.radio
+                  << ", \"channel\": " << (uint32_t)r.channel
+                  << ", \"datarate\": \"" << datarateName(r.datarate)
+                  << "\", \"address\": \"" << addressHex(r) << "\"}";
+        first = false;
+      }
+      for (uint32_t i = 0; i < numCFoverUSB; ++i) {
+        std::cout << (first ? "" : ",") << std::endl
+                  << "  {\"uri\": \"usb://" << i << "\"}";
+        first = false;
+      }
+      std::cout << std::endl << "]" << std::endl;
     } else {
-      std::cout << "No Crazyflie over USB found." << std::endl;
+      for (const auto& r : results) {
+        std::cout << uri(r) << std::endl;
+      }
+
+      if (numCFoverUSB > 0) {
+        CrazyflieUSB cfusb(0);
+        std::cout << "Found Crazyflie via USB with version " << cfusb.version() << std::endl;
+
+        for (uint32_t i = 0; i < numCFoverUSB; ++i) {
+          std::cout << "usb://" << i << std::endl;
+        }
+
+      } else {
+        std::cout << "No Crazyflie over USB found." << std::endl;
+      }
     }
     return 0;
   }
@@ -0,0 +1,282 @@
+#include <iostream>
+#include <sstream>
+#include <thread>
+#include <mutex>
+#include <chrono>
+#include <atomic>
+#include <algorithm>
+
+#include <boost/program_options.hpp>
+#include <crazyflie_cpp/Crazyflie.h>
+
+// Measures the performance of the driver's communication (connect, TOC
+// download, params, logging, trajectory upload) and how fast an emergency
+// aborts the requests in progress. Meant for simulated
+// Crazyflies (sim://id/latency_ms/loss_percent), where it doesn't depend on
+// hardware, but it works for any URI.
+// Prints CSV lines: uri,benchmark,value,unit
+
+namespace {
+
+typedef std::chrono::steady_clock benchmarkClock;
+
+double secondsSince(
+  benchmarkClock::time_point start)
+{
+  std::chrono::duration<double> elapsed = benchmarkClock::now() - start;
+  return elapsed.count();
+}
+
+std::mutex g_outputMutex;
+
+void report(
+  const std::string& uri,
+  const std::string& benchmark,
+  double value,
+  const std::string& unit)
+{
+  std::unique_lock<std::mutex> lock(g_outputMutex);
+  std::cout << uri << "," << benchmark << "," << value << "," << unit << std::endl;
+}
+
+void runBenchmarks(
+  const std::string& uri,
+  size_t batchWindow,
+  float batchRetransmitTimeout,
+  double logDuration,
+  size_t numTrajectoryPieces)
+{
+  auto configure = [&](Crazyflie& cf) {
+    cf.setBatchWindow(batchWindow);
+    cf.setBatchRetransmitTimeout(batchRetransmitTimeout);
+  };
+
+  // connect, without and with TOC cache
+  auto start = benchmarkClock::now();
+  Crazyflie cf(uri);
+  configure(cf);
+  report(uri, "open", secondsSince(start), "s");
+
+  start = benchmarkClock::now();
+  cf.requestLogToc(/*forceNoCache*/ true);
+  double duration = secondsSince(start);
+  size_t numLogVariables = std::distance(cf.logVariablesBegin(), cf.logVariablesEnd());
+  report(uri, "log_toc", duration, "s");
+  report(uri, "log_toc_rate", numLogVariables / duration, "entries/s");
+
+  start = benchmarkClock::now();
+  cf.requestParamToc(/*forceNoCache*/ true);
+  duration = secondsSince(start);
+  size_t numParams = std::distance(cf.paramsBegin(), cf.paramsEnd());
+  report(uri, "param_toc", duration, "s");
+  report(uri, "param_toc_rate", numParams / duration, "entries/s");
+
+  {
+    start = benchmarkClock::now();
+    Crazyflie cached(uri);
+    configure(cached);
+    cached.requestLogToc();
+    cached.requestParamToc();
+    report(uri, "connect_cached", secondsSince(start), "s");
+  }
+
+  // read all params in one batch (writing them would change a real CF)
+  std::vector<uint8_t> paramIds;
+  for (auto iter = cf.paramsBegin(); iter != cf.paramsEnd(); ++iter) {
+    paramIds.push_back(iter->id);
+  }
+  start = benchmarkClock::now();
+  cf.requestParams(paramIds);
+  duration = secondsSince(start);
+  report(uri, "param_read_rate", paramIds.size() / duration, "params/s");
+
+  // log throughput: one block with as many floats as fit, every 10 ms
+  std::vector<std::string> variables;
+  for (auto iter = cf.logVariablesBegin(); iter != cf.logVariablesEnd() && variables.size() < 6; ++iter) {
+    if (iter->type == Crazyflie::LogTypeFloat) {
+      variables.push_back(iter->group + "." + iter->name);
+    }
+  }
+  if (!variables.empty() && logDuration > 0) {
+    size_t numRecords = 0;
+    std::function<void(uint32_t, std::vector<double>*, void*)> cb =
+      [&numRecords](uint32_t, std::vector<double>*, void*) { ++numRecords; };
+    LogBlockGeneric logBlock(&cf, variables, nullptr, cb);
+    logBlock.start(1); // 10 ms
+    start = benchmarkClock::now();
+    size_t numPings = 0;
+    while (secondsSince(start) < logDuration) {
+      cf.sendPing();
+      ++numPings;
+    }
+    duration = secondsSince(start);
+    logBlock.stop();
+    report(uri, "log_rate", numRecords / duration, "records/s");
+    report(uri, "log_expected_rate", 100, "records/s");
+    report(uri, "ping_rate", numPings / duration, "packets/s");
+  }
+
+  // trajectory upload
+  if (numTrajectoryPieces > 0) {
+    std::vector<Crazyflie::TrajectoryPiece> pieces(numTrajectoryPieces);
+    for (size_t i = 0; i < pieces.size(); ++i) {
+      pieces[i].duration = 1.0;
+      for (size_t j = 0; j < 8; ++j) {
+        pieces[i].poly_x[j] = i + j;
+        pieces[i].poly_y[j] = i - j;
+        pieces[i].poly_z[j] = 1.0;
+        pieces[i].poly_yaw[j] = 0;
+      }
+    }
+    start = benchmarkClock::now();
+    cf.trajectoryReset();
+    cf.trajectoryAdd(pieces);
+    duration = secondsSince(start);
+    report(uri, "trajectory_upload", duration, "s");
+    report(uri, "trajectory_upload_rate", numTrajectoryPieces / duration, "pieces/s");
+  }
+
+  // link of cf over all of the above
+  Crazyflie::linkStatistics link;
+  cf.readLinkStatistics(link);
+  report(uri, "link_sent", link.numSent, "packets");
+  report(uri, "link_ack_ratio", link.numAcked / std::max<double>(link.numSent, 1), "");
+  report(uri, "link_ack_time_avg", link.transferTime * 1e-9 / std::max<double>(link.numTransfers, 1), "s");
+  report(uri, "link_ack_time_max", link.maxTransferTime * 1e-9, "s");
+  report(uri, "link_wait_avg", link.waitTime * 1e-9 / std::max<double>(link.numTransfers, 1), "s");
+}
+
+// Downloads the log TOC over and over on all CFs and aborts that
+// (Crazyflie::abortRequests, as done for an emergency) numTests times.
+// The latency is the time from the abort until the request threw.
+void runEmergencyBenchmark(
+  const std::vector<std::string>& uris,
+  size_t numTests)
+{
+  std::vector<std::unique_ptr<Crazyflie> > cfs;
+  for (const auto& uri : uris) {
+    cfs.push_back(std::unique_ptr<Crazyflie>(new Crazyflie(uri)));
+  }
+  std::vector<double> maxLatency(uris.size(), 0);
+  std::vector<double> sumLatency(uris.size(), 0);
+
+  for (size_t test = 0; test < numTests; ++test) {
+    std::atomic<bool> stop(false);
+    benchmarkClock::time_point abortTime;
+    std::vector<benchmarkClock::time_point> stopped(uris.size());
+    std::vector<std::thread> threads;
+    for (size_t i = 0; i < cfs.size(); ++i) {
+      threads.push_back(std::thread([&, i] {
+        try {
+          while (!stop) {
+            cfs[i]->requestLogToc(/*forceNoCache*/ true);
+          }
+        }
+        catch(std::runtime_error&) {
+        }
+        stopped[i] = benchmarkClock::now();
+      }));
+    }
+    // abort at different points of the downloads
+    std::this_thread::sleep_for(std::chrono::milliseconds(10 + 7 * test % 20));
+    abortTime = benchmarkClock::now();
+    stop = true;
+    Crazyflie::abortRequests();
+    for (auto& thread : threads) {
+      thread.join();
+    }
+    for (size_t i = 0; i < uris.size(); ++i) {
+      std::chrono::duration<double> latency = stopped[i] - abortTime;
+      maxLatency[i] = std::max(maxLatency[i], latency.count());
+      sumLatency[i] += latency.count();
+    }
+  }
+
+  for (size_t i = 0; i < uris.size(); ++i) {
+    report(uris[i], "emergency_abort_max", maxLatency[i], "s");
+    report(uris[i], "emergency_abort_avg", sumLatency[i] / numTests, "s");
+  }
+}
+
+} // namespace
+
+int main(int argc, char **argv)
+{
+
+  std::vector<std::string> uris;
+  size_t batchWindow = 8;
+  float batchRetransmitTimeout = 0.01;
+  double logDuration = 2.0;
+  size_t numTrajectoryPieces = 30;
+  size_t numEmergencyTests = 10;
+  std::string tocCacheDir;
+
+  namespace po = boost::program_options;
+
+  po::options_description desc("Allowed options");
+  desc.add_options()
+    ("help", "produce help message")
+    ("uri", po::value<std::vector<std::string> >(&uris)->multitoken(), "Crazyflies to benchmark in parallel (default: sim://0)")
+    ("batch-window", po::value<size_t>(&batchWindow)->default_value(batchWindow), "requests in flight")
+    ("batch-retransmit-timeout", po::value<float>(&batchRetransmitTimeout)->default_value(batchRetransmitTimeout), "s before a request is resent")
+    ("log-duration", po::value<double>(&logDuration)->default_value(logDuration), "s of logging (0: skip)")
+    ("trajectory-pieces", po::value<size_t>(&numTrajectoryPieces)->default_value(numTrajectoryPieces), "pieces to upload (0: skip)")
+    ("emergency-tests", po::value<size_t>(&numEmergencyTests)->default_value(numEmergencyTests), "aborts to measure (0: skip)")
+    ("toc-cache-dir", po::value<std::string>(&tocCacheDir), "directory of the TOC cache (default: current directory)")
+  ;
+
+  try
+  {
+    po::variables_map vm;
+    po::store(po::parse_command_line(argc, argv, desc), vm);
+    po::notify(vm);
+
+    if (vm.count("help")) {
+      std::cout << desc << "\n";
+      return 0;
+    }
+  }
+  catch(po::error& e)
+  {
+    std::cerr << e.what() << std::endl << std::endl;
+    std::cerr << desc << std::endl;
+    return 1;
+  }
+
+  if (uris.empty()) {
+    uris.push_back("sim://0");
+  }
+  Crazyflie::setTocCacheDirectory(tocCacheDir);
+
+  std::cout << "uri,benchmark,value,unit" << std::endl;
+  bool success = true;
+  std::vector<std::thread> threads;
+  for (const auto& uri : uris) {
+    threads.push_back(std::thread([&, uri] {
+      try {
+        runBenchmarks(uri, batchWindow, batchRetransmitTimeout, logDuration, numTrajectoryPieces);
+      }
+      catch(std::exception& e) {
+        std::unique_lock<std::mutex> lock(g_outputMutex);
+        std::cerr << uri << ": " << e.what() << std::endl;
+        success = false;
+      }
+    }));
+  }
+  for (auto& thread : threads) {
+    thread.join();
+  }
+
+  // aborts affect the requests of all threads, i.e. this runs separately
+  if (numEmergencyTests > 0) {
+    try {
+      runEmergencyBenchmark(uris, numEmergencyTests);
+    }
+    catch(std::exception& e) {
+      std::cerr << "emergency: " << e.what() << std::endl;
+      success = false;
+    }
+  }
+
+  return success ? 0 : 1;
+}